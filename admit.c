@@ -0,0 +1,268 @@
+/*
+ * ----------------------------------------------------------
+ * admit.c - Admission control, so that under a spike the
+ *           proxy keeps serving what it can at full speed and
+ *           turns the rest away at once instead of letting
+ *           every client's latency collapse.
+ *
+ * - at most --max-conns client connections are open at once;
+ *   past that new ones get a 503 and are closed as soon as
+ *   they are accepted
+ * - with --client-conns, one address may hold only that many
+ *   of them; with --client-rate, its requests draw on a token
+ *   bucket of --client-burst tokens refilled at that many a
+ *   second, and one it cannot pay for gets a 429
+ * - a connection that waited in a worker queue for longer
+ *   than --queue-target is answered 503 instead of being
+ *   served: by then its client has likely given up, and
+ *   serving it would only make the next one late too. A
+ *   keep-alive connection queued again for its next request
+ *   is timed from then
+ * - refusals send a fixed response with Retry-After, without
+ *   blocking, and close the connection
+ * - clients live in a fixed table split into ADMITSTRIPES,
+ *   each under its own lock; an address whose stripe is full
+ *   of busy clients is let through untracked (and counted),
+ *   and --max-conns still bounds it
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "metrics.h"
+#include "admit.h"
+
+long admitMax;
+long admitActive;
+int admitClientMax;
+double admitRate;			/* tokens a second; 0 for no rate limit */
+double admitBurst;
+long admitTarget;			/* ns; 0 for no queue target */
+
+admitFd *admitFds;
+int admitNumFds;
+admitClient admitClients[ADMITSTRIPES][ADMITSTRIPESIZE];
+pthread_mutex_t admitLocks[ADMITSTRIPES];
+
+/* Counters for the status page. */
+long admitAdmitted;
+long admitRefused[ADMIT_LATE + 1];
+long admitUntracked;
+
+char *admitResponses[ADMIT_LATE + 1] = {
+	[ADMIT_BUSY] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+	[ADMIT_CLIENT_CONNS] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+	[ADMIT_CLIENT_RATE] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+	[ADMIT_LATE] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+};
+
+int  admitStripe(uint32_t ip);
+admitClient *admitFind(uint32_t ip, long now);
+int  admitIdle(admitClient *e, long now);
+void admitRefill(admitClient *e, long now);
+
+/* Sets the limits; 0 turns any of them off. */
+void admitInit(long maxConns, int clientConns, double clientRate, double clientBurst, long targetMs){
+	struct rlimit rl;
+	int i;
+
+	admitMax = maxConns;
+	admitClientMax = clientConns;
+	admitRate = clientRate;
+	admitBurst = 1 > clientBurst ? 1 : clientBurst;
+	admitTarget = targetMs * 1000000;
+
+	/* Descriptors are small and dense, so what is known of a connection is kept by its number. */
+	admitNumFds = ADMITMAXFDS;
+	if (0 == getrlimit(RLIMIT_NOFILE, &rl) && RLIM_INFINITY != rl.rlim_cur && rl.rlim_cur < ADMITMAXFDS){
+		admitNumFds = rl.rlim_cur;
+	}
+	admitFds = Calloc(admitNumFds, sizeof(admitFd));
+	for (i = 0; i < ADMITSTRIPES; i++){
+		pthread_mutex_init(&admitLocks[i], NULL);
+	}
+}
+
+/* Admits a just-accepted connection from addr, or says why not. An admitted one must be given to admitDone when it closes. */
+int admitConn(int fd, struct sockaddr_in *addr){
+	uint32_t ip = addr->sin_addr.s_addr;
+	int stripe = admitStripe(ip), counted = FALSE;
+	long now = metricNow();
+	admitClient *e;
+
+	if (admitMax < __atomic_add_fetch(&admitActive, 1, __ATOMIC_RELAXED) && 0 < admitMax){
+		__atomic_sub_fetch(&admitActive, 1, __ATOMIC_RELAXED);
+		return ADMIT_BUSY;
+	}
+	if (0 < admitClientMax && fd < admitNumFds){
+		pthread_mutex_lock(&admitLocks[stripe]);
+		if (NULL == (e = admitFind(ip, now))){
+			__atomic_add_fetch(&admitUntracked, 1, __ATOMIC_RELAXED);
+		}
+		else if (admitClientMax <= e->conns){
+			pthread_mutex_unlock(&admitLocks[stripe]);
+			__atomic_sub_fetch(&admitActive, 1, __ATOMIC_RELAXED);
+			return ADMIT_CLIENT_CONNS;
+		}
+		else{
+			e->conns++;
+			counted = TRUE;
+		}
+		pthread_mutex_unlock(&admitLocks[stripe]);
+	}
+	if (fd < admitNumFds){
+		admitFds[fd].accepted = now;
+		admitFds[fd].ip = ip;
+		admitFds[fd].counted = counted;
+	}
+	__atomic_add_fetch(&admitAdmitted, 1, __ATOMIC_RELAXED);
+	return ADMIT_OK;
+}
+
+/* Checks a queued connection as a worker picks it up: ADMIT_LATE if it waited past the target. */
+int admitStart(int fd){
+	if (0 < admitTarget && fd < admitNumFds && 0 != admitFds[fd].accepted && admitTarget < metricNow() - admitFds[fd].accepted){
+		return ADMIT_LATE;
+	}
+	return ADMIT_OK;
+}
+
+/* Restarts a parked connection's wait for a worker, as its next request sends it back to the queues. */
+void admitRequeue(int fd){
+	if (fd < admitNumFds && 0 != admitFds[fd].accepted){
+		admitFds[fd].accepted = metricNow();
+	}
+}
+
+/* Charges a request on fd to its client's token bucket: ADMIT_CLIENT_RATE if the bucket is empty. */
+int admitRequest(int fd){
+	uint32_t ip;
+	int stripe, reason = ADMIT_OK;
+	long now;
+	admitClient *e;
+
+	if (0 >= admitRate || fd >= admitNumFds || 0 == (ip = admitFds[fd].ip)){
+		return ADMIT_OK;
+	}
+	now = metricNow();
+	stripe = admitStripe(ip);
+	pthread_mutex_lock(&admitLocks[stripe]);
+	if (NULL == (e = admitFind(ip, now))){
+		__atomic_add_fetch(&admitUntracked, 1, __ATOMIC_RELAXED);
+	}
+	else{
+		admitRefill(e, now);
+		if (1 <= e->tokens){
+			e->tokens -= 1;
+		}
+		else{
+			reason = ADMIT_CLIENT_RATE;
+		}
+	}
+	pthread_mutex_unlock(&admitLocks[stripe]);
+	return reason;
+}
+
+/* Tells fd's client why it is turned away, without waiting on it; the caller closes it. */
+void admitRefuse(int fd, int reason){
+	char buf[MAXLINE];
+	char *response = admitResponses[reason];
+	int i;
+
+	__atomic_add_fetch(&admitRefused[reason], 1, __ATOMIC_RELAXED);
+	/* Read what has come of the request so that closing does not reset the connection under the response. */
+	for (i = 0; i < 4 && 0 < recv(fd, buf, sizeof(buf), MSG_DONTWAIT); i++)
+		;
+	send(fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(fd, SHUT_WR);
+}
+
+/* Gives back what an admitted connection held, as it closes. */
+void admitDone(int fd){
+	uint32_t ip;
+	int stripe;
+	admitClient *e;
+
+	__atomic_sub_fetch(&admitActive, 1, __ATOMIC_RELAXED);
+	if (fd >= admitNumFds){
+		return;
+	}
+	if (admitFds[fd].counted){
+		ip = admitFds[fd].ip;
+		stripe = admitStripe(ip);
+		pthread_mutex_lock(&admitLocks[stripe]);
+		/* An entry with connections open is never given to another address, so it is still there. */
+		if (NULL != (e = admitFind(ip, metricNow())) && 0 < e->conns){
+			e->conns--;
+		}
+		pthread_mutex_unlock(&admitLocks[stripe]);
+	}
+	admitFds[fd].accepted = 0;
+	admitFds[fd].ip = 0;
+	admitFds[fd].counted = FALSE;
+}
+
+/* The stripe, and lock, ip belongs to. */
+int admitStripe(uint32_t ip){
+	return (ip * 2654435761u >> 16) % ADMITSTRIPES;
+}
+
+/* The entry for ip, taking over a free or idle one for it if it has none; NULL if its stripe is too crowded. Called with ip's stripe locked. */
+admitClient *admitFind(uint32_t ip, long now){
+	unsigned int h = ip * 2654435761u;
+	admitClient *row = admitClients[admitStripe(ip)], *e, *spare = NULL;
+	int i;
+
+	for (i = 0; i < ADMITPROBES; i++){
+		e = &row[(h + i) % ADMITSTRIPESIZE];
+		if (ip == e->ip){
+			return e;
+		}
+		if (NULL == spare && (0 == e->ip || admitIdle(e, now))){
+			spare = e;
+		}
+	}
+	if (NULL != spare){
+		spare->ip = ip;
+		spare->conns = 0;
+		spare->tokens = admitBurst;
+		spare->stamp = now;
+	}
+	return spare;
+}
+
+/* TRUE if e is no different from a new entry: no connections open and a full bucket. */
+int admitIdle(admitClient *e, long now){
+	return 0 == e->conns && (0 >= admitRate || admitBurst <= e->tokens + (now - e->stamp) * admitRate / 1e9);
+}
+
+/* Adds the tokens e has earned since it was last topped up. */
+void admitRefill(admitClient *e, long now){
+	e->tokens += (now - e->stamp) * admitRate / 1e9;
+	if (e->tokens > admitBurst){
+		e->tokens = admitBurst;
+	}
+	e->stamp = now;
+}
+
+/* Writes "name value" lines for the status page. */
+int admitStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"admit_active %ld\n"
+		"admit_admitted %ld\n"
+		"admit_refused_busy %ld\n"
+		"admit_refused_client_conns %ld\n"
+		"admit_refused_client_rate %ld\n"
+		"admit_shed_late %ld\n"
+		"admit_untracked %ld\n",
+		__atomic_load_n(&admitActive, __ATOMIC_RELAXED),
+		__atomic_load_n(&admitAdmitted, __ATOMIC_RELAXED),
+		__atomic_load_n(&admitRefused[ADMIT_BUSY], __ATOMIC_RELAXED),
+		__atomic_load_n(&admitRefused[ADMIT_CLIENT_CONNS], __ATOMIC_RELAXED),
+		__atomic_load_n(&admitRefused[ADMIT_CLIENT_RATE], __ATOMIC_RELAXED),
+		__atomic_load_n(&admitRefused[ADMIT_LATE], __ATOMIC_RELAXED),
+		__atomic_load_n(&admitUntracked, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,40 @@
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include "csapp.h"
+
+#define ADMITCONNS 8192		/* default --max-conns */
+#define ADMITTARGET 1000		/* default --queue-target, ms */
+#define ADMITSTRIPES 64			/* locks over the client table */
+#define ADMITSTRIPESIZE 256		/* clients tracked per stripe */
+#define ADMITPROBES 8			/* entries looked at for a client before giving up on tracking it */
+#define ADMITMAXFDS (1 << 20)	/* most descriptors admission is tracked for */
+
+/* What admission decided; anything but ADMIT_OK is refused with admitRefuse. */
+enum { ADMIT_OK, ADMIT_BUSY, ADMIT_CLIENT_CONNS, ADMIT_CLIENT_RATE, ADMIT_LATE };
+
+/* One client address: its open connections and its token bucket. */
+typedef struct admitClient{
+	uint32_t ip;		/* network order; 0 for a free entry */
+	int conns;
+	double tokens;
+	long stamp;			/* ns when tokens was last topped up */
+} admitClient;
+
+/* What is known about an admitted connection, by descriptor. */
+typedef struct admitFd{
+	long accepted;		/* ns it was accepted, or last queued again after waiting idle; 0 if the descriptor was not admitted */
+	uint32_t ip;
+	int counted;		/* it holds one of its client's connections */
+} admitFd;
+
+void admitInit(long maxConns, int clientConns, double clientRate, double clientBurst, long targetMs);
+int  admitConn(int fd, struct sockaddr_in *addr);
+int  admitStart(int fd);
+void admitRequeue(int fd);
+int  admitRequest(int fd);
+void admitRefuse(int fd, int reason);
+void admitDone(int fd);
+int  admitStats(char *buf, size_t len);
+
+#endif /* __ADMIT_H__ */
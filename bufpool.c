@@ -0,0 +1,116 @@
+/*
+ * ----------------------------------------------------------
+ * bufpool.c - Shared pool of BUFPOOLSIZE I/O buffers, so a
+ *             connection holds one only while it has data in
+ *             flight rather than for as long as it is open.
+ *
+ * - a connection waiting for its next request holds none;
+ *   the threaded front end takes its rio_t and scratch
+ *   lines from here once bytes arrive, and the event loops
+ *   their head and relay buffers
+ * - freed buffers are kept for reuse, already faulted in,
+ *   on BUFPOOLSTRIPES free lists under their own locks; a
+ *   thread sticks to one stripe, so threads seldom meet on
+ *   a lock
+ * - buffers are mapped on their own rather than malloc'd,
+ *   and a stripe keeps at most BUFPOOLKEEP, so what a burst
+ *   leaves behind goes back to the kernel instead of being
+ *   stranded in malloc's per-thread arenas
+ * - buffers taken, in use and kept are counted for the
+ *   status page
+ * ----------------------------------------------------------
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "bufpool.h"
+
+/* One stripe's free buffers, chained through their first bytes. */
+typedef struct bufStripe{
+	pthread_mutex_t lock;
+	void *free;
+	int numFree;
+} __attribute__((aligned(64))) bufStripe;
+
+bufStripe bufStripes[BUFPOOLSTRIPES];
+__thread int bufMine = -1;		/* the calling thread's stripe */
+int bufNext;
+
+/* Counters for the status page. */
+long bufTaken;
+long bufInUse;
+long bufMade;
+
+int bufStripeOf();
+
+/* Readies the stripes. */
+void bufPoolInit(){
+	int i;
+
+	for (i = 0; i < BUFPOOLSTRIPES; i++){
+		pthread_mutex_init(&bufStripes[i].lock, NULL);
+	}
+}
+
+/* A BUFPOOLSIZE buffer, from a free list if one has any, else newly mapped; NULL if there is no memory. */
+char *bufGet(){
+	bufStripe *s = &bufStripes[bufStripeOf()];
+	char *buf;
+
+	pthread_mutex_lock(&s->lock);
+	if (NULL != (buf = s->free)){
+		s->free = *(void **)buf;
+		s->numFree--;
+	}
+	pthread_mutex_unlock(&s->lock);
+	if (NULL == buf){
+		if (MAP_FAILED == (buf = mmap(NULL, BUFPOOLSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))){
+			return NULL;
+		}
+		__atomic_add_fetch(&bufMade, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&bufTaken, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bufInUse, 1, __ATOMIC_RELAXED);
+	return buf;
+}
+
+/* Gives back a buffer from bufGet; NULL is ignored. */
+void bufPut(char *buf){
+	bufStripe *s = &bufStripes[bufStripeOf()];
+
+	if (NULL == buf){
+		return;
+	}
+	__atomic_sub_fetch(&bufInUse, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&s->lock);
+	if (BUFPOOLKEEP > s->numFree){
+		*(void **)buf = s->free;
+		s->free = buf;
+		s->numFree++;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&s->lock);
+	if (NULL != buf){
+		munmap(buf, BUFPOOLSIZE);
+		__atomic_sub_fetch(&bufMade, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* The calling thread's stripe, dealt round robin on its first call. */
+int bufStripeOf(){
+	if (0 > bufMine){
+		bufMine = __atomic_fetch_add(&bufNext, 1, __ATOMIC_RELAXED) % BUFPOOLSTRIPES;
+	}
+	return bufMine;
+}
+
+/* Writes "name value" lines for the status page. */
+int bufStats(char *buf, size_t len){
+	long made = __atomic_load_n(&bufMade, __ATOMIC_RELAXED), inUse = __atomic_load_n(&bufInUse, __ATOMIC_RELAXED);
+
+	return snprintf(buf, len,
+		"bufpool_taken %ld\n"
+		"bufpool_in_use %ld\n"
+		"bufpool_kept %ld\n",
+		__atomic_load_n(&bufTaken, __ATOMIC_RELAXED), inUse, made - inUse);
+}
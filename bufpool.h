@@ -0,0 +1,15 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include "csapp.h"
+
+#define BUFPOOLSIZE (4 * MAXLINE)	/* bytes per buffer: a request's scratch lines, a rio_t or a relay's worth */
+#define BUFPOOLSTRIPES 16			/* free lists, each under its own lock */
+#define BUFPOOLKEEP 32				/* free buffers kept per stripe; more are unmapped */
+
+void  bufPoolInit();
+char *bufGet();
+void  bufPut(char *buf);
+int   bufStats(char *buf, size_t len);
+
+#endif /* __BUFPOOL_H__ */
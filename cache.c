@@ -0,0 +1,802 @@
+/*
+ * ----------------------------------------------------------
+ * cache.c - Sharded object cache keyed by url.
+ *
+ * - the url's FNV-1a hash picks one of up to CACHESHARDS
+ *   shards, as many as can each hold the largest object and
+ *   have SHARDMINLINES lines; each has its own rwlock, lines,
+ *   buckets and an equal share of the byte budget, so misses
+ *   on different shards never contend
+ * - the budget, line count and largest object are set at
+ *   startup; MAXCACHE, NUMLINES and MAXOBJ are the defaults
+ * - within a shard, lines are chained by index into hash
+ *   buckets and into the eviction policy's queues, so
+ *   lookup, insert and evict are O(1); see policy.c
+ * - a hit only takes the shard's read lock (unless the
+ *   policy is strict LRU, or the cache is shared between
+ *   processes and has only a mutex) and tells the policy;
+ *   with TinyLFU admission every lookup is also counted,
+ *   and a miss only displaces a line asked for less often
+ * - objects are immutable and reference counted: a hit pins
+ *   its object and sends it with no lock held, eviction just
+ *   unlinks it, and whoever drops the last reference hands
+ *   its chunk back
+ * - objects are written straight into chunks of size-classed
+ *   slabs (see slab.c), so inserting allocates nothing and
+ *   memory stays within the budget; eviction makes room in
+ *   the object's own size class, or takes whole slabs from
+ *   the class holding the most when its class has none
+ * - lines and slabs live in one arena; given a cache file
+ *   the arena is a shared mapping of it, so a restarted
+ *   proxy reattaches to the objects it had instead of
+ *   starting cold
+ * - a cache shared between worker processes (--procs) is set
+ *   up before they are forked: the arena is a memfd (or the
+ *   cache file) and the shards, buckets, slabs and policy
+ *   state are shared mappings too, so every worker sees them
+ *   at the same address. Shards are then locked with robust
+ *   process-shared mutexes; the next worker to lock a shard
+ *   whose holder died rebuilds it from its lines, the same
+ *   way a restart does
+ * - each worker counts the references it holds, and the line
+ *   it is filling, per line in shared memory; when one dies
+ *   the supervisor drops its references and frees what it
+ *   was filling (cacheReap), so nothing stays pinned for good
+ * - a chunk is only written while its line is not linked, and
+ *   the line is marked linked last; reattaching trusts only
+ *   linked lines, and checks each one's checksum on its
+ *   first hit, dropping it if the chunk is torn
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "policy.h"
+#include "slab.h"
+
+cacheLine *cache;
+cacheShard *shards;
+int numShards;
+int linesPerShard;
+long cacheMaxObject = MAXOBJ;
+cachePolicy *policy;
+int admission;
+int cacheShared;		/* the cache is shared with other processes */
+int cacheWorker = -1;	/* this process's index among them, -1 in the supervisor or unshared */
+int *cachePins;			/* per worker, per line: references it holds, counting the one on a line it fills */
+int cacheWorkers;
+pthread_mutex_t cacheRecoverLock = PTHREAD_MUTEX_INITIALIZER;	/* restoring uses slab.c's one claim map */
+
+/* Counters for the status page. */
+long cacheRestored;
+long cacheTorn;
+long cacheHits;
+long cacheMisses;
+long cacheRejected;
+long cacheSlabMoves;
+long cacheEvictions;
+long cacheRecovered;
+
+cacheShard *shardOf(unsigned long hash);
+unsigned long cacheSum(cacheObj *obj);
+int  cacheAttach(char *map, cacheFileHeader *want);
+void cacheRestore(cacheShard *sp, int s, int live);
+void cacheRecover(cacheShard *sp);
+cacheObj *cacheCheck(cacheShard *sp, char *url, unsigned long hash);
+int  cacheVictim(cacheShard *sp, int cls, int *wholeSlab);
+void cacheEvictSlabs(cacheShard *sp, int slab, int need);
+int  cacheFind(cacheShard *sp, char *url, unsigned long hash);
+int  cacheVacancy(cacheShard *sp);
+void cacheLineFree(cacheShard *sp, int index, int evicted);
+void cacheLineRecycle(cacheShard *sp, int index);
+void cacheAlloc(cacheShard *sp, int index, unsigned long hash);
+void cachePin(int index, int delta);
+int  cachePinned(int index);
+void lockShardR(cacheShard *sp);
+void lockShardW(cacheShard *sp);
+void unlockShard(cacheShard *sp);
+
+/* Initializes a cache of maxBytes in maxLines lines, split into as many shards as can each hold the largest object, in an arena mapped from path if given. If procs, that many worker processes forked afterwards all use it. */
+void initCache(char *path, size_t maxBytes, int maxLines, long maxObject, cachePolicy *evictPolicy, int tinyLfu, int procs){
+	cacheFileHeader want;
+	pthread_mutexattr_t attr;
+	unsigned long nbuckets = 1;
+	size_t linesOff, slabsOff, mapSize, slabSize, largest;
+	int i, s, perShard, slabsPerShard, fd = -1, restored = FALSE;
+	char *map;
+	struct stat st;
+
+	cacheMaxObject = maxObject;
+	policy = evictPolicy;
+	admission = tinyLfu;
+	cacheShared = 0 < procs;
+
+	/* Every shard can hold the largest cacheable response with its head and url, and enough lines that a few hot urls do not crowd each other out, in slabs small enough that it has several; the budget is a whole number of them. */
+	largest = sizeof(cacheObj) + maxObject + MAXBUF + MAXLINE;
+	numShards = 1;
+	while (2 * numShards <= CACHESHARDS && largest <= maxBytes / (2 * numShards) && 2 * numShards * SHARDMINLINES <= maxLines){
+		numShards *= 2;
+	}
+	slabSize = slabSizeFor(largest, maxBytes / numShards);
+	slabsPerShard = maxBytes / numShards / slabSize;
+	if (slabsPerShard < (int)((largest + slabSize - 1) / slabSize)){
+		slabsPerShard = (largest + slabSize - 1) / slabSize;
+	}
+	perShard = maxLines / numShards ? maxLines / numShards : 1;
+	linesPerShard = 2 * perShard;
+	while (nbuckets < 2 * (unsigned long)perShard){
+		nbuckets <<= 1;
+	}
+
+	/* Header page, then the lines, then the slabs, page aligned. */
+	linesOff = 4096;
+	slabsOff = (linesOff + numShards * linesPerShard * sizeof(cacheLine) + 4095) & ~4095UL;
+	mapSize = slabsOff + (size_t)numShards * slabsPerShard * slabSize;
+
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, CACHEMAGIC, sizeof(want.magic));
+	want.version = CACHEVERSION;
+	want.numShards = numShards;
+	want.linesPerShard = linesPerShard;
+	want.maxLines = perShard;
+	want.slabsPerShard = slabsPerShard;
+	want.slabBytes = slabSize;
+	want.lineSize = sizeof(cacheLine);
+	want.objSize = sizeof(cacheObj);
+
+	if (NULL != path){
+		if (0 > (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600))){
+			fprintf(stderr, "Error opening cache file %s.\n", path);
+			exit(1);
+		}
+		/* Two proxies writing one arena would corrupt it. */
+		if (0 > flock(fd, LOCK_EX | LOCK_NB)){
+			fprintf(stderr, "Error cache file %s is in use by another proxy.\n", path);
+			exit(1);
+		}
+		if (0 > fstat(fd, &st)){
+			fprintf(stderr, "Error reading cache file %s.\n", path);
+			exit(1);
+		}
+		/* A file of the wrong size cannot hold this geometry; zero it. Truncating first leaves the new file sparse. */
+		if ((size_t)st.st_size != mapSize && (0 > ftruncate(fd, 0) || 0 > ftruncate(fd, mapSize))){
+			fprintf(stderr, "Error sizing cache file %s.\n", path);
+			exit(1);
+		}
+		map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	/* Shared memory of its own: nothing to reattach to, but the workers forked later all map it. */
+	else if (cacheShared){
+		if (0 > (fd = memfd_create("proxy-cache", MFD_CLOEXEC)) || 0 > ftruncate(fd, mapSize)){
+			fprintf(stderr, "Error creating the shared cache arena.\n");
+			exit(1);
+		}
+		map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	else{
+		map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (MAP_FAILED == map){
+		fprintf(stderr, "Error mapping the cache arena.\n");
+		exit(1);
+	}
+
+	cache = (cacheLine *)(map + linesOff);
+	slabInit(map + slabsOff, slabSize, numShards * slabsPerShard, largest);
+	if (NULL != path){
+		restored = cacheAttach(map, &want);
+	}
+
+	shards = cacheCalloc(numShards, sizeof(cacheShard));
+	if (cacheShared){
+		cacheWorkers = procs;
+		cachePins = cacheCalloc((size_t)procs * numShards * linesPerShard, sizeof(int));
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (s = 0; s < numShards; s++){
+		cacheShard *sp = &shards[s];
+
+		if (0 != (cacheShared ? pthread_mutex_init(&sp->procLock, &attr) : pthread_rwlock_init(&sp->lock, NULL))){
+			fprintf(stderr, "Error initializing cache lock.\n");
+			exit(1);
+		}
+		sp->buckets = cacheCalloc(nbuckets, sizeof(int));
+		sp->bucketMask = nbuckets - 1;
+		for (i = 0; i < (int)nbuckets; i++){
+			sp->buckets[i] = -1;
+		}
+		sp->freeLines = -1;
+		sp->maxLines = perShard;
+		slabShardInit(sp, s * slabsPerShard, slabsPerShard);
+		policyInit(sp);
+		if (restored){
+			cacheRestore(sp, s, FALSE);
+			continue;
+		}
+		for (i = (s + 1) * linesPerShard - 1; i >= s * linesPerShard; i--){
+			cache[i].state = LINE_FREE;
+			cache[i].hnext = sp->freeLines;
+			sp->freeLines = i;
+		}
+	}
+}
+
+/* Zeroed room for count of the cache's own structures of size bytes: from a shared mapping if the cache is shared, so that processes forked later see the same ones, else from the heap. */
+void *cacheCalloc(size_t count, size_t size){
+	void *p;
+
+	if (!cacheShared){
+		return Calloc(count, size);
+	}
+	if (MAP_FAILED == (p = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))){
+		fprintf(stderr, "Error mapping shared cache memory.\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* TRUE if map holds a cache written with the same format and geometry; otherwise stamps it as a fresh one. */
+int cacheAttach(char *map, cacheFileHeader *want){
+	if (0 == memcmp(map, want, sizeof(cacheFileHeader))){
+		return TRUE;
+	}
+	/* Clear the header first so a crash while formatting leaves nothing that looks valid. */
+	memset(map, 0, sizeof(cacheFileHeader));
+	memset(cache, 0, numShards * linesPerShard * sizeof(cacheLine));
+	memcpy(map, want, sizeof(cacheFileHeader));
+	return FALSE;
+}
+
+/* Rebuilds shard s, and its slabs, from the lines its last run left linked. Chunks that are plainly unusable are dropped now, the rest on first hit. If live, other processes may still hold its objects: their references stand, and lines being filled or drained, or linked but dropped while still being sent, keep their chunks for them. */
+void cacheRestore(cacheShard *sp, int s, int live){
+	cacheObj *obj;
+	char *end;
+	int i, released = -1;
+
+	slabRestoreBegin(sp);
+	for (i = (s + 1) * linesPerShard - 1; i >= s * linesPerShard; i--){
+		if (LINE_LINKED == cache[i].state && chunkInRange(sp, cache[i].cls, cache[i].slab, cache[i].chunk)){
+			obj = cacheSlot(i);
+			end = (char *)obj + classSize[cache[i].cls];
+			if (obj->size <= (size_t)(end - obj->data) && obj->hdrLen <= obj->size
+				&& NULL != memchr(obj->data + obj->size, 0, end - obj->data - obj->size)
+				&& cache[i].hash == cacheHash(obj->data + obj->size) && sp == shardOf(cache[i].hash)
+				&& sp->occupiedLines < sp->maxLines && 0 > cacheFind(sp, obj->data + obj->size, cache[i].hash)
+				&& chunkClaim(sp, cache[i].cls, cache[i].slab, cache[i].chunk)){
+				if (!live){
+					obj->refs = 1;
+				}
+				obj->line = i;
+				obj->url = obj->data + obj->size;
+				sp->occupiedLines++;
+				sp->size += obj->size;
+				cacheAlloc(sp, i, cache[i].hash);
+				cache[i].checked = FALSE;
+				cacheRestored++;
+				continue;
+			}
+		}
+		/* Whoever has these finishes with them as usual: a filled line is committed, a drained one recycled. A filling line nobody counts was being linked by the worker that died. */
+		if (live && ((LINE_FILLING == cache[i].state && cachePinned(i)) || LINE_DRAINING == cache[i].state)
+			&& chunkClaim(sp, cache[i].cls, cache[i].slab, cache[i].chunk)){
+			sp->occupiedLines += LINE_FILLING == cache[i].state;
+			continue;
+		}
+		if (LINE_LINKED == cache[i].state){
+			cacheTorn++;
+			/* Dropped, such as a duplicate left by a worker that died committing, but still being sent: it drains like an evicted line. */
+			if (live && chunkInRange(sp, cache[i].cls, cache[i].slab, cache[i].chunk) && 1 < __atomic_load_n(&cacheSlot(i)->refs, __ATOMIC_ACQUIRE)
+				&& chunkClaim(sp, cache[i].cls, cache[i].slab, cache[i].chunk)){
+				cache[i].state = LINE_DRAINING;
+				/* Its readers let go in the meantime: the chunk goes back once the slabs are rebuilt. */
+				if (0 == __atomic_sub_fetch(&cacheSlot(i)->refs, 1, __ATOMIC_ACQ_REL)){
+					cache[i].hnext = released;
+					released = i;
+				}
+				continue;
+			}
+		}
+		cache[i].state = LINE_FREE;
+		cache[i].hnext = sp->freeLines;
+		sp->freeLines = i;
+	}
+	slabRestoreEnd(sp);
+	while (0 <= (i = released)){
+		released = cache[i].hnext;
+		cacheLineRecycle(sp, i);
+	}
+}
+
+/* A worker died holding sp's lock, maybe half way through changing it: rebuilds sp from its lines as a restart would, keeping what live workers hold. Called with the lock held. */
+void cacheRecover(cacheShard *sp){
+	int first = sp->firstSlab, count = sp->numSlabs;
+	unsigned long i;
+
+	pthread_mutex_lock(&cacheRecoverLock);
+	for (i = 0; i <= sp->bucketMask; i++){
+		sp->buckets[i] = -1;
+	}
+	sp->freeLines = -1;
+	sp->occupiedLines = 0;
+	sp->size = 0;
+	slabShardInit(sp, first, count);
+	policyInit(sp);
+	cacheRestore(sp, sp - shards, TRUE);
+	pthread_mutex_unlock(&cacheRecoverLock);
+	__atomic_add_fetch(&cacheRecovered, 1, __ATOMIC_RELAXED);
+}
+
+/* The object in line index's chunk. */
+cacheObj *cacheSlot(int index){
+	return (cacheObj *)chunkAddr(cache[index].cls, cache[index].slab, cache[index].chunk);
+}
+
+/* 64-bit FNV-1a of obj's content and url, which is what a torn chunk would get wrong. */
+unsigned long cacheSum(cacheObj *obj){
+	unsigned long hash = 14695981039346656037UL;
+	unsigned char *p = (unsigned char *)obj->data, *end = p + obj->size + strlen(obj->url) + 1;
+
+	while (p < end){
+		hash ^= *p++;
+		hash *= 1099511628211UL;
+	}
+	return hash ^ obj->hdrLen;
+}
+
+/* 64-bit FNV-1a hash of url. */
+unsigned long cacheHash(char *url){
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*url){
+		hash ^= (unsigned char)*url++;
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+
+/* Returns the object cached under url with a reference held for the caller, or NULL on a miss. */
+cacheObj *cacheGet(char *url){
+	unsigned long hash = cacheHash(url);
+	cacheShard *sp = shardOf(hash);
+	cacheObj *obj = NULL;
+	int index;
+
+	policy->exclusiveHits ? lockShardW(sp) : lockShardR(sp);
+	if (admission){
+		sketchAdd(sp, hash);
+	}
+	if (0 <= (index = cacheFind(sp, url, hash)) && cache[index].checked){
+		policy->hit(sp, index);
+		obj = cacheSlot(index);
+		/* The line's own reference is only dropped under the write lock, so this cannot race to zero. */
+		__atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+		cachePin(index, 1);
+	}
+	unlockShard(sp);
+
+	if (0 <= index && NULL == obj){
+		obj = cacheCheck(sp, url, hash);
+	}
+	__atomic_add_fetch(NULL != obj ? &cacheHits : &cacheMisses, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+
+/* First hit on a line restored from the cache file: verifies its checksum, dropping it if the chunk is torn. */
+cacheObj *cacheCheck(cacheShard *sp, char *url, unsigned long hash){
+	cacheObj *obj = NULL;
+	int index;
+
+	lockShardW(sp);
+	if (0 <= (index = cacheFind(sp, url, hash))){
+		if (!cache[index].checked && cacheSlot(index)->sum != cacheSum(cacheSlot(index))){
+			cacheLineFree(sp, index, FALSE);
+			__atomic_add_fetch(&cacheTorn, 1, __ATOMIC_RELAXED);
+		}
+		else{
+			cache[index].checked = TRUE;
+			policy->hit(sp, index);
+			obj = cacheSlot(index);
+			__atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+			cachePin(index, 1);
+		}
+	}
+	unlockShard(sp);
+	return obj;
+}
+
+/* Returns a new object on the heap holding a copy of content (left for the caller to fill if NULL), with one reference held for the caller. */
+cacheObj *cacheObjNew(char *url, char *content, size_t size){
+	size_t urlLen = strlen(url) + 1;
+	cacheObj *obj;
+
+	if (NULL == (obj = malloc(sizeof(cacheObj) + size + urlLen))){
+		dbg_printf("Error allocating memory for the data. Malloc unsuccessful.\n");
+		return NULL;
+	}
+	obj->refs = 1;
+	obj->line = -1;
+	obj->size = size;
+	obj->hdrLen = 0;
+	obj->fetched = obj->expires = 0;
+	obj->url = obj->data + size;
+	if (NULL != content){
+		memcpy(obj->data, content, size);
+	}
+	memcpy(obj->url, url, urlLen);
+	return obj;
+}
+
+/* Drops a reference to obj. Once neither the cache nor any reader holds it, frees it or gives its chunk back. */
+void cacheRelease(cacheObj *obj){
+	cacheShard *sp;
+
+	/* Uncounted first: dying in between leaks the reference rather than having it dropped twice. */
+	if (0 <= obj->line){
+		cachePin(obj->line, -1);
+	}
+	if (0 == __atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL)){
+		if (0 > obj->line){
+			free(obj);
+			return;
+		}
+		/* Only an evicted line's object gets here, and nothing else will touch its line. */
+		sp = &shards[obj->line / linesPerShard];
+		lockShardW(sp);
+		cacheLineRecycle(sp, obj->line);
+		unlockShard(sp);
+	}
+}
+
+/* Makes room for an object of size bytes under url, evicting within its size class. Returns the object, empty but for its url, for the caller to fill and pass to cacheCommit; NULL if it is not to be cached. */
+cacheObj *cacheReserve(char *url, size_t size){
+	unsigned long hash = cacheHash(url);
+	cacheShard *sp = shardOf(hash);
+	size_t urlLen = strlen(url) + 1;
+	int cls = slabClassFor(sizeof(cacheObj) + size + urlLen);
+	int index, slab, chunk, victim, wholeSlab, contested = FALSE, moved = FALSE;
+	cacheObj *obj;
+
+	if (0 > cls){
+		return NULL;
+	}
+
+	/* Take a line and a chunk under the lock; the caller fills the chunk without it. */
+	lockShardW(sp);
+	while (sp->maxLines <= sp->occupiedLines || 0 > chunkAlloc(sp, cls, &slab, &chunk)){
+		/* Nothing left to evict: everything is being filled, or a slab just taken is still pinned by a slow reader. */
+		if (0 > (victim = cacheVictim(sp, cls, &wholeSlab)) || (wholeSlab && moved)){
+			unlockShard(sp);
+			return NULL;
+		}
+		/* TinyLFU: the newcomer has to have been asked for more often than the first line it would displace. */
+		if (admission && !contested && !sketchAdmit(sp, hash, cache[victim].hash)){
+			unlockShard(sp);
+			__atomic_add_fetch(&cacheRejected, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		contested = TRUE;
+		if (wholeSlab){
+			cacheEvictSlabs(sp, cache[victim].slab, classRun[cls]);
+			moved = TRUE;
+		}
+		else{
+			cacheLineFree(sp, victim, TRUE);
+		}
+	}
+	if (0 > (index = cacheVacancy(sp))){
+		chunkFree(sp, slab, chunk);
+		unlockShard(sp);
+		return NULL;
+	}
+	cachePin(index, 1);
+	cache[index].state = LINE_FILLING;
+	cache[index].cls = cls;
+	cache[index].slab = slab;
+	cache[index].chunk = chunk;
+	sp->occupiedLines++;
+	/* cacheEvictSlabs reads the line back from the chunk, so it is set before unlocking. */
+	obj = cacheSlot(index);
+	obj->line = index;
+	unlockShard(sp);
+
+	obj->refs = 1;
+	obj->size = size;
+	obj->hdrLen = 0;
+	obj->fetched = obj->expires = 0;
+	obj->url = obj->data + size;
+	memcpy(obj->url, url, urlLen);
+	return obj;
+}
+
+/* Links in an object from cacheReserve once the caller has filled it. The caller's reference becomes the line's. */
+void cacheCommit(cacheObj *obj){
+	unsigned long hash = cacheHash(obj->url);
+	cacheShard *sp = shardOf(hash);
+	int old;
+
+	obj->sum = cacheSum(obj);
+	lockShardW(sp);
+	/* A concurrent miss may have stored the same url first; the newer copy wins. */
+	if (0 <= (old = cacheFind(sp, obj->url, hash))){
+		cacheLineFree(sp, old, FALSE);
+	}
+	cachePin(obj->line, -1);
+	sp->size += obj->size;
+	cacheAlloc(sp, obj->line, hash);
+	unlockShard(sp);
+}
+
+/* The line to evict for an object of class cls, or -1 if there is none. If the class has no lines to give up, the victim is from the class with the most slabs and *wholeSlab says whether its slabs are wanted rather than just its line. */
+int cacheVictim(cacheShard *sp, int cls, int *wholeSlab){
+	int c, donor = -1;
+
+	*wholeSlab = FALSE;
+	if (0 < sp->classes[cls].lines){
+		return policy->victim(sp, &sp->classes[cls]);
+	}
+	for (c = 0; c < numClasses; c++){
+		if (0 < sp->classes[c].lines && (0 > donor || sp->classes[donor].slabs < sp->classes[c].slabs)){
+			donor = c;
+		}
+	}
+	if (0 > donor){
+		return -1;
+	}
+	*wholeSlab = sp->maxLines > sp->occupiedLines;
+	return policy->victim(sp, &sp->classes[donor]);
+}
+
+/* Evicts every line with its object in need adjacent slabs from the run starting at slab (or fewer, to stay in the shard), so that they can go to another class once readers are done with them. */
+void cacheEvictSlabs(cacheShard *sp, int slab, int need){
+	int first = (sp - shards) * linesPerShard, i, run, cls, c, line;
+
+	__atomic_add_fetch(&cacheSlabMoves, 1, __ATOMIC_RELAXED);
+	if (slab > sp->firstSlab + sp->numSlabs - need){
+		slab = sp->firstSlab + sp->numSlabs - need;
+	}
+	for (i = slab; i < slab + need; i++){
+		if (0 > (cls = slabs[i].cls)){
+			continue;
+		}
+		run = slabs[i].run;
+		for (c = 0; c < slabs[run].carved; c++){
+			/* A free chunk still has its last object's line; it only counts if that line still points here. */
+			line = ((cacheObj *)chunkAddr(cls, run, c))->line;
+			if (first <= line && first + linesPerShard > line && LINE_LINKED == cache[line].state && run == cache[line].slab && c == cache[line].chunk){
+				cacheLineFree(sp, line, TRUE);
+			}
+		}
+		i = run + classRun[cls] - 1;
+	}
+}
+
+/* The shard responsible for hash. Bucket selection uses the low bits, so use the high ones here. */
+cacheShard *shardOf(unsigned long hash){
+	return &shards[(hash >> 32) & (numShards - 1)];
+}
+
+/* Returns the index of the line holding url, or -1. Caller holds the shard lock. */
+int cacheFind(cacheShard *sp, char *url, unsigned long hash){
+	int i;
+
+	for (i = sp->buckets[hash & sp->bucketMask]; 0 <= i; i = cache[i].hnext){
+		if (hash == cache[i].hash && 0 == strcmp(url, cacheSlot(i)->url)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* If there are no vacant lines, returns -1. Otherwise, pops a vacant line off the free list. */
+int cacheVacancy(cacheShard *sp){
+	int i = sp->freeLines;
+
+	if (0 <= i){
+		sp->freeLines = cache[i].hnext;
+	}
+	return i;
+}
+
+/* Unlinks the specified cache line, evicted or replaced, and drops its reference to the object; the line is free again once readers are done with it. */
+void cacheLineFree(cacheShard *sp, int index, int evicted){
+	int *p = &sp->buckets[cache[index].hash & sp->bucketMask];
+	cacheObj *obj = cacheSlot(index);
+
+	while (*p != index){
+		p = &cache[*p].hnext;
+	}
+	*p = cache[index].hnext;
+	policy->remove(sp, index, evicted);
+	cache[index].state = LINE_DRAINING;
+	if (evicted){
+		__atomic_add_fetch(&cacheEvictions, 1, __ATOMIC_RELAXED);
+	}
+
+	sp->classes[cache[index].cls].lines--;
+	sp->occupiedLines--;
+	sp->size -= obj->size;
+	if (0 == __atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL)){
+		cacheLineRecycle(sp, index);
+	}
+}
+
+/* Returns an unlinked line whose object nobody holds, and its chunk, to the free lists. Caller holds the write lock. */
+void cacheLineRecycle(cacheShard *sp, int index){
+	chunkFree(sp, cache[index].slab, cache[index].chunk);
+	cache[index].state = LINE_FREE;
+	cache[index].hnext = sp->freeLines;
+	sp->freeLines = index;
+}
+
+/* Links the line whose chunk has just been filled. Marking it linked comes last, so the file never shows a half-written chunk as an entry. */
+void cacheAlloc(cacheShard *sp, int index, unsigned long hash){
+	int *bucket = &sp->buckets[hash & sp->bucketMask];
+
+	cache[index].hash = hash;
+	cache[index].referenced = FALSE;
+	cache[index].checked = TRUE;
+	sp->classes[cache[index].cls].lines++;
+
+	cache[index].hnext = *bucket;
+	*bucket = index;
+	policy->insert(sp, index);
+	__atomic_store_n(&cache[index].state, LINE_LINKED, __ATOMIC_RELEASE);
+}
+
+/* Counts delta references to line index's object as this worker's. */
+void cachePin(int index, int delta){
+	if (0 <= cacheWorker){
+		__atomic_add_fetch(&cachePins[cacheWorker * numShards * linesPerShard + index], delta, __ATOMIC_RELAXED);
+	}
+}
+
+/* TRUE if any worker counts a reference to line index's object. */
+int cachePinned(int index){
+	int w;
+
+	for (w = 0; w < cacheWorkers; w++){
+		if (0 < __atomic_load_n(&cachePins[w * numShards * linesPerShard + index], __ATOMIC_RELAXED)){
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Worker worker has died: drops the references it held and frees the lines it was filling, shard by shard. Run by the supervisor before the worker is replaced. */
+void cacheReap(int worker){
+	int *pins = &cachePins[worker * numShards * linesPerShard];
+	cacheShard *sp;
+	int s, i;
+
+	for (s = 0; s < numShards; s++){
+		sp = &shards[s];
+		lockShardW(sp);
+		for (i = s * linesPerShard; i < (s + 1) * linesPerShard; i++){
+			if (0 == pins[i]){
+				continue;
+			}
+			if (LINE_FILLING == cache[i].state){
+				sp->occupiedLines--;
+				cacheLineRecycle(sp, i);
+			}
+			/* Only a line already evicted can lose its last reference here. */
+			else if ((LINE_LINKED == cache[i].state || LINE_DRAINING == cache[i].state)
+				&& 0 == __atomic_sub_fetch(&cacheSlot(i)->refs, pins[i], __ATOMIC_ACQ_REL)){
+				cacheLineRecycle(sp, i);
+			}
+			pins[i] = 0;
+		}
+		unlockShard(sp);
+	}
+}
+
+/* Lock a shard for reading. */
+void lockShardR(cacheShard *sp){
+	if (cacheShared){
+		lockShardW(sp);
+		return;
+	}
+    if(pthread_rwlock_rdlock(&sp->lock)){
+        fprintf(stderr, "Error during cache read lock.\n");
+        exit(-1);
+    }
+}
+
+/* Lock a shard for writing. Shared between processes, the shard is rebuilt first if whoever held it last died with it. */
+void lockShardW(cacheShard *sp){
+	int err;
+
+	if (cacheShared){
+		if (EOWNERDEAD == (err = pthread_mutex_lock(&sp->procLock))){
+			fprintf(stderr, "Error a worker died holding cache shard %d; rebuilding it.\n", (int)(sp - shards));
+			cacheRecover(sp);
+			pthread_mutex_consistent(&sp->procLock);
+		}
+		else if (0 != err){
+			fprintf(stderr, "Error during cache write lock.\n");
+			exit(-1);
+		}
+		return;
+	}
+    if(pthread_rwlock_wrlock(&sp->lock)){
+        fprintf(stderr, "Error during cache write lock.\n");
+        exit(-1);
+    }
+}
+
+/* Unlocks a shard if it has been locked for reading or writing. */
+void unlockShard(cacheShard *sp){
+    if(cacheShared ? pthread_mutex_unlock(&sp->procLock) : pthread_rwlock_unlock(&sp->lock)){
+        fprintf(stderr, "Error during cache unlock.\n");
+        exit(-1);
+    }
+}
+
+/* Writes the cache counters as "name value" lines to buf. Returns the length written. */
+int cacheStats(char *buf, size_t len){
+	size_t bytes = 0;
+	long objects = 0;
+	int s, i, freeSlabs = 0;
+
+	for (s = 0; s < numShards; s++){
+		lockShardR(&shards[s]);
+		objects += shards[s].occupiedLines;
+		bytes += shards[s].size;
+		for (i = shards[s].freeSlabs; 0 <= i; i = slabs[i].next){
+			freeSlabs++;
+		}
+		unlockShard(&shards[s]);
+	}
+	return snprintf(buf, len,
+		"cache_objects %ld\n"
+		"cache_bytes %zu\n"
+		"cache_hits %ld\n"
+		"cache_misses %ld\n"
+		"cache_evictions %ld\n"
+		"cache_rejected %ld\n"
+		"cache_restored %ld\n"
+		"cache_torn %ld\n"
+		"cache_recovered %ld\n"
+		"cache_slabs_free %d\n"
+		"cache_slab_moves %ld\n",
+		objects, bytes,
+		__atomic_load_n(&cacheHits, __ATOMIC_RELAXED),
+		__atomic_load_n(&cacheMisses, __ATOMIC_RELAXED),
+		__atomic_load_n(&cacheEvictions, __ATOMIC_RELAXED),
+		__atomic_load_n(&cacheRejected, __ATOMIC_RELAXED),
+		__atomic_load_n(&cacheRestored, __ATOMIC_RELAXED),
+		__atomic_load_n(&cacheTorn, __ATOMIC_RELAXED),
+		__atomic_load_n(&cacheRecovered, __ATOMIC_RELAXED),
+		freeSlabs,
+		__atomic_load_n(&cacheSlabMoves, __ATOMIC_RELAXED));
+}
+
+/* Parses a byte count with an optional K, M or G suffix, as cache and object sizes are given to the proxy and tracereplay. Returns -1 if it is not one. */
+long long parseSize(char *arg){
+	char *end;
+	long long n = strtoll(arg, &end, 10);
+
+	if (end == arg){
+		return -1;
+	}
+	switch (*end){
+	case 'g': case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		n <<= 10;
+		end++;
+		break;
+	}
+	return '\0' == *end ? n : -1;
+}
@@ -0,0 +1,155 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+#define CACHESHARDS 16
+#define SHARDMINLINES 64	/* fewest lines a shard is given: fewer, and a few hot urls hashing together crowd each other out */
+#define SHARDSLABS 8		/* fewest slabs a shard is split into, unless they would be under SLABMIN */
+#define SLABCLASSES 64		/* most chunk size classes */
+
+/* The cache file starts with this header; a file that does not match it is reformatted. */
+#define CACHEMAGIC "PRXCACHE"
+#define CACHEVERSION 6
+
+/* 
+ * An immutable cached object. The cache holds one reference
+ * while it is linked in and every reader holds another while
+ * it sends, so eviction never frees bytes that are in use.
+ * Cached objects live in a chunk of the cache arena; the
+ * rest (the status page) are on the heap.
+ */
+typedef struct cacheObj{
+	int refs;
+	int line;		/* the line whose chunk holds it, -1 on the heap */
+	size_t size;
+	size_t hdrLen;	/* response head up to, not including, its blank line */
+	unsigned long sum;	/* FNV-1a of content and url, checked after a restart */
+	long fetched;	/* when the origin last sent or confirmed it, in seconds since the epoch */
+	long expires;	/* when it goes stale; a 304 moves both on */
+	char *url;		/* NUL-terminated, stored after the content */
+	char data[];
+} cacheObj;
+
+/* What a line is doing; only LINE_LINKED lines survive a restart. */
+enum { LINE_FREE, LINE_FILLING, LINE_LINKED, LINE_DRAINING };
+
+/* 
+ * A cache entry. Lines are linked three ways by index:
+ * into their hash bucket (or the free list) through hnext,
+ * and into one of their size class's policy queues through
+ * prev/next. The object is in chunk chunk of slab slab.
+ * Lines are stored in the cache file, but only hash, state
+ * and where the object is are trusted when it is reattached;
+ * the links are rebuilt.
+ */
+typedef struct cacheLine{
+	unsigned long hash;
+	int state;
+	int cls;		/* size class of its chunk */
+	int slab;
+	int chunk;
+	int checked;	/* the chunk's checksum is known good */
+	int referenced;	/* hits since the policy last looked, set without the write lock */
+	int queue;		/* which of its class's queues it is in */
+	int prev;		/* newer neighbour, -1 at the head */
+	int next;		/* older neighbour, -1 at the tail */
+	int hnext;		/* next line in the bucket or free list, -1 at the end */
+} cacheLine;
+
+/* 
+ * The first page of the cache file. Any field that differs
+ * from what this build would write means the file is from
+ * another version or geometry and is started afresh.
+ */
+typedef struct cacheFileHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t numShards;
+	uint32_t linesPerShard;
+	uint32_t maxLines;
+	uint32_t slabsPerShard;
+	uint64_t slabBytes;
+	uint64_t lineSize;
+	uint64_t objSize;
+} cacheFileHeader;
+
+/* 
+ * A slab of the arena. Free slabs belong to no class; a
+ * class is given a run of them, one slab for most classes,
+ * which is carved into its chunks as they are needed and
+ * goes back to being free once none of them is in use. The
+ * first slab of a run keeps the run's state. See slab.c.
+ */
+typedef struct cacheSlab{
+	int cls;		/* -1 while free */
+	int run;		/* the first slab of its run */
+	int carved;		/* chunks handed out at least once; the rest are untouched */
+	int used;
+	int freeChunk;	/* chunks given back, chained through their first bytes */
+	int prev;		/* in its class's list of runs with room, or the free list */
+	int next;
+} cacheSlab;
+
+/* 
+ * One size class within a shard: its slabs and the eviction
+ * policy's queues for the lines whose objects are in them,
+ * so that room for an object is made in its own class.
+ */
+typedef struct cacheClass{
+	int partial;		/* runs with a chunk to spare */
+	int slabs;
+	int lines;
+	int head[2];		/* newest line of each queue */
+	int tail[2];		/* oldest line of each queue */
+	size_t queued[2];	/* bytes in each queue */
+	int hand;			/* where SIEVE resumes looking for a victim */
+} cacheClass;
+
+/* 
+ * An independent slice of the cache selected by url hash,
+ * with its own lock, buckets, lines, slabs and state for the
+ * eviction policy (see policy.c). A cache shared between
+ * processes takes procLock in place of lock.
+ */
+typedef struct cacheShard{
+	pthread_rwlock_t lock;
+	pthread_mutex_t procLock;	/* process-shared and robust, so a worker dying with it held is found out */
+	int *buckets;
+	unsigned long bucketMask;
+	cacheClass classes[SLABCLASSES];
+	int firstSlab;		/* the shard's slabs are firstSlab onwards */
+	int numSlabs;
+	int freeSlabs;
+	unsigned long *ghost;	/* S3-FIFO: hashes recently evicted from the small queue */
+	unsigned long ghostMask;
+	unsigned char *sketch;	/* TinyLFU: SKETCHROWS rows of request counts */
+	unsigned long sketchMask;
+	unsigned long sketchAdds;
+	int freeLines;
+	int occupiedLines;	/* linked and filling lines */
+	int maxLines;		/* half the shard's lines, so evicted chunks still being sent never block an insert */
+	size_t size;		/* bytes of objects linked */
+} __attribute__((aligned(64))) cacheShard;
+
+struct cachePolicy;
+
+extern cacheLine *cache;
+extern long cacheMaxObject;
+extern int cacheWorker;
+
+void initCache(char *path, size_t maxBytes, int maxLines, long maxObject, struct cachePolicy *policy, int admission, int procs);
+void *cacheCalloc(size_t count, size_t size);
+unsigned long cacheHash(char *url);
+cacheObj *cacheObjNew(char *url, char *content, size_t size);
+cacheObj *cacheGet(char *url);
+cacheObj *cacheSlot(int index);
+cacheObj *cacheReserve(char *url, size_t size);
+void cacheCommit(cacheObj *obj);
+void cacheRelease(cacheObj *obj);
+void cacheReap(int worker);
+int  cacheStats(char *buf, size_t len);
+long long parseSize(char *arg);
+
+#endif /* __CACHE_H__ */
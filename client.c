@@ -1,101 +1,667 @@
-#include "csapp.h" 
+/*
+ * ----------------------------------------------------------
+ * client.c - Load generator: drives the proxy (or an origin
+ *            directly) and reports throughput and latency
+ *            percentiles, split by cache hit and miss.
+ *
+ * - -t threads share -c keep-alive connections; each thread
+ *   polls its own, so a thread keeps many requests in flight
+ * - closed loop by default: a connection sends its next
+ *   request as soon as the last is answered. With -r the loop
+ *   is open: requests fall due at that rate whether or not
+ *   earlier ones are answered, and latency is measured from
+ *   when a request fell due rather than from when a
+ *   connection came free to send it, so a stall counts
+ *   against every request it held back (no coordinated
+ *   omission); requests still waiting at the end are
+ *   reported as unsent
+ * - urls are /obj/i for i below -n, picked uniformly or,
+ *   with -z s, Zipf-distributed with exponent s (/obj/0 the
+ *   most popular); -u gives another pattern for them, such
+ *   as tiny -b's synthetic "/synth/%d?size=10240&delay=5"
+ * - the proxy marks copies from its cache "X-Cache: HIT";
+ *   latencies go into log-linear histograms as in metrics.c,
+ *   one for hits and one for misses
+ * - -m dir writes that corpus, -s bytes an object, into
+ *   dir/obj for tiny to serve (cd dir; tiny port) and exits;
+ *   "make loadtest" does all of this against a local tiny
+ * - without -x requests go straight to the origin; classic
+ *   tiny (without -b) closes each connection after one
+ *   response, so every request then pays for a connect,
+ *   while tiny -b, which "make loadtest" runs, keeps them
+ *   alive
+ * - responses must carry a Content-Length or end with the
+ *   connection; chunked ones are counted as errors
+ * - 429s and 503s, the proxy turning load away, are counted
+ *   as refused and kept out of the latencies, so that
+ *   throughput is goodput
+ * - -l conns also runs a slowloris alongside: that many
+ *   connections, opened before the load starts, trickle a
+ *   request head that never ends, a byte every SLOWGAP ms,
+ *   and are opened again once the server closes them;
+ *   "make slowtest" shows the proxy's deadlines keeping it
+ *   serving through one
+ *
+ * usage: client [-t threads] [-c conns] [-r rate] [-d secs]
+ *               [-n urls] [-z s] [-u pattern] [-x proxyhost:port]
+ *               [-l conns] host port
+ *        client -m dir [-n urls] [-s bytes]
+ * ----------------------------------------------------------
+ */
 
-#define VERSION " HTTP/1.0\r\n"
+#define _GNU_SOURCE
 
-char *allcaps(char *str);
-void genheader(char *host, char *header);
-void genrequest(char *request, char *method, char *uri);
+#include <poll.h>
+#include <math.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "parse.h"
+#include "metrics.h"
+
+#define LOADBUF MAXLINE			/* a response head must fit */
+#define LOADGRACE 2000000000L	/* ns to wait for answers once the run is over */
+#define LOADPOLL 100			/* ms to poll when nothing falls due sooner */
+#define SLOWGAP 1000			/* ms between the bytes a slowloris connection sends */
+
+/* One connection and the request on it. */
+typedef struct loadConn{
+	int fd;					/* -1 when not connected */
+	int busy;				/* a request is outstanding */
+	long due;				/* when it fell due, in ns */
+	httpHead head;
+	char buf[LOADBUF];		/* the head, then scratch for the body */
+	size_t len;
+	int headDone;
+	long remaining;			/* body bytes to come; -1 until the connection ends */
+	int hit;
+	int closing;			/* the server ends the connection after this response */
+} loadConn;
+
+/* One thread's connections and results. */
+typedef struct loadThread{
+	pthread_t tid;
+	int id;
+	int numConns;
+	loadConn *conns;
+	long interval;			/* ns between requests it sends; 0 for a closed loop */
+	unsigned short seed[3];
+	long requests[2];		/* answered, misses then hits */
+	long errors;
+	long refused;			/* answered 429 or 503 */
+	long unsent;
+	long bytes;
+	long maxLat[2];
+	long hist[2][METRICBUCKETS];
+	long finished;			/* when its last answer came */
+} loadThread;
+
+struct sockaddr_in target;	/* the proxy, or the origin without one */
+char origin[MAXLINE];		/* host:port of the origin */
+int viaProxy;
+int numThreads;
+int numUrls = 100;
+char *urlPattern = "/obj/%d";	/* printf format taking the url's number */
+double *zipfCdf;			/* NULL for uniform */
+long runStart;
+long runStop;
+int numSlow;				/* slowloris connections; 0 for none */
+int *slowFds;
+long *slowSent;				/* bytes of its head each has sent */
+char slowHead[MAXLINE];
+int slowLen;
+long slowOpened;
+long slowClosed;			/* by the server, or refused */
+
+void *loadRun(void *vargp);
+long loadDue(loadThread *t, long k);
+int  loadSend(loadThread *t, loadConn *c, long due);
+int  loadRead(loadThread *t, loadConn *c);
+void loadDone(loadThread *t, loadConn *c, long now);
+void loadDrop(loadConn *c);
+int  loadConnect();
+void slowBegin();
+void *slowRun(void *vargp);
+void slowRound();
+int  pickUrl(loadThread *t);
+void makeCorpus(char *dir, long size);
+long percentile(long *hist, long count, long max, double pct);
+void printRow(char *name, long *hist, long count, long max);
+void usage(char *prog);
 
 int main(int argc, char **argv)
 {
-    int clientfd, port;
-    char *host;
-    char buffer[1024];
-
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], requesthdr[MAXLINE];
-    char version[MAXLINE];
-    //int bufsize;
-    rio_t rio;
-
-    FILE *file;
-
-    if(argc!=3){
-        fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
-        exit(0);
-    }
-
-    host=argv[1];
-    port=atoi(argv[2]);
-
-    /* generate the request header for this host */
-    genheader(host,requesthdr);
-
-    clientfd = Open_clientfd(host, port);
-    Rio_readinitb(&rio, clientfd);
-
-    while(Fgets(buf, MAXLINE, stdin)!=NULL){
-        sscanf(buf ,"%s %s %s", method, uri, version);
-        if(!strcasecmp(method, "GET")){
-            genrequest(buf,"GET",uri); /* generate request into buf */
-            strcat(buf, requesthdr); /* concatenate header to buf */	
-
-            file = Fopen(uri+1,"w");  
-
-            /* send request+header to host */
-            Rio_writen(clientfd, buf, strlen(buf));
-
-            /* Read the server response header */
-            do{
-                Rio_readlineb(&rio,buf,MAXLINE);
-                printf("%s\n",buf);
-            }while(strcmp(buf,"\r\n"));
-            printf("end of server response header\n");
-
-            while(Rio_readlineb(&rio,buf,MAXLINE)){
-                Fputs(buf,file);
-            }
-
-            //printf("wrote to file: %s\n",uri);
-            Fclose(file);
-        }
-    }
-    /*
-       while(Fgets(buf, MAXLINE, stdin)!=NULL){
-       Rio_writen(clientfd, buf, strlen(buf));
-       Rio_readlineb(&rio, buf, MAXLINE);
-       Fputs(buf, stdout);
-       }*/
-    Close(clientfd);
-    exit(0);
-}
-
-/* allcaps - returns str with all letters capitalized */
-char *allcaps(char *str)
-{
-    int i=0;
-    while(str[i]){
-        putchar(toupper(str[i]));
-        i++;
-    }
-    return str;
+	int threads = 1, conns = 1, opt, i, j;
+	double rate = 0, secs = 10, zipf = 0, sum;
+	long size = 10240, requests[2] = {0}, errors = 0, refused = 0, unsent = 0, bytes = 0, maxLat[2] = {0}, finished = 0;
+	static long hist[3][METRICBUCKETS];
+	char *dir = NULL, *proxy = NULL, *colon, host[MAXLINE];
+	struct addrinfo hints, *res;
+	loadThread *t;
+	pthread_t slowTid;
+
+	while (-1 != (opt = getopt(argc, argv, "t:c:r:d:n:z:u:x:m:s:l:"))){
+		switch (opt){
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'd':
+			secs = atof(optarg);
+			break;
+		case 'n':
+			numUrls = atoi(optarg);
+			break;
+		case 'z':
+			zipf = atof(optarg);
+			break;
+		case 'u':
+			urlPattern = optarg;
+			break;
+		case 'x':
+			proxy = optarg;
+			break;
+		case 'm':
+			dir = optarg;
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		case 'l':
+			numSlow = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* The pattern goes to snprintf, so it may hold one conversion and that a %d. */
+	if (0 >= numUrls || NULL == (colon = strchr(urlPattern, '%')) || 'd' != colon[1] || NULL != strchr(colon + 1, '%')){
+		usage(argv[0]);
+	}
+	if (NULL != dir){
+		makeCorpus(dir, size);
+		exit(EXIT_SUCCESS);
+	}
+	if (argc - optind != 2 || 0 >= threads || 0 >= secs || 0 > rate || 0 > numSlow){
+		usage(argv[0]);
+	}
+	if (conns < threads){
+		conns = threads;
+	}
+	snprintf(origin, sizeof(origin), "%s:%s", argv[optind], argv[optind + 1]);
+
+	/* Resolve whatever is connected to once, up front. */
+	viaProxy = NULL != proxy;
+	snprintf(host, sizeof(host), "%s", viaProxy ? proxy : origin);
+	if (NULL == (colon = strrchr(host, ':'))){
+		usage(argv[0]);
+	}
+	*colon = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (0 != getaddrinfo(host, colon + 1, &hints, &res)){
+		fprintf(stderr, "Error: cannot resolve %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&target, res->ai_addr, sizeof(target));
+	freeaddrinfo(res);
+
+	if (0 < zipf){
+		zipfCdf = Malloc(numUrls * sizeof(double));
+		for (i = 0, sum = 0; i < numUrls; i++){
+			zipfCdf[i] = sum += pow(i + 1, -zipf);
+		}
+		for (i = 0; i < numUrls; i++){
+			zipfCdf[i] /= sum;
+		}
+	}
+
+	Signal(SIGPIPE, SIG_IGN);
+	numThreads = threads;
+	t = Calloc(threads, sizeof(loadThread));
+	runStart = metricNow();
+	runStop = runStart + (long)(secs * 1e9);
+	if (0 < numSlow){
+		slowBegin();
+		Pthread_create(&slowTid, NULL, slowRun, NULL);
+	}
+	for (i = 0; i < threads; i++){
+		t[i].id = i;
+		t[i].numConns = conns / threads + (i < conns % threads);
+		t[i].conns = Calloc(t[i].numConns, sizeof(loadConn));
+		t[i].interval = 0 < rate ? (long)(1e9 * threads / rate) : 0;
+		t[i].seed[0] = i;
+		t[i].seed[1] = i >> 16;
+		t[i].seed[2] = 0x330e;
+		Pthread_create(&t[i].tid, NULL, loadRun, &t[i]);
+	}
+
+	for (i = 0; i < threads; i++){
+		Pthread_join(t[i].tid, NULL);
+		for (j = 0; j < 2; j++){
+			requests[j] += t[i].requests[j];
+			maxLat[j] = t[i].maxLat[j] > maxLat[j] ? t[i].maxLat[j] : maxLat[j];
+		}
+		errors += t[i].errors;
+		refused += t[i].refused;
+		unsent += t[i].unsent;
+		bytes += t[i].bytes;
+		finished = t[i].finished > finished ? t[i].finished : finished;
+		for (j = 0; j < METRICBUCKETS; j++){
+			hist[0][j] += t[i].hist[0][j];
+			hist[1][j] += t[i].hist[1][j];
+			hist[2][j] += t[i].hist[0][j] + t[i].hist[1][j];
+		}
+	}
+	if (0 < numSlow){
+		Pthread_join(slowTid, NULL);
+	}
+	secs = (finished > runStart ? finished - runStart : runStop - runStart) / 1e9;
+
+	if (0 < rate){
+		printf("open loop at %.0f req/s", rate);
+	}
+	else{
+		printf("closed loop");
+	}
+	printf(", %d threads, %d connections, %.1f s, %d urls %s%s%s\n", threads, conns, secs, numUrls,
+	       NULL != zipfCdf ? "zipf" : "uniform", viaProxy ? " via " : "", viaProxy ? proxy : "");
+	printf("requests   %ld (hits %ld, misses %ld), refused %ld, errors %ld, unsent %ld\n",
+	       requests[0] + requests[1], requests[1], requests[0], refused, errors, unsent);
+	printf("throughput %.1f req/s, %.2f MB/s\n", (requests[0] + requests[1]) / secs, bytes / secs / 1e6);
+	printf("latency ms %9s %9s %9s %9s\n", "p50", "p99", "p999", "max");
+	printRow("all", hist[2], requests[0] + requests[1], maxLat[0] > maxLat[1] ? maxLat[0] : maxLat[1]);
+	printRow("hit", hist[1], requests[1], maxLat[1]);
+	printRow("miss", hist[0], requests[0], maxLat[0]);
+	if (0 < numSlow){
+		printf("slowloris  %d connections, %ld opened, %ld closed by the server\n", numSlow, slowOpened, slowClosed);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* Thread routine: keeps its connections busy until the run is over and its answers are in. */
+void *loadRun(void *vargp){
+	loadThread *t = vargp;
+	struct pollfd *fds = Calloc(t->numConns, sizeof(struct pollfd));
+	int *polled = Calloc(t->numConns, sizeof(int));
+	long now, due, sent = 0, busy = 0, timeout;
+	int i, n;
+
+	for (i = 0; i < t->numConns; i++){
+		t->conns[i].fd = -1;
+	}
+	while(1){
+		now = metricNow();
+		if (now >= runStop && (0 == busy || now >= runStop + LOADGRACE)){
+			break;
+		}
+
+		/* Start whatever has fallen due on the connections that are free. */
+		for (i = 0; i < t->numConns && now < runStop; i++){
+			if (t->conns[i].busy){
+				continue;
+			}
+			due = now;
+			if (0 < t->interval && (due = loadDue(t, sent)) > now){
+				break;
+			}
+			sent++;
+			if (0 > loadSend(t, &t->conns[i], due)){
+				t->errors++;
+				continue;
+			}
+			busy++;
+		}
+
+		for (i = n = 0; i < t->numConns; i++){
+			if (t->conns[i].busy){
+				fds[n].fd = t->conns[i].fd;
+				fds[n].events = POLLIN;
+				polled[n++] = i;
+			}
+		}
+		timeout = LOADPOLL;
+		if (now < runStop){
+			if (0 < t->interval){
+				due = loadDue(t, sent);
+				timeout = due > now ? (due - now) / 1000000 : 0;
+			}
+			if (0 == t->interval && n < t->numConns){
+				timeout = 0;
+			}
+			timeout = timeout > (runStop - now) / 1000000 + 1 ? (runStop - now) / 1000000 + 1 : timeout;
+		}
+		if (0 > poll(fds, n, timeout)){
+			if (EINTR == errno){
+				continue;
+			}
+			fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++){
+			if (0 == fds[i].revents){
+				continue;
+			}
+			if (0 != loadRead(t, &t->conns[polled[i]])){
+				busy--;
+			}
+		}
+	}
+
+	/* Whatever fell due in an open loop but was never sent. */
+	if (0 < t->interval && runStop > (due = loadDue(t, sent))){
+		t->unsent = (runStop - due - 1) / t->interval + 1;
+	}
+	for (i = 0; i < t->numConns; i++){
+		t->errors += t->conns[i].busy;
+		loadDrop(&t->conns[i]);
+	}
+	free(fds);
+	free(polled);
+	return NULL;
+}
+
+/* When t's kth request falls due. Threads are staggered across the interval so they do not all send at once. */
+long loadDue(loadThread *t, long k){
+	return runStart + k * t->interval + t->interval * t->id / numThreads;
 }
 
-/* genheader - compiles a HTTP request header from host name */
-void genheader(char *host,char *header){
-    strcpy(header,"Host: ");
-    strcat(header,host);
-    strcat(header,"\r\n\r\n");
+/* Sends a request for a url on c, connecting it first if need be. Returns -1, leaving it unconnected, if that fails. */
+int loadSend(loadThread *t, loadConn *c, long due){
+	char req[MAXLINE], path[MAXLINE];
+	int len, retry;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), urlPattern, pickUrl(t));
+	len = snprintf(req, sizeof(req), "GET %s%s%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+		viaProxy ? "http://" : "", viaProxy ? origin : "", path, origin);
+
+	/* A kept-alive connection may have been closed while idle: try once more on a new one. */
+	for (retry = 0; retry < 2; retry++){
+		if (0 > c->fd || 0 < retry){
+			loadDrop(c);
+			if (0 > (c->fd = loadConnect())){
+				return -1;
+			}
+		}
+		/* The socket's buffer is empty, so a short request goes in one write. */
+		if (len == (n = write(c->fd, req, len))){
+			c->busy = TRUE;
+			c->due = due;
+			c->len = 0;
+			c->headDone = FALSE;
+			c->remaining = -1;
+			c->hit = FALSE;
+			c->closing = FALSE;
+			parseBegin(&c->head, TRUE);
+			return 0;
+		}
+	}
+	loadDrop(c);
+	return -1;
 }
 
-void genrequest(char *request, char *method, char *uri){
-    /* create request string */
-    strcpy(request,"GET");
-    if (uri[strlen(uri)-1] == '/')
-        strcat(uri, "index.html");
-    strcat(request," ");
-    strcat(request, uri);
-    strcat(request, VERSION);
-    printf("%s",request);
+/* Reads what has arrived on c's busy connection. Returns TRUE once its response is complete or has failed. */
+int loadRead(loadThread *t, loadConn *c){
+	ssize_t n;
+	httpHeader *hdr;
+	long body;
+	int done;
+
+	while(1){
+		if (c->headDone){
+			n = read(c->fd, c->buf, LOADBUF);
+		}
+		else{
+			n = read(c->fd, c->buf + c->len, LOADBUF - c->len);
+		}
+		if (0 > n){
+			if (EAGAIN == errno || EWOULDBLOCK == errno){
+				return FALSE;
+			}
+			if (EINTR == errno){
+				continue;
+			}
+			break;
+		}
+		if (0 == n){
+			/* Ending the connection is how a body without a length ends. */
+			if (c->headDone && 0 > c->remaining){
+				loadDone(t, c, metricNow());
+				loadDrop(c);
+				return TRUE;
+			}
+			break;
+		}
+		t->bytes += n;
+
+		if (c->headDone){
+			if (0 <= c->remaining && 0 == (c->remaining -= n)){
+				loadDone(t, c, metricNow());
+				return TRUE;
+			}
+			continue;
+		}
+
+		c->len += n;
+		if (0 > (done = parseHead(&c->head, c->buf, c->len)) || (0 == done && LOADBUF == c->len)){
+			break;
+		}
+		if (0 == done){
+			continue;
+		}
+		c->headDone = TRUE;
+		c->hit = NULL != (hdr = parseFind(&c->head, "X-Cache")) && spanHas(hdr->value, "HIT");
+		c->closing = 1 > c->head.major || (1 == c->head.major && 1 > c->head.minor);
+		if (NULL != (hdr = parseFind(&c->head, "Connection"))){
+			c->closing = !spanHas(hdr->value, "keep-alive");
+		}
+		if (NULL != (hdr = parseFind(&c->head, "Transfer-Encoding")) && spanHas(hdr->value, "chunked")){
+			break;
+		}
+		if (NULL != (hdr = parseFind(&c->head, "Content-Length"))){
+			body = strtol(hdr->value.p, NULL, 10);
+			c->remaining = body - (long)(c->len - c->head.len);
+			if (0 >= c->remaining){
+				loadDone(t, c, metricNow());
+				return TRUE;
+			}
+		}
+		else{
+			/* Without a length the body runs to the end of the connection. */
+			c->closing = TRUE;
+		}
+	}
+
+	t->errors++;
+	loadDrop(c);
+	return TRUE;
 }
 
+/* Records c's answered request and frees it for the next. */
+void loadDone(loadThread *t, loadConn *c, long now){
+	long ns = now - c->due;
 
+	c->busy = FALSE;
+	if (c->closing){
+		loadDrop(c);
+	}
+	if (429 == c->head.status || 503 == c->head.status){
+		t->refused++;
+		return;
+	}
+	t->requests[c->hit]++;
+	t->hist[c->hit][metricBucket(ns)]++;
+	t->maxLat[c->hit] = ns > t->maxLat[c->hit] ? ns : t->maxLat[c->hit];
+	t->finished = now;
+}
+
+/* Closes c's connection, abandoning any request on it. */
+void loadDrop(loadConn *c){
+	if (0 <= c->fd){
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->busy = FALSE;
+}
+
+/* A new non-blocking connection to target, or -1. */
+int loadConnect(){
+	int fd;
+
+	if (0 > (fd = socket(AF_INET, SOCK_STREAM, 0))){
+		return -1;
+	}
+	if (0 > connect(fd, (struct sockaddr *)&target, sizeof(target))){
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+/* Opens the slowloris connections and sends each its first byte, so the attack is in place before the load starts. */
+void slowBegin(){
+	int i;
+
+	slowFds = Malloc(numSlow * sizeof(int));
+	slowSent = Calloc(numSlow, sizeof(long));
+	/* A request line and Host, then header after header, never the blank line. */
+	slowLen = snprintf(slowHead, sizeof(slowHead), "GET %s%s/obj/0 HTTP/1.1\r\nHost: %s\r\n", viaProxy ? "http://" : "", viaProxy ? origin : "", origin);
+	for (i = 0; i < numSlow; i++){
+		slowFds[i] = -1;
+	}
+	slowRound();
+}
+
+/* Slowloris thread: a round every SLOWGAP ms until the run is over. */
+void *slowRun(void *vargp){
+	struct timespec gap = { SLOWGAP / 1000, SLOWGAP % 1000 * 1000000L };
+	int i;
+
+	while (metricNow() < runStop){
+		nanosleep(&gap, NULL);
+		slowRound();
+	}
+	for (i = 0; i < numSlow; i++){
+		if (0 <= slowFds[i]){
+			close(slowFds[i]);
+		}
+	}
+	return NULL;
+}
+
+/* Sends the next byte of its head on every slowloris connection, opening again those the server has closed. */
+void slowRound(){
+	char scratch[MAXLINE], *more = "X-Slow: 1\r\n", c;
+	int i, moreLen = strlen(more);
+	ssize_t n;
+
+	for (i = 0; i < numSlow; i++){
+		if (0 > slowFds[i]){
+			if (0 > (slowFds[i] = loadConnect())){
+				continue;
+			}
+			slowSent[i] = 0;
+			slowOpened++;
+		}
+		/* Any answer, or the connection ending, means the server has given up on the head. */
+		n = recv(slowFds[i], scratch, sizeof(scratch), MSG_DONTWAIT);
+		c = slowSent[i] < slowLen ? slowHead[slowSent[i]] : more[(slowSent[i] - slowLen) % moreLen];
+		if (0 <= n || (EAGAIN != errno && EWOULDBLOCK != errno) || 1 != send(slowFds[i], &c, 1, MSG_NOSIGNAL)){
+			close(slowFds[i]);
+			slowFds[i] = -1;
+			slowClosed++;
+			continue;
+		}
+		slowSent[i]++;
+	}
+}
+
+/* The next url to ask for: uniform, or by binary search of the Zipf cdf. */
+int pickUrl(loadThread *t){
+	double u = erand48(t->seed);
+	int lo = 0, hi = numUrls - 1, mid;
+
+	if (NULL == zipfCdf){
+		return (int)(u * numUrls);
+	}
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (zipfCdf[mid] < u){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Writes numUrls objects of size bytes to dir/obj/0, dir/obj/1, ... */
+void makeCorpus(char *dir, long size){
+	char path[MAXLINE], line[64];
+	long off;
+	int i, n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/obj", dir);
+	if (0 > mkdir(dir, 0755) && EEXIST != errno){
+		fprintf(stderr, "Error: cannot make %s: %s\n", dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (0 > mkdir(path, 0755) && EEXIST != errno){
+		fprintf(stderr, "Error: cannot make %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < numUrls; i++){
+		snprintf(path, sizeof(path), "%s/obj/%d", dir, i);
+		if (NULL == (f = fopen(path, "w"))){
+			fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		/* Numbered lines, so a body that comes back wrong is easy to spot. */
+		for (off = 0; off < size; off += n){
+			n = snprintf(line, sizeof(line), "object %d line %ld\n", i, off);
+			n = n < size - off ? n : size - off;
+			fwrite(line, 1, n, f);
+		}
+		fclose(f);
+	}
+	printf("wrote %d objects of %ld bytes to %s/obj\n", numUrls, size, dir);
+}
+
+/* The latency, in ns, that pct of count requests in hist came in under, to the top of its bucket. */
+long percentile(long *hist, long count, long max, double pct){
+	long want = (long)ceil(pct * count), seen = 0;
+	int b;
+
+	for (b = 0; b < METRICBUCKETS; b++){
+		if ((seen += hist[b]) >= want){
+			return metricBucketTop(b) < max ? metricBucketTop(b) : max;
+		}
+	}
+	return max;
+}
+
+/* Prints one line of the latency table. */
+void printRow(char *name, long *hist, long count, long max){
+	if (0 == count){
+		printf("%-10s %9s %9s %9s %9s\n", name, "-", "-", "-", "-");
+		return;
+	}
+	printf("%-10s %9.3f %9.3f %9.3f %9.3f\n", name, percentile(hist, count, max, 0.50) / 1e6,
+	       percentile(hist, count, max, 0.99) / 1e6, percentile(hist, count, max, 0.999) / 1e6, max / 1e6);
+}
+
+void usage(char *prog){
+	fprintf(stderr, "usage: %s [-t threads] [-c conns] [-r rate] [-d secs] [-n urls] [-z s] [-u pattern] [-x proxyhost:port] [-l conns] host port\n"
+	        "       %s -m dir [-n urls] [-s bytes]\n", prog, prog);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,260 @@
+/*
+ * ----------------------------------------------------------
+ * deadline.c - Per-connection deadlines on a hashed timer
+ *              wheel, so that a client trickling its head or
+ *              an origin stalling mid-body cannot hold a
+ *              thread, or a connection, forever.
+ *
+ * - a connection waiting on a request head, an origin
+ *   connect, an origin's first byte or a stalled relay has
+ *   a deadline armed for that wait; each has its own
+ *   timeout, and a timeout of 0 turns it off
+ * - the wheel has DEADLINESLOTS slots of DEADLINETICK ms
+ *   each; a deadline is linked into the slot its tick falls
+ *   in, and one further out than a turn is passed over
+ *   until its turn comes, so arming and cancelling are a
+ *   list link under a lock whatever the number of deadlines
+ * - there are DEADLINEWHEELS wheels, picked by descriptor,
+ *   each under its own lock; one thread runs them all
+ * - progress on an idle deadline only notes the tick, with
+ *   no lock; it is moved further out when its slot comes up
+ * - a wait with nothing to shut down, a name lookup before
+ *   an origin connect, is bounded with deadlineLimit instead
+ * - an expired deadline shuts its descriptors down, which
+ *   wakes whatever is blocked on them or their epoll loop;
+ *   the owner finds reads and writes failing, sees it fired
+ *   and closes the connection. Owners cancel before closing
+ *   a descriptor, so a reused one is never shut down
+ * - expirations are counted by kind for the status page
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "metrics.h"
+#include "deadline.h"
+
+/* One wheel: its slots, and the next tick it has to run. */
+typedef struct deadlineWheel{
+	pthread_mutex_t lock;
+	long tick;
+	long pending;
+	deadline *slots[DEADLINESLOTS];
+} deadlineWheel;
+
+__thread deadline *deadlineMine;
+
+deadlineWheel deadlineWheels[DEADLINEWHEELS];
+long deadlineSpans[NUMDEADLINES];	/* ticks; 0 for no deadline */
+long deadlineNow;					/* the tick the wheels have been run up to */
+
+/* Counters for the status page. */
+long deadlineExpired[NUMDEADLINES];
+
+void *deadlineThread(void *vargp);
+long deadlineTick();
+void deadlineLink(deadlineWheel *w, deadline *d);
+void deadlineUnlink(deadlineWheel *w, deadline *d);
+void deadlineRun(deadlineWheel *w, long now);
+
+/* Sets the timeouts, in ms, and starts the thread that runs the wheels if any of them is on. */
+void deadlineInit(long headerMs, long connectMs, long firstByteMs, long idleMs){
+	long ms[NUMDEADLINES] = { headerMs, connectMs, firstByteMs, idleMs };
+	pthread_t tid;
+	int i, any = FALSE;
+
+	for (i = 0; i < NUMDEADLINES; i++){
+		deadlineSpans[i] = 0 < ms[i] ? (ms[i] + DEADLINETICK - 1) / DEADLINETICK : 0;
+		any = any || 0 < deadlineSpans[i];
+	}
+	deadlineNow = deadlineTick();
+	for (i = 0; i < DEADLINEWHEELS; i++){
+		pthread_mutex_init(&deadlineWheels[i].lock, NULL);
+		deadlineWheels[i].tick = deadlineNow + 1;
+	}
+	if (any && 0 != pthread_create(&tid, NULL, deadlineThread, NULL)){
+		fprintf(stderr, "Error creating deadline thread.\n");
+		exit(1);
+	}
+}
+
+/* Readies d for a new connection, unarmed. */
+void deadlineClear(deadline *d){
+	memset(d, 0, sizeof(deadline));
+	d->wheel = -1;
+	d->fd = d->fd2 = -1;
+}
+
+/* Arms d for kind's timeout, in place of whatever it was armed for: when it expires, fd and fd2 (if not -1) are shut down. Does nothing if d is NULL, kind has no timeout or d has already fired. */
+void deadlineArm(deadline *d, int kind, int fd, int fd2){
+	deadlineWheel *w;
+
+	if (NULL == d){
+		return;
+	}
+	deadlineCancel(d);
+	if (0 >= deadlineSpans[kind] || __atomic_load_n(&d->fired, __ATOMIC_ACQUIRE)){
+		return;
+	}
+	d->kind = kind;
+	d->fd = fd;
+	d->fd2 = fd2;
+	d->touched = __atomic_load_n(&deadlineNow, __ATOMIC_RELAXED);
+	/* A tick is part gone already, so a whole one more keeps the deadline from coming early. */
+	d->expires = d->touched + deadlineSpans[kind] + 1;
+	d->wheel = (unsigned int)fd % DEADLINEWHEELS;
+	w = &deadlineWheels[d->wheel];
+	pthread_mutex_lock(&w->lock);
+	deadlineLink(w, d);
+	w->pending++;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Notes progress on d, which pushes an idle deadline back. Costs a store. */
+void deadlineTouch(deadline *d){
+	if (NULL != d){
+		__atomic_store_n(&d->touched, __atomic_load_n(&deadlineNow, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
+}
+
+/* Disarms d. Once it returns, d's descriptors will not be shut down, so they may be closed. */
+void deadlineCancel(deadline *d){
+	deadlineWheel *w;
+	int wheel;
+
+	/* Only the wheel's thread disarms d behind our back, and then it stays disarmed. */
+	if (NULL == d || 0 > (wheel = __atomic_load_n(&d->wheel, __ATOMIC_ACQUIRE))){
+		return;
+	}
+	w = &deadlineWheels[wheel];
+	pthread_mutex_lock(&w->lock);
+	if (wheel == d->wheel){
+		deadlineUnlink(w, d);
+		w->pending--;
+		d->wheel = -1;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Disarms d if it would shut fd down, as fd is about to be closed or handed to someone else. */
+void deadlineRelease(deadline *d, int fd){
+	if (NULL != d && 0 <= __atomic_load_n(&d->wheel, __ATOMIC_ACQUIRE) && (fd == d->fd || fd == d->fd2)){
+		deadlineCancel(d);
+	}
+}
+
+/* TRUE if d has expired, so that what its descriptors said since is not to be believed. */
+int deadlineFired(deadline *d){
+	return NULL != d && __atomic_load_n(&d->fired, __ATOMIC_ACQUIRE);
+}
+
+/* How long, in ms, d would allow a wait of kind that has no descriptor to shut down; 0 for no limit, as when d is NULL or kind has no timeout. */
+long deadlineLimit(deadline *d, int kind){
+	return NULL != d ? deadlineSpans[kind] * DEADLINETICK : 0;
+}
+
+/* Runs every wheel up to the current tick, a tick at a time. */
+void *deadlineThread(void *vargp){
+	struct timespec ts = { 0, DEADLINETICK * 1000000L };
+	long now;
+	int i;
+
+	pthread_detach(pthread_self());
+	while(1){
+		nanosleep(&ts, NULL);
+		now = deadlineTick();
+		__atomic_store_n(&deadlineNow, now, __ATOMIC_RELAXED);
+		for (i = 0; i < DEADLINEWHEELS; i++){
+			deadlineRun(&deadlineWheels[i], now);
+		}
+	}
+	return NULL;
+}
+
+/* The current tick of the monotonic clock. */
+long deadlineTick(){
+	return metricNow() / 1000000 / DEADLINETICK;
+}
+
+/* Links d into the slot of its tick. Called with w locked. */
+void deadlineLink(deadlineWheel *w, deadline *d){
+	deadline **slot;
+
+	if (d->expires < w->tick){
+		d->expires = w->tick;
+	}
+	slot = &w->slots[d->expires & (DEADLINESLOTS - 1)];
+	if (NULL != (d->next = *slot)){
+		d->next->pprev = &d->next;
+	}
+	d->pprev = slot;
+	*slot = d;
+}
+
+/* Unlinks d from its slot. Called with w locked. */
+void deadlineUnlink(deadlineWheel *w, deadline *d){
+	if (NULL != d->next){
+		d->next->pprev = d->pprev;
+	}
+	*d->pprev = d->next;
+	d->next = NULL;
+	d->pprev = NULL;
+}
+
+/* Expires what is due in w's slots up to tick now, moving idle deadlines with recent progress further out. */
+void deadlineRun(deadlineWheel *w, long now){
+	deadline *d, *next;
+	long due;
+
+	pthread_mutex_lock(&w->lock);
+	for (; w->tick <= now; w->tick++){
+		for (d = w->slots[w->tick & (DEADLINESLOTS - 1)]; NULL != d; d = next){
+			next = d->next;
+			/* Due on a later turn of the wheel. */
+			if (d->expires > w->tick){
+				continue;
+			}
+			deadlineUnlink(w, d);
+			due = __atomic_load_n(&d->touched, __ATOMIC_RELAXED) + deadlineSpans[d->kind] + 1;
+			if (DEADLINE_IDLE == d->kind && due > w->tick){
+				d->expires = due;
+				deadlineLink(w, d);
+				continue;
+			}
+			w->pending--;
+			__atomic_add_fetch(&deadlineExpired[d->kind], 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&d->fired, TRUE, __ATOMIC_RELEASE);
+			shutdown(d->fd, SHUT_RDWR);
+			if (0 <= d->fd2){
+				shutdown(d->fd2, SHUT_RDWR);
+			}
+			/* Last: until then an owner cancelling has to wait for the lock, so it cannot close the descriptors, or free d, under us. */
+			__atomic_store_n(&d->wheel, -1, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Writes "name value" lines for the status page. */
+int deadlineStats(char *buf, size_t len){
+	long pending = 0;
+	int i;
+
+	for (i = 0; i < DEADLINEWHEELS; i++){
+		pending += __atomic_load_n(&deadlineWheels[i].pending, __ATOMIC_RELAXED);
+	}
+	return snprintf(buf, len,
+		"deadline_pending %ld\n"
+		"deadline_expired_header %ld\n"
+		"deadline_expired_connect %ld\n"
+		"deadline_expired_first_byte %ld\n"
+		"deadline_expired_idle %ld\n",
+		pending,
+		__atomic_load_n(&deadlineExpired[DEADLINE_HEADER], __ATOMIC_RELAXED),
+		__atomic_load_n(&deadlineExpired[DEADLINE_CONNECT], __ATOMIC_RELAXED),
+		__atomic_load_n(&deadlineExpired[DEADLINE_FIRST_BYTE], __ATOMIC_RELAXED),
+		__atomic_load_n(&deadlineExpired[DEADLINE_IDLE], __ATOMIC_RELAXED));
+}
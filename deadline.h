@@ -0,0 +1,43 @@
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include "csapp.h"
+
+#define DEADLINETICK 100		/* ms a slot of the wheel covers */
+#define DEADLINESLOTS 1024		/* slots per wheel, a power of two: one turn is about 100 seconds */
+#define DEADLINEWHEELS 16		/* wheels, each under its own lock, picked by descriptor */
+#define DEADLINEHEADER 30		/* default --header-timeout, s */
+#define DEADLINECONNECT 10		/* default --connect-timeout, s */
+#define DEADLINEFIRSTBYTE 60	/* default --first-byte-timeout, s */
+#define DEADLINEIDLE 60			/* default --idle-timeout, s */
+
+/* What a connection is waiting on while its deadline is armed. Only an idle deadline is pushed back by progress. */
+enum { DEADLINE_HEADER, DEADLINE_CONNECT, DEADLINE_FIRST_BYTE, DEADLINE_IDLE, NUMDEADLINES };
+
+/* One connection's deadline. It lives in the connection's own state and is linked into a wheel slot while armed, so arming and cancelling allocate nothing. */
+typedef struct deadline{
+	struct deadline *next;
+	struct deadline **pprev;
+	long expires;		/* tick it is due at */
+	long touched;		/* tick of the last progress */
+	int wheel;			/* the wheel it is linked into; -1 when not armed */
+	int kind;
+	int fd;				/* shut down when it expires */
+	int fd2;			/* shut down with it; -1 for none */
+	int fired;			/* it has expired; it is never armed again */
+} deadline;
+
+/* The deadline of the connection the calling thread is serving, if any. */
+extern __thread deadline *deadlineMine;
+
+void deadlineInit(long headerMs, long connectMs, long firstByteMs, long idleMs);
+void deadlineClear(deadline *d);
+void deadlineArm(deadline *d, int kind, int fd, int fd2);
+void deadlineTouch(deadline *d);
+void deadlineCancel(deadline *d);
+void deadlineRelease(deadline *d, int fd);
+int  deadlineFired(deadline *d);
+long deadlineLimit(deadline *d, int kind);
+int  deadlineStats(char *buf, size_t len);
+
+#endif /* __DEADLINE_H__ */
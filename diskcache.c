@@ -0,0 +1,333 @@
+/*
+ * ----------------------------------------------------------
+ * diskcache.c - Second cache tier on disk for objects too
+ *               big for the in-memory cache.
+ *
+ * - bodies larger than MAXOBJ are written to a file in the
+ *   cache directory while they stream to the client; once
+ *   complete the file becomes a cache entry
+ * - files are unlinked from the start (O_TMPFILE, or unlink
+ *   right after mkstemp), so nothing is left behind by a
+ *   crash and eviction only has to close the descriptor
+ * - hits write the head from memory and the body straight
+ *   from the file with sendfile()
+ * - the tier has its own byte budget and largest object, and
+ *   evicts least recently used entries to stay within it
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "relay.h"
+#include "diskcache.h"
+#include "deadline.h"
+
+diskObj *diskTable[DISKBUCKETS];
+diskObj *diskHead;		/* most recently used */
+diskObj *diskTail;		/* next to be evicted */
+pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+
+char *diskDir = NULL;
+long long diskMaxBytes;
+long long diskMaxObject;
+long long diskUsed;
+long diskObjects;
+
+/* Counters for the status page. */
+long diskHits;
+long diskStores;
+long diskEvictions;
+long diskFailures;
+
+int  diskOpenFile();
+void diskUnlink(diskObj *obj);
+void diskPush(diskObj *obj);
+
+/* Enables the tier in dir with a budget of maxBytes, holding objects of up to maxObject bytes. */
+void diskInit(char *dir, long long maxBytes, long long maxObject){
+	struct stat st;
+
+	if (0 > stat(dir, &st) || !S_ISDIR(st.st_mode) || 0 != access(dir, W_OK)){
+		fprintf(stderr, "Error using %s as the disk cache directory; disk tier disabled.\n", dir);
+		return;
+	}
+	diskDir = dir;
+	diskMaxBytes = maxBytes;
+	diskMaxObject = maxObject < maxBytes ? maxObject : maxBytes;
+}
+
+/* TRUE if large objects should be offered to the tier. */
+int diskEnabled(){
+	return NULL != diskDir;
+}
+
+/* Starts a body of expected bytes (-1 if not yet known). Returns NULL if it would not be kept. */
+diskWriter *diskBegin(long long expected){
+	diskWriter *w;
+
+	if (!diskEnabled() || diskMaxObject < expected){
+		return NULL;
+	}
+	if (NULL == (w = malloc(sizeof(diskWriter)))){
+		return NULL;
+	}
+	if (0 > (w->fd = diskOpenFile())){
+		__atomic_add_fetch(&diskFailures, 1, __ATOMIC_RELAXED);
+		free(w);
+		return NULL;
+	}
+	w->written = 0;
+	w->failed = FALSE;
+	return w;
+}
+
+/* Appends n body bytes. Once a write fails or the body outgrows the tier the writer only waits to be aborted. Returns -1 then. */
+int diskWrite(diskWriter *w, char *data, size_t n){
+	ssize_t out;
+	size_t done = 0;
+
+	if (w->failed || diskMaxObject < w->written + (long long)n){
+		w->failed = TRUE;
+		return -1;
+	}
+	while (done < n){
+		if (0 > (out = write(w->fd, data + done, n - done))){
+			if (EINTR == errno){
+				continue;
+			}
+			w->failed = TRUE;
+			return -1;
+		}
+		done += out;
+	}
+	w->written += n;
+	return 0;
+}
+
+/* Makes the written body an entry for url with the given response head, evicting older entries to fit. Frees w. */
+void diskCommit(diskWriter *w, char *url, char *head, size_t hdrLen, long expires){
+	unsigned long hash = cacheHash(url);
+	diskObj *obj, *old;
+
+	if (w->failed || NULL == (obj = calloc(1, sizeof(diskObj)))){
+		diskAbort(w);
+		return;
+	}
+	if (NULL == (obj->head = malloc(hdrLen)) || NULL == (obj->url = strdup(url))){
+		free(obj->head);
+		free(obj);
+		diskAbort(w);
+		return;
+	}
+	memcpy(obj->head, head, hdrLen);
+	obj->hdrLen = hdrLen;
+	obj->fetched = time(NULL);
+	obj->expires = expires;
+	obj->fd = w->fd;
+	obj->bodyLen = w->written;
+	obj->hash = hash;
+	obj->refs = 1;
+	free(w);
+
+	pthread_mutex_lock(&diskLock);
+	/* A newer copy replaces an older one. */
+	for (old = diskTable[hash % DISKBUCKETS]; NULL != old; old = old->hnext){
+		if (hash == old->hash && 0 == strcmp(url, old->url)){
+			diskUnlink(old);
+			break;
+		}
+	}
+	while (NULL != diskTail && diskMaxBytes < diskUsed + obj->bodyLen){
+		diskUnlink(diskTail);
+		__atomic_add_fetch(&diskEvictions, 1, __ATOMIC_RELAXED);
+	}
+	obj->hnext = diskTable[hash % DISKBUCKETS];
+	diskTable[hash % DISKBUCKETS] = obj;
+	diskPush(obj);
+	diskUsed += obj->bodyLen;
+	diskObjects++;
+	pthread_mutex_unlock(&diskLock);
+	__atomic_add_fetch(&diskStores, 1, __ATOMIC_RELAXED);
+}
+
+/* Discards a body that will not be kept. Frees w. */
+void diskAbort(diskWriter *w){
+	close(w->fd);
+	free(w);
+}
+
+/* Returns the entry for url with a reference held for the caller, or NULL on a miss. */
+diskObj *diskGet(char *url){
+	unsigned long hash;
+	diskObj *obj;
+
+	if (!diskEnabled()){
+		return NULL;
+	}
+	hash = cacheHash(url);
+	pthread_mutex_lock(&diskLock);
+	for (obj = diskTable[hash % DISKBUCKETS]; NULL != obj; obj = obj->hnext){
+		if (hash == obj->hash && 0 == strcmp(url, obj->url)){
+			break;
+		}
+	}
+	if (NULL != obj){
+		/* Move to the front of the LRU list. */
+		if (diskHead != obj){
+			obj->prev->next = obj->next;
+			if (NULL != obj->next){
+				obj->next->prev = obj->prev;
+			}
+			else{
+				diskTail = obj->prev;
+			}
+			diskPush(obj);
+		}
+		obj->refs++;
+	}
+	pthread_mutex_unlock(&diskLock);
+
+	if (NULL != obj){
+		__atomic_add_fetch(&diskHits, 1, __ATOMIC_RELAXED);
+	}
+	return obj;
+}
+
+/* Sends obj to a blocking client: the head from memory, the body with sendfile. Returns -1 if the client has gone. */
+int diskSend(int connfd, diskObj *obj, int keepAlive){
+	struct iovec iov[3];
+	off_t off = 0;
+	ssize_t n;
+
+	iov[0].iov_base = obj->head;
+	iov[0].iov_len = obj->hdrLen;
+	iov[1].iov_base = keepAlive ? "X-Cache: HIT\r\nConnection: keep-alive\r\n" : "X-Cache: HIT\r\nConnection: close\r\n";
+	iov[1].iov_len = strlen(iov[1].iov_base);
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+	if (0 > relayWritev(connfd, iov, 3)){
+		return -1;
+	}
+
+	while (off < obj->bodyLen){
+		if (0 > (n = sendfile(connfd, obj->fd, &off, obj->bodyLen - off))){
+			if (EINTR == errno){
+				continue;
+			}
+			return -1;
+		}
+		if (0 == n){
+			return -1;
+		}
+		deadlineTouch(deadlineMine);
+	}
+	return 0;
+}
+
+/* Drops a reference to obj, closing its file once neither the tier nor any reader holds it. */
+void diskRelease(diskObj *obj){
+	int refs;
+
+	pthread_mutex_lock(&diskLock);
+	refs = --obj->refs;
+	pthread_mutex_unlock(&diskLock);
+
+	if (0 == refs){
+		close(obj->fd);
+		free(obj->head);
+		free(obj->url);
+		free(obj);
+	}
+}
+
+/* An empty, already unlinked file in the cache directory. Returns -1 if none can be made. */
+int diskOpenFile(){
+	char path[MAXLINE];
+	int fd;
+
+	if (0 <= (fd = open(diskDir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600))){
+		return fd;
+	}
+	/* Filesystems without O_TMPFILE get a named file that is unlinked at once. */
+	snprintf(path, sizeof(path), "%s/proxy-XXXXXX", diskDir);
+	if (0 > (fd = mkostemp(path, O_CLOEXEC))){
+		return -1;
+	}
+	unlink(path);
+	return fd;
+}
+
+/* Takes obj out of the table and LRU list and drops the tier's reference. Caller holds diskLock. */
+void diskUnlink(diskObj *obj){
+	diskObj **pp;
+
+	for (pp = &diskTable[obj->hash % DISKBUCKETS]; *pp != obj; pp = &(*pp)->hnext)
+		;
+	*pp = obj->hnext;
+
+	if (NULL != obj->prev){
+		obj->prev->next = obj->next;
+	}
+	else{
+		diskHead = obj->next;
+	}
+	if (NULL != obj->next){
+		obj->next->prev = obj->prev;
+	}
+	else{
+		diskTail = obj->prev;
+	}
+	diskUsed -= obj->bodyLen;
+	diskObjects--;
+
+	/* Readers still sending it keep the file open. */
+	if (0 == --obj->refs){
+		close(obj->fd);
+		free(obj->head);
+		free(obj->url);
+		free(obj);
+	}
+}
+
+/* Puts obj at the front of the LRU list. Caller holds diskLock. */
+void diskPush(diskObj *obj){
+	obj->prev = NULL;
+	obj->next = diskHead;
+	if (NULL != diskHead){
+		diskHead->prev = obj;
+	}
+	diskHead = obj;
+	if (NULL == diskTail){
+		diskTail = obj;
+	}
+}
+
+/* Writes the disk tier counters as "name value" lines to buf. Returns the length written. */
+int diskStats(char *buf, size_t len){
+	long long used;
+	long objects;
+
+	pthread_mutex_lock(&diskLock);
+	used = diskUsed;
+	objects = diskObjects;
+	pthread_mutex_unlock(&diskLock);
+
+	return snprintf(buf, len,
+		"disk_objects %ld\n"
+		"disk_bytes %lld\n"
+		"disk_hits %ld\n"
+		"disk_stores %ld\n"
+		"disk_evictions %ld\n"
+		"disk_failures %ld\n",
+		objects, used,
+		__atomic_load_n(&diskHits, __ATOMIC_RELAXED),
+		__atomic_load_n(&diskStores, __ATOMIC_RELAXED),
+		__atomic_load_n(&diskEvictions, __ATOMIC_RELAXED),
+		__atomic_load_n(&diskFailures, __ATOMIC_RELAXED));
+}
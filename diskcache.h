@@ -0,0 +1,47 @@
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include "csapp.h"
+
+#define DISKBUCKETS 4096
+
+/*
+ * A large object in the disk tier: its response head in
+ * memory and its body in an unlinked file. Reference counted
+ * like cacheObj, so an evicted body stays readable until the
+ * last sendfile finishes.
+ */
+typedef struct diskObj{
+	int refs;
+	int fd;
+	off_t bodyLen;
+	size_t hdrLen;
+	long fetched;		/* when the origin last sent or confirmed it, in seconds since the epoch */
+	long expires;		/* when it goes stale; a 304 moves both on */
+	char *head;			/* response head up to, not including, its blank line */
+	char *url;
+	unsigned long hash;
+	struct diskObj *hnext;	/* bucket chain */
+	struct diskObj *prev;	/* more recently used */
+	struct diskObj *next;	/* less recently used */
+} diskObj;
+
+/* A body being written to the disk tier while it streams to the client. */
+typedef struct diskWriter{
+	int fd;
+	off_t written;
+	int failed;
+} diskWriter;
+
+void diskInit(char *dir, long long maxBytes, long long maxObject);
+int  diskEnabled();
+diskWriter *diskBegin(long long expected);
+int  diskWrite(diskWriter *w, char *data, size_t n);
+void diskCommit(diskWriter *w, char *url, char *head, size_t hdrLen, long expires);
+void diskAbort(diskWriter *w);
+diskObj *diskGet(char *url);
+int  diskSend(int connfd, diskObj *obj, int keepAlive);
+void diskRelease(diskObj *obj);
+int  diskStats(char *buf, size_t len);
+
+#endif /* __DISKCACHE_H__ */
@@ -0,0 +1,802 @@
+/*
+ * ----------------------------------------------------------
+ * event.c - Event-driven front end for the proxy.
+ *
+ * Runs a fixed number of epoll loops (one per core by
+ * default) instead of one thread per connection:
+ *
+ * - every loop watches the shared, non-blocking listenfd
+ *   and accepts until EAGAIN
+ * - sockets are edge-triggered, so each handler keeps going
+ *   until the kernel says EAGAIN
+ * - each connection is a small state machine that mirrors
+ *   procRequest/genRequest: read the request, resolve the
+ *   host, connect upstream, send the request, relay the
+ *   response while filling the cache, or write a pinned
+ *   cache hit
+ * - name resolution never blocks a loop: the resolver calls
+ *   back and the loop's eventfd resumes the connection
+ * - a connection lives on the loop that accepted it, so its
+ *   state is never shared between threads
+ * - each stage has its deadline (see deadline.c); one that
+ *   passes shuts the connection's sockets down, and the
+ *   event that follows finishes it
+ * - a connection only holds a buffer, from the shared pool
+ *   (see bufpool.c), while it has bytes in hand, and its
+ *   parsed request head only until the request is under way,
+ *   so one that is waiting costs little more than its evConn
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "event.h"
+#include "cache.h"
+#include "resolver.h"
+#include "fresh.h"
+#include "refresh.h"
+#include "metrics.h"
+#include "admit.h"
+#include "deadline.h"
+#include "bufpool.h"
+
+#define MAXEVENTS 256
+
+/* Connection states, in the order a request moves through them. */
+enum { READ_REQ, RESOLVING, CONNECTING, SEND_REQ, RELAY, WRITE_HIT, DONE };
+
+typedef struct evConn evConn;
+typedef struct evLoop evLoop;
+
+/* A descriptor registered with epoll; the event hands it back so we can find its connection. */
+typedef struct evSource{
+	int fd;
+	evConn *conn;
+} evSource;
+
+struct evConn{
+	evSource client;
+	evSource server;
+	int state;
+	char *buf;		/* request head, then upstream request, then relayed bytes; NULL while there are none */
+	size_t len;
+	size_t off;
+	size_t cap;
+	int pooled;		/* buf came from the pool rather than malloc */
+	httpHead *req;		/* request head, parsed as it arrives; NULL before and after */
+	cacheObj *hit;		/* pinned cache hit being written */
+	char *object;	/* response being collected for the cache */
+	size_t size;
+	char *uri;
+	char *host;
+	int port;
+	long stamp;		/* when the current stage began, for its histogram */
+	long began;		/* when the request head was complete */
+	int waiting;		/* a resolver callback is outstanding */
+	deadline dl;
+	evLoop *loop;
+	evConn *nextDone;
+	evConn *nextResolved;
+};
+
+/* Per-loop state. */
+struct evLoop{
+	int epfd;
+	int listenfd;
+	int wakefd;			/* eventfd the resolver pokes when it has answered */
+	pthread_mutex_t lock;	/* protects resolved, which resolver threads push onto */
+	evConn *resolved;
+	evConn *done;	/* finished connections, freed once the current batch of events is handled */
+};
+
+void *eventLoop(void *vargp);
+void eventAccept(evLoop *loop);
+void eventWake(evLoop *loop);
+void connResolved(void *arg);
+void connConnect(evLoop *loop, evConn *c, struct in_addr addr);
+void connDrive(evLoop *loop, evConn *c, evSource *src, unsigned int events);
+int  connReadRequest(evConn *c);
+void connStartRequest(evLoop *loop, evConn *c);
+int  connBuildRequest(evConn *c, char *host, char *filePath);
+int  connRelay(evConn *c);
+int  connWrite(int fd, char *data, size_t *off, size_t len);
+int  connWritev(int fd, struct iovec *iov, int cnt, size_t *off);
+int  connBuf(evConn *c, size_t cap);
+void connBufDone(evConn *c);
+void connFinish(evLoop *loop, evConn *c);
+int  openNonblock(struct in_addr addr, int numPort, int *pending);
+int  setNonblock(int fd);
+
+/* Start loops event threads on listenfd and run the last one on the calling thread. */
+void eventRun(int listenfd, int loops){
+	evLoop *loop;
+	pthread_t tid;
+	int i;
+
+	if (0 > setNonblock(listenfd)){
+		fprintf(stderr, "Error making listenfd non-blocking.\n");
+		exit(1);
+	}
+
+	for (i = 0; i < loops; i++){
+		if (NULL == (loop = calloc(1, sizeof(evLoop)))){
+			fprintf(stderr, "Error allocating memory for event loop.\n");
+			exit(1);
+		}
+		loop->listenfd = listenfd;
+		if (i == loops - 1){
+			eventLoop(loop);
+		}
+		else if (0 != pthread_create(&tid, NULL, eventLoop, loop)){
+			fprintf(stderr, "Error creating event loop thread.\n");
+			exit(1);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* Wait for events and hand each one to the connection it belongs to. */
+void *eventLoop(void *vargp){
+	evLoop *loop = vargp;
+	struct epoll_event ev, events[MAXEVENTS];
+	evSource listenSrc, wakeSrc;
+	evConn *c;
+	int i, n;
+
+	if (0 > (loop->epfd = epoll_create1(0))){
+		fprintf(stderr, "Error creating epoll instance.\n");
+		exit(1);
+	}
+
+	/* Only wake one loop per incoming connection when the kernel supports it. */
+	listenSrc.fd = loop->listenfd;
+	listenSrc.conn = NULL;
+	ev.data.ptr = &listenSrc;
+	ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+	if (0 > epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev)){
+		ev.events = EPOLLIN | EPOLLET;
+		if (0 > epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev)){
+			fprintf(stderr, "Error adding listenfd to epoll.\n");
+			exit(1);
+		}
+	}
+
+	/* Resolver callbacks wake the loop through an eventfd. */
+	if (0 > (loop->wakefd = eventfd(0, EFD_NONBLOCK)) || 0 != pthread_mutex_init(&loop->lock, NULL)){
+		fprintf(stderr, "Error creating event loop wakeup.\n");
+		exit(1);
+	}
+	wakeSrc.fd = loop->wakefd;
+	wakeSrc.conn = NULL;
+	ev.data.ptr = &wakeSrc;
+	ev.events = EPOLLIN | EPOLLET;
+	if (0 > epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev)){
+		fprintf(stderr, "Error adding eventfd to epoll.\n");
+		exit(1);
+	}
+
+	while(1){
+		if (0 > (n = epoll_wait(loop->epfd, events, MAXEVENTS, -1))){
+			if (EINTR != errno){
+				fprintf(stderr, "Error waiting for events.\n");
+			}
+			continue;
+		}
+
+		for (i = 0; i < n; i++){
+			evSource *src = events[i].data.ptr;
+			if (NULL == src->conn){
+				if (src->fd == loop->listenfd){
+					eventAccept(loop);
+				}
+				else{
+					eventWake(loop);
+				}
+			}
+			else if (DONE != src->conn->state){
+				connDrive(loop, src->conn, src, events[i].events);
+			}
+		}
+
+		/* Nothing in this batch can refer to these any more. */
+		while (NULL != (c = loop->done)){
+			loop->done = c->nextDone;
+			connBufDone(c);
+			free(c->req);
+			free(c->object);
+			free(c->uri);
+			free(c->host);
+			if (NULL != c->hit){
+				cacheRelease(c->hit);
+			}
+			free(c);
+		}
+	}
+	return NULL;
+}
+
+/* Accept every pending connection and register it with this loop. */
+void eventAccept(evLoop *loop){
+	struct epoll_event ev;
+	struct sockaddr_in addr;
+	socklen_t len;
+	evConn *c;
+	int connfd, reason;
+
+	while(1){
+		len = sizeof(addr);
+		if (0 > (connfd = accept4(loop->listenfd, (SA *)&addr, &len, SOCK_NONBLOCK))){
+			if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno){
+				fprintf(stderr, "Error accepting connfd.\n");
+			}
+			if (EINTR == errno){
+				continue;
+			}
+			return;
+		}
+
+		if (ADMIT_OK != (reason = admitConn(connfd, &addr))){
+			admitRefuse(connfd, reason);
+			close(connfd);
+			continue;
+		}
+		if (NULL == (c = calloc(1, sizeof(evConn)))){
+			fprintf(stderr, "Error allocating memory for connection.\n");
+			admitRefuse(connfd, ADMIT_BUSY);
+			admitDone(connfd);
+			close(connfd);
+			continue;
+		}
+		c->client.fd = connfd;
+		c->client.conn = c;
+		c->server.fd = -1;
+		c->server.conn = c;
+		c->state = READ_REQ;
+		c->loop = loop;
+		deadlineClear(&c->dl);
+		metricCount(METRIC_CONNS_OPENED, 1);
+
+		ev.data.ptr = &c->client;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		if (0 > epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev)){
+			fprintf(stderr, "Error adding connfd to epoll.\n");
+			admitDone(connfd);
+			close(connfd);
+			free(c);
+			continue;
+		}
+		deadlineArm(&c->dl, DEADLINE_HEADER, connfd, -1);
+		connDrive(loop, c, &c->client, EPOLLIN);
+	}
+}
+
+/* Resume the connections whose names the resolver has answered. */
+void eventWake(evLoop *loop){
+	evConn *c, *next;
+	uint64_t count;
+
+	while (0 < read(loop->wakefd, &count, sizeof(count)))
+		;
+	pthread_mutex_lock(&loop->lock);
+	c = loop->resolved;
+	loop->resolved = NULL;
+	pthread_mutex_unlock(&loop->lock);
+
+	for (; NULL != c; c = next){
+		next = c->nextResolved;
+		c->waiting = FALSE;
+		connDrive(loop, c, NULL, 0);
+	}
+}
+
+/* Resolver callback, run on a resolver thread: hand c back to its loop. */
+void connResolved(void *arg){
+	evConn *c = arg;
+	evLoop *loop = c->loop;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&loop->lock);
+	c->nextResolved = loop->resolved;
+	loop->resolved = c;
+	pthread_mutex_unlock(&loop->lock);
+	if (0 > write(loop->wakefd, &one, sizeof(one)) && EAGAIN != errno){
+		fprintf(stderr, "Error waking event loop.\n");
+	}
+}
+
+/* Advance c until it needs to wait for the kernel or is finished. */
+void connDrive(evLoop *loop, evConn *c, evSource *src, unsigned int events){
+	struct in_addr addr;
+	struct iovec iov[3];
+	httpHead resp;
+	char *head;
+	long expires;
+	int err, storable;
+	socklen_t errLen;
+	size_t off;
+
+	/* Out of time: whatever woke us, the sockets have been shut down. A pending lookup still has to call back first. */
+	if (deadlineFired(&c->dl) && !c->waiting){
+		connFinish(loop, c);
+		return;
+	}
+
+	while(1){
+		switch (c->state){
+		case READ_REQ:
+			if (0 >= (err = connReadRequest(c))){
+				if (0 > err){
+					connFinish(loop, c);
+				}
+				return;
+			}
+			c->began = c->stamp = metricObserve(METRIC_PARSE, c->stamp);
+			metricCount(METRIC_REQUESTS, 1);
+			connStartRequest(loop, c);
+			/* Only a miss still needs the buffer, for the request the head was rewritten into. */
+			free(c->req);
+			c->req = NULL;
+			if (RESOLVING != c->state){
+				connBufDone(c);
+			}
+			break;
+
+		case RESOLVING:
+			/* Until the resolver calls back, events on the client say nothing new. */
+			if (c->waiting){
+				return;
+			}
+			if (0 == (err = resolveAsync(c->host, &addr, connResolved, c))){
+				c->waiting = TRUE;
+				return;
+			}
+			if (0 > err){
+				fprintf(stderr, "DNS error\n");
+				connFinish(loop, c);
+				return;
+			}
+			connConnect(loop, c, addr);
+			break;
+
+		case CONNECTING:
+			/* Only the upstream socket becoming writable (or failing) says anything about the connect. */
+			if (src != &c->server || !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+				return;
+			}
+			errLen = sizeof(err);
+			if (0 > getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &errLen) || 0 != err){
+				fprintf(stderr, "Unix error\n");
+				connFinish(loop, c);
+				return;
+			}
+			c->stamp = metricObserve(METRIC_CONNECT, c->stamp);
+			deadlineArm(&c->dl, DEADLINE_FIRST_BYTE, c->server.fd, c->client.fd);
+			c->state = SEND_REQ;
+			break;
+
+		case SEND_REQ:
+			if (0 >= (err = connWrite(c->server.fd, c->buf, &c->off, c->len))){
+				if (0 > err){
+					connFinish(loop, c);
+				}
+				return;
+			}
+			connBufDone(c);
+			c->stamp = metricNow();
+			c->state = RELAY;
+			break;
+
+		case RELAY:
+			if (0 >= (err = connRelay(c))){
+				if (0 > err){
+					connFinish(loop, c);
+				}
+				return;
+			}
+			/* The shutdown reads as EOF; nothing cut short is cached. */
+			if (deadlineFired(&c->dl)){
+				connFinish(loop, c);
+				return;
+			}
+			metricObserve(METRIC_RELAY, c->stamp);
+			metricCount(METRIC_ORIGIN_BYTES, c->size);
+			parseBegin(&resp, TRUE);
+			if (NULL != c->object && cacheMaxObject >= c->size && 1 == parseHead(&resp, c->object, c->size)){
+				head = c->object + resp.len;
+				expires = freshUntil(c->object, head - c->object, &storable);
+				if (storable){
+					cacheResponse(c->uri, c->object, head - c->object, head, c->object + c->size - head, expires);
+				}
+			}
+			connFinish(loop, c);
+			return;
+
+		case WRITE_HIT:
+			objectIov(c->hit, FALSE, iov);
+			off = c->off;
+			err = connWritev(c->client.fd, iov, 3, &c->off);
+			if (off != c->off){
+				deadlineTouch(&c->dl);
+			}
+			if (0 != err){
+				dbg_printf("Cache hit. Reading from cache.\n");
+				connFinish(loop, c);
+			}
+			return;
+
+		default:
+			return;
+		}
+	}
+}
+
+/* Read until the blank line ending the request head. Returns 1 once it is complete, 0 on EAGAIN and -1 on error or EOF. */
+int connReadRequest(evConn *c){
+	ssize_t n;
+
+	while(1){
+		if (c->len + 1 >= c->cap){
+			if (MAXHEAD <= c->cap){
+				fprintf(stderr, "Error request header too large.\n");
+				return -1;
+			}
+			if (0 > connBuf(c, c->cap ? 2 * c->cap : BUFPOOLSIZE)){
+				fprintf(stderr, "Error allocating memory for request.\n");
+				return -1;
+			}
+		}
+
+		if (0 > (n = read(c->client.fd, c->buf + c->len, c->cap - c->len - 1))){
+			if (EINTR == errno){
+				continue;
+			}
+			/* Nothing of the head yet: the buffer goes back until some arrives. */
+			if (0 == c->len){
+				connBufDone(c);
+			}
+			return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+		}
+		if (0 == n){
+			return -1;
+		}
+		if (0 == c->len){
+			c->stamp = metricNow();
+		}
+		c->len += n;
+		if (NULL == c->req){
+			if (NULL == (c->req = malloc(sizeof(httpHead)))){
+				fprintf(stderr, "Error allocating memory for request.\n");
+				return -1;
+			}
+			parseBegin(c->req, FALSE);
+		}
+
+		/* Only the lines that have just arrived are parsed. */
+		if (0 != (n = parseHead(c->req, c->buf, c->len))){
+			if (0 > n){
+				fprintf(stderr, "Error parsing GET instruction.\n");
+			}
+			return n;
+		}
+	}
+}
+
+/* Act on the request head parsed in c->req: either start writing a cache hit or start the upstream connect. */
+void connStartRequest(evLoop *loop, evConn *c){
+	char uri[MAXLINE];
+	char host[MAXLINE];
+	char filePath[MAXLINE];
+	int numPort, reason;
+
+	c->state = DONE;
+	if (ADMIT_OK != (reason = admitRequest(c->client.fd))){
+		admitRefuse(c->client.fd, reason);
+		connFinish(loop, c);
+		return;
+	}
+	if (0 > spanCopy(c->req->uri, uri, MAXLINE)){
+		fprintf(stderr, "Error parsing GET instruction.\n");
+		connFinish(loop, c);
+		return;
+	}
+	/* The status and metrics pages are written like a hit from an object nobody else holds. */
+	if (spanIs(c->req->method, "GET") && (0 == strcmp(STATUSPATH, uri) || 0 == strcmp(METRICSPATH, uri))){
+		if (NULL != (c->hit = 0 == strcmp(STATUSPATH, uri) ? statusObj(uri) : metricsObj(uri))){
+			c->off = 0;
+			c->state = WRITE_HIT;
+			deadlineArm(&c->dl, DEADLINE_IDLE, c->client.fd, -1);
+		}
+		else{
+			connFinish(loop, c);
+		}
+		return;
+	}
+	if (!spanIs(c->req->method, "GET") || 0 > parseUri(uri, host, filePath, &numPort) || 0 == numPort){
+		connFinish(loop, c);
+		return;
+	}
+
+	if (NULL != (c->hit = cacheGet(uri))){
+		if (refreshCheck(uri, host, filePath, numPort, c->hit->data, c->hit->hdrLen,
+			__atomic_load_n(&c->hit->fetched, __ATOMIC_RELAXED), __atomic_load_n(&c->hit->expires, __ATOMIC_RELAXED))){
+			c->stamp = metricObserve(METRIC_LOOKUP, c->stamp);
+			metricCount(METRIC_HITS, 1);
+			metricCount(METRIC_CACHE_BYTES, c->hit->size);
+			c->off = 0;
+			c->state = WRITE_HIT;
+			deadlineArm(&c->dl, DEADLINE_IDLE, c->client.fd, -1);
+			return;
+		}
+		/* Too stale to send: this front end fetches it again in full. */
+		cacheRelease(c->hit);
+		c->hit = NULL;
+	}
+	c->stamp = metricObserve(METRIC_LOOKUP, c->stamp);
+	metricCount(METRIC_MISSES, 1);
+
+	if (NULL == (c->uri = strdup(uri)) || NULL == (c->host = strdup(host)) || 0 > connBuildRequest(c, host, filePath)){
+		fprintf(stderr, "Error allocating memory for request.\n");
+		connFinish(loop, c);
+		return;
+	}
+	c->port = numPort;
+	c->state = RESOLVING;
+	/* The lookup counts against the connect. */
+	deadlineArm(&c->dl, DEADLINE_CONNECT, c->client.fd, -1);
+	dbg_printf("Cache miss. Reading from server.\n");
+}
+
+/* Start the non-blocking connect to the resolved origin and register it with the loop. */
+void connConnect(evLoop *loop, evConn *c, struct in_addr addr){
+	struct epoll_event ev;
+	int pending;
+
+	if (0 > (c->server.fd = openNonblock(addr, c->port, &pending))){
+		connFinish(loop, c);
+		return;
+	}
+	ev.data.ptr = &c->server;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	if (0 > epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->server.fd, &ev)){
+		fprintf(stderr, "Error adding serverfd to epoll.\n");
+		connFinish(loop, c);
+		return;
+	}
+	if (!pending){
+		c->stamp = metricObserve(METRIC_CONNECT, c->stamp);
+	}
+	deadlineArm(&c->dl, pending ? DEADLINE_CONNECT : DEADLINE_FIRST_BYTE, c->server.fd, c->client.fd);
+	c->state = pending ? CONNECTING : SEND_REQ;
+}
+
+/* Replace the request head in c->buf with the request genRequest would send upstream. */
+int connBuildRequest(evConn *c, char *host, char *filePath){
+	char *req, *end;
+	size_t len = 0, n;
+	size_t cap = c->len + strlen(host) + strlen(filePath) + MAXLINE;
+	int i, pooled = BUFPOOLSIZE >= cap;
+
+	/* Built beside the head it is taken from, which is then given back. */
+	if (NULL == (req = pooled ? bufGet() : malloc(cap))){
+		return -1;
+	}
+	cap = pooled ? BUFPOOLSIZE : cap;
+	len += sprintf(req + len, "GET /%s HTTP/1.0\r\n", filePath);
+	len += sprintf(req + len, "Host: %s\r\n", host);
+
+	/* Forward the parsed header lines straight out of the request buffer, less hop-by-hop ones. */
+	for (i = 0; i < c->req->numHeaders; i++){
+		end = c->req->headers[i].value.p + c->req->headers[i].value.len;
+		n = end - c->req->headers[i].name.p;
+		if (filterHeader(c->req->headers[i].name) && cap - len > n + 24){
+			memcpy(req + len, c->req->headers[i].name.p, n);
+			memcpy(req + len + n, "\r\n", 2);
+			len += n + 2;
+		}
+	}
+	len += sprintf(req + len, "Connection: close\r\n\r\n");
+
+	connBufDone(c);
+	c->buf = req;
+	c->pooled = pooled;
+	c->cap = cap;
+	c->len = len;
+	c->off = 0;
+	return 0;
+}
+
+/* Relay the response to the client, keeping a copy for the cache. Returns 1 at upstream EOF, 0 on EAGAIN and -1 on error. */
+int connRelay(evConn *c){
+	ssize_t n;
+	int err;
+
+	while(1){
+		if (c->off < c->len){
+			if (0 >= (err = connWrite(c->client.fd, c->buf, &c->off, c->len))){
+				return err;
+			}
+		}
+
+		if (NULL == c->buf && 0 > connBuf(c, BUFPOOLSIZE)){
+			return -1;
+		}
+		if (0 > (n = read(c->server.fd, c->buf, c->cap))){
+			if (EINTR == errno){
+				continue;
+			}
+			/* Everything read has been written, so the buffer can go back while the origin is quiet. */
+			connBufDone(c);
+			return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+		}
+		if (0 == n){
+			return 1;
+		}
+		if (0 == c->size){
+			c->stamp = metricObserve(METRIC_TTFB, c->stamp);
+			deadlineArm(&c->dl, DEADLINE_IDLE, c->server.fd, c->client.fd);
+		}
+		/* A client too slow to take what was read stops further reads, so this marks progress both ways. */
+		deadlineTouch(&c->dl);
+
+		/* Only objects that fit are worth collecting. */
+		if (cacheMaxObject >= c->size + n){
+			if (NULL == c->object && NULL == (c->object = malloc(cacheMaxObject))){
+				return -1;
+			}
+			memcpy(c->object + c->size, c->buf, n);
+		}
+		c->size += n;
+		c->len = n;
+		c->off = 0;
+	}
+}
+
+/* Write data[*off, len) to fd. Returns 1 once it is all written, 0 on EAGAIN and -1 on error. */
+int connWrite(int fd, char *data, size_t *off, size_t len){
+	ssize_t n;
+
+	while (*off < len){
+		if (0 > (n = write(fd, data + *off, len - *off))){
+			if (EINTR == errno){
+				continue;
+			}
+			return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+		}
+		*off += n;
+	}
+	return 1;
+}
+
+/* Write the concatenation of iov[0, cnt) to fd, resuming *off bytes in. Returns 1 once it is all written, 0 on EAGAIN and -1 on error. */
+int connWritev(int fd, struct iovec *iov, int cnt, size_t *off){
+	struct iovec rest[cnt];
+	size_t skip;
+	ssize_t n;
+	int i, j;
+
+	while(1){
+		/* Rebuild the unwritten tail; hits are three short iovecs, so this is cheap. */
+		for (i = 0, j = 0, skip = *off; i < cnt; i++){
+			if (skip >= iov[i].iov_len){
+				skip -= iov[i].iov_len;
+				continue;
+			}
+			rest[j].iov_base = (char *)iov[i].iov_base + skip;
+			rest[j].iov_len = iov[i].iov_len - skip;
+			skip = 0;
+			j++;
+		}
+		if (0 == j){
+			return 1;
+		}
+		if (0 > (n = writev(fd, rest, j))){
+			if (EINTR == errno){
+				continue;
+			}
+			return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+		}
+		*off += n;
+	}
+}
+
+/* Gives c a buffer of cap bytes, keeping what it has in hand: one from the pool if it fits, else from malloc. Returns -1 if there is no memory. */
+int connBuf(evConn *c, size_t cap){
+	size_t len, off;
+	char *p;
+
+	if (NULL != c->buf && cap <= c->cap){
+		return 0;
+	}
+	if (NULL == c->buf && BUFPOOLSIZE >= cap){
+		if (NULL == (c->buf = bufGet())){
+			return -1;
+		}
+		c->pooled = TRUE;
+		c->cap = BUFPOOLSIZE;
+		return 0;
+	}
+	if (NULL == (p = malloc(cap))){
+		return -1;
+	}
+	memcpy(p, c->buf, len = c->len);
+	off = c->off;
+	connBufDone(c);
+	c->buf = p;
+	c->cap = cap;
+	c->len = len;
+	c->off = off;
+	return 0;
+}
+
+/* Gives c's buffer back, to the pool or to malloc, and everything in it up. */
+void connBufDone(evConn *c){
+	if (c->pooled){
+		bufPut(c->buf);
+	}
+	else{
+		free(c->buf);
+	}
+	c->buf = NULL;
+	c->pooled = FALSE;
+	c->cap = c->len = c->off = 0;
+}
+
+/* Close both sides of c and queue it to be freed after the current batch of events. */
+void connFinish(evLoop *loop, evConn *c){
+	if (0 != c->began){
+		metricObserve(METRIC_REQUEST, c->began);
+	}
+	metricCount(METRIC_CONNS_CLOSED, 1);
+	deadlineCancel(&c->dl);
+	admitDone(c->client.fd);
+	close(c->client.fd);
+	if (0 <= c->server.fd){
+		close(c->server.fd);
+	}
+	c->state = DONE;
+	c->nextDone = loop->done;
+	loop->done = c;
+	dbg_printf("Closing connection.\n\n");
+}
+
+/* Start a non-blocking connect to addr:numPort. Sets pending if the connect is still in progress. */
+int openNonblock(struct in_addr addr, int numPort, int *pending){
+	struct sockaddr_in sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr = addr;
+	sa.sin_port = htons(numPort);
+
+	if (0 > (fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0))){
+		fprintf(stderr, "Unix error\n");
+		return -1;
+	}
+
+	*pending = FALSE;
+	if (0 > connect(fd, (SA *)&sa, sizeof(sa))){
+		if (EINPROGRESS != errno){
+			close(fd);
+			fprintf(stderr, "Unix error\n");
+			return -1;
+		}
+		*pending = TRUE;
+	}
+	return fd;
+}
+
+/* Set O_NONBLOCK on fd. */
+int setNonblock(int fd){
+	int flags;
+
+	if (0 > (flags = fcntl(fd, F_GETFL, 0))){
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
@@ -0,0 +1,7 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/* Serve every connection accepted on listenfd from loops epoll threads. Never returns. */
+void eventRun(int listenfd, int loops);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,240 @@
+/*
+ * ----------------------------------------------------------
+ * flight.c - Collapses concurrent misses on one url into a
+ *            single origin fetch.
+ *
+ * - the first miss on a url becomes the leader and fetches
+ *   it; misses that arrive while it is in flight follow it
+ *   instead of asking the origin again
+ * - followers get the leader's response head with their own
+ *   framing as soon as it is known, then stream the body
+ *   from the leader's buffer as it fills
+ * - only bodies that fit in MAXOBJ and may be stored are
+ *   shared; for anything larger, private or no-store the
+ *   leader bypasses and its followers fetch on their own
+ * - the leader caches the object before it leaves the table,
+ *   so a later miss finds it one place or the other
+ * ----------------------------------------------------------
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "relay.h"
+#include "flight.h"
+
+flight *flights[FLIGHTBUCKETS];
+pthread_mutex_t flightLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Counters for the status page. */
+long flightLeaders;
+long flightFollowers;
+long flightBypassed;
+long flightFailed;
+
+void flightUnlink(flight *f);
+void flightSet(flight *f, int state);
+
+/* Returns the fetch in flight for url, or a new one that the caller is to lead. NULL if one cannot be made. */
+flight *flightJoin(char *url, int *leader){
+	unsigned long hash = cacheHash(url);
+	flight **bucket = &flights[hash % FLIGHTBUCKETS];
+	flight *f;
+
+	pthread_mutex_lock(&flightLock);
+	for (f = *bucket; NULL != f; f = f->next){
+		if (hash == f->hash && 0 == strcmp(url, f->url)){
+			f->refs++;
+			pthread_mutex_unlock(&flightLock);
+			__atomic_add_fetch(&flightFollowers, 1, __ATOMIC_RELAXED);
+			*leader = FALSE;
+			return f;
+		}
+	}
+
+	if (NULL == (f = calloc(1, sizeof(flight))) || NULL == (f->url = strdup(url))){
+		pthread_mutex_unlock(&flightLock);
+		free(f);
+		return NULL;
+	}
+	f->hash = hash;
+	f->refs = 2;
+	f->linked = TRUE;
+	f->state = FLIGHT_HEAD;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->grew, NULL);
+	f->next = *bucket;
+	*bucket = f;
+	pthread_mutex_unlock(&flightLock);
+
+	__atomic_add_fetch(&flightLeaders, 1, __ATOMIC_RELAXED);
+	*leader = TRUE;
+	return f;
+}
+
+/* Leader: publishes the response head and takes over body, a buffer of at least length bytes. Returns -1, bypassing, if it cannot. */
+int flightHead(flight *f, char *head, size_t headLen, char *body, long long length){
+	char *copy;
+
+	if (NULL == (copy = malloc(headLen))){
+		flightBypass(f);
+		return -1;
+	}
+	memcpy(copy, head, headLen);
+
+	pthread_mutex_lock(&f->lock);
+	f->head = copy;
+	f->headLen = headLen;
+	f->length = length;
+	f->body = body;
+	f->filled = 0;
+	f->state = FLIGHT_BODY;
+	pthread_cond_broadcast(&f->grew);
+	pthread_mutex_unlock(&f->lock);
+	return 0;
+}
+
+/* Leader: the first filled bytes of the body have arrived. */
+void flightFill(flight *f, size_t filled){
+	pthread_mutex_lock(&f->lock);
+	f->filled = filled;
+	pthread_cond_broadcast(&f->grew);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Leader: this response will not be shared; followers waiting for its head fetch on their own. */
+void flightBypass(flight *f){
+	__atomic_add_fetch(&flightBypassed, 1, __ATOMIC_RELAXED);
+	flightUnlink(f);
+	flightSet(f, FLIGHT_BYPASS);
+}
+
+/* Leader: the fetch is over, complete if the whole body arrived. Drops the leader's reference. */
+void flightEnd(flight *f){
+	int state;
+
+	pthread_mutex_lock(&f->lock);
+	state = f->state;
+	pthread_mutex_unlock(&f->lock);
+
+	if (FLIGHT_BYPASS != state){
+		if (FLIGHT_BODY == state && (0 > f->length || (long long)f->filled == f->length)){
+			state = FLIGHT_DONE;
+		}
+		else{
+			state = FLIGHT_FAILED;
+			__atomic_add_fetch(&flightFailed, 1, __ATOMIC_RELAXED);
+		}
+		flightUnlink(f);
+		flightSet(f, state);
+	}
+	flightRelease(f);
+}
+
+/* Follower: sends the shared response to connfd. Returns -1 if the leader bypassed before its head, else whether the connection can carry another request. */
+int flightFollow(flight *f, int connfd, int keepAlive){
+	struct iovec iov[2];
+	char framing[MAXLINE];
+	size_t sent = 0, filled;
+	int state;
+
+	pthread_mutex_lock(&f->lock);
+	while (FLIGHT_HEAD == f->state){
+		pthread_cond_wait(&f->grew, &f->lock);
+	}
+	state = f->state;
+	pthread_mutex_unlock(&f->lock);
+
+	if (FLIGHT_BYPASS == state){
+		return -1;
+	}
+	if (NULL == f->head){
+		return FALSE;
+	}
+
+	/* Shared bodies always fit in MAXOBJ, so every follower gets a Content-Length. */
+	framing[0] = 0;
+	if (0 <= f->length){
+		sprintf(framing, "Content-Length: %lld\r\n", f->length);
+	}
+	sprintf(framing + strlen(framing), "Connection: %s\r\n\r\n", keepAlive ? "keep-alive" : "close");
+	iov[0].iov_base = f->head;
+	iov[0].iov_len = f->headLen;
+	iov[1].iov_base = framing;
+	iov[1].iov_len = strlen(framing);
+	if (0 > relayWritev(connfd, iov, 2)){
+		return FALSE;
+	}
+
+	while (0 < f->length && (long long)sent < f->length){
+		pthread_mutex_lock(&f->lock);
+		while (sent == f->filled && FLIGHT_BODY == f->state){
+			pthread_cond_wait(&f->grew, &f->lock);
+		}
+		filled = f->filled;
+		pthread_mutex_unlock(&f->lock);
+
+		/* The leader gave up part way; the client cannot be told any other way. */
+		if (sent == filled || 0 > relayOut(connfd, f->body + sent, filled - sent, FALSE)){
+			return FALSE;
+		}
+		sent = filled;
+	}
+	return keepAlive;
+}
+
+/* Drops a reference to f, freeing it once the table, leader and followers are all done with it. */
+void flightRelease(flight *f){
+	int refs;
+
+	pthread_mutex_lock(&flightLock);
+	refs = --f->refs;
+	pthread_mutex_unlock(&flightLock);
+
+	if (0 == refs){
+		pthread_mutex_destroy(&f->lock);
+		pthread_cond_destroy(&f->grew);
+		free(f->head);
+		free(f->body);
+		free(f->url);
+		free(f);
+	}
+}
+
+/* Takes f out of the table so later misses start a fetch of their own, dropping the table's reference. */
+void flightUnlink(flight *f){
+	flight **pp;
+
+	pthread_mutex_lock(&flightLock);
+	if (!f->linked){
+		pthread_mutex_unlock(&flightLock);
+		return;
+	}
+	for (pp = &flights[f->hash % FLIGHTBUCKETS]; *pp != f; pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->linked = FALSE;
+	pthread_mutex_unlock(&flightLock);
+	flightRelease(f);
+}
+
+/* Moves f to state and wakes everyone waiting on it. */
+void flightSet(flight *f, int state){
+	pthread_mutex_lock(&f->lock);
+	f->state = state;
+	pthread_cond_broadcast(&f->grew);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Writes the collapsed forwarding counters as "name value" lines to buf. Returns the length written. */
+int flightStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"flight_leaders %ld\n"
+		"flight_followers %ld\n"
+		"flight_bypassed %ld\n"
+		"flight_failed %ld\n",
+		__atomic_load_n(&flightLeaders, __ATOMIC_RELAXED),
+		__atomic_load_n(&flightFollowers, __ATOMIC_RELAXED),
+		__atomic_load_n(&flightBypassed, __ATOMIC_RELAXED),
+		__atomic_load_n(&flightFailed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,41 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHTBUCKETS 256
+
+/* Where an in-flight fetch is, in the order it gets there. */
+enum { FLIGHT_HEAD, FLIGHT_BODY, FLIGHT_DONE, FLIGHT_FAILED, FLIGHT_BYPASS };
+
+/*
+ * One origin fetch that concurrent misses on the same url
+ * share. The leader fills body and advances filled; followers
+ * stream body[0, filled) to their own clients as it grows.
+ */
+typedef struct flight{
+	char *url;
+	unsigned long hash;
+	int refs;			/* the table's, the leader's and each follower's; under flightLock */
+	int linked;			/* still findable in the table */
+	pthread_mutex_t lock;	/* protects state and filled */
+	pthread_cond_t grew;
+	int state;
+	char *head;			/* status line and end-to-end headers, without framing */
+	size_t headLen;
+	long long length;	/* body length, or -1 if the status has no body */
+	char *body;			/* never reallocated, so followers write from it unlocked */
+	size_t filled;
+	struct flight *next;
+} flight;
+
+flight *flightJoin(char *url, int *leader);
+int  flightHead(flight *f, char *head, size_t headLen, char *body, long long length);
+void flightFill(flight *f, size_t filled);
+void flightBypass(flight *f);
+void flightEnd(flight *f);
+int  flightFollow(flight *f, int connfd, int keepAlive);
+void flightRelease(flight *f);
+int  flightStats(char *buf, size_t len);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,246 @@
+/*
+ * ----------------------------------------------------------
+ * fresh.c - HTTP freshness: how long a cached response may
+ *           be served before it has to be revalidated.
+ *
+ * - only 200 responses are stored, and not those marked
+ *   no-store or private or that vary on everything
+ * - a response is fresh for its s-maxage, else max-age,
+ *   else Expires less Date, less any Age it arrived with;
+ *   no-cache makes it stale at once
+ * - without any of those, a tenth of the time since its
+ *   Last-Modified (up to FRESHHEURISTICMAX), else the
+ *   default ttl (--cache-ttl)
+ * - expiry is kept as wall-clock seconds with the object, so
+ *   it survives a restart of a file-backed cache
+ * - a stale object is revalidated with the ETag and
+ *   Last-Modified it was stored with; a 304 renews it in
+ *   place and the body is not fetched again
+ * - for its stale-while-revalidate seconds past expiry
+ *   (--stale-while-revalidate if it gives none) it may still
+ *   be sent while a refresh runs in the background; see
+ *   refresh.c
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "fresh.h"
+
+long freshDefaultTtl = FRESHTTL;
+long freshDefaultStale = FRESHSTALE;
+
+/* Counters for the status page. */
+long freshStale;
+long freshRevalidations;
+long freshNotModified;
+long freshUncacheable;
+
+time_t httpDate(char *date);
+int  headerValue(char *head, size_t headLen, char *name, char *value);
+
+/* Sets the lifetime of responses that carry no freshness information, and how long past it they may be sent while refreshed. */
+void freshInit(long defaultTtl, long staleWindow){
+	freshDefaultTtl = defaultTtl;
+	freshDefaultStale = staleWindow;
+}
+
+/* Seconds the response whose head is given stays fresh from now, or -1 if it does not say. Sets *storable to whether it may be cached at all. */
+long freshLifetime(char *head, size_t headLen, int *storable){
+	char content[MAXLINE];
+	char *tok, *save;
+	long maxAge = -1, sMaxAge = -1, age = 0, lifetime = -1;
+	time_t now = time(NULL), date = 0, expires = 0, modified = 0;
+	int noCache = FALSE, hasExpires = FALSE, i;
+	span header;
+	httpHead h;
+
+	parseBegin(&h, TRUE);
+	if (0 > parseHead(&h, head, headLen) || !h.started){
+		*storable = FALSE;
+		return -1;
+	}
+	*storable = 200 == h.status;
+
+	for (i = 0; i < h.numHeaders; i++){
+		header = h.headers[i].name;
+		/* Values are copied out only for the headers read here, and skipped if too long to be sane. */
+		if (0 > spanCopy(h.headers[i].value, content, MAXLINE)){
+			continue;
+		}
+
+		if (spanIs(header, "Cache-Control")){
+			for (tok = strtok_r(content, ",", &save); NULL != tok; tok = strtok_r(NULL, ",", &save)){
+				tok += strspn(tok, " \t");
+				if (0 == strncasecmp("no-store", tok, 8) || 0 == strncasecmp("private", tok, 7)){
+					*storable = FALSE;
+				}
+				else if (0 == strncasecmp("no-cache", tok, 8)){
+					noCache = TRUE;
+				}
+				else if (0 == strncasecmp("max-age=", tok, 8)){
+					maxAge = strtol(tok + 8, NULL, 10);
+				}
+				else if (0 == strncasecmp("s-maxage=", tok, 9)){
+					sMaxAge = strtol(tok + 9, NULL, 10);
+				}
+			}
+		}
+		else if (spanIs(header, "Pragma") && NULL != strcasestr(content, "no-cache")){
+			noCache = TRUE;
+		}
+		else if (spanIs(header, "Vary") && NULL != strchr(content, '*')){
+			*storable = FALSE;
+		}
+		else if (spanIs(header, "Expires")){
+			/* An Expires that is not a date means already expired. */
+			hasExpires = TRUE;
+			expires = httpDate(content);
+		}
+		else if (spanIs(header, "Date")){
+			date = httpDate(content);
+		}
+		else if (spanIs(header, "Last-Modified")){
+			modified = httpDate(content);
+		}
+		else if (spanIs(header, "Age")){
+			age = strtol(content, NULL, 10);
+		}
+	}
+
+	if (0 >= date){
+		date = now;
+	}
+	if (noCache){
+		return 0;
+	}
+	if (0 <= sMaxAge){
+		lifetime = sMaxAge;
+	}
+	else if (0 <= maxAge){
+		lifetime = maxAge;
+	}
+	else if (hasExpires){
+		lifetime = 0 < expires && expires > date ? expires - date : 0;
+	}
+	else if (0 < modified && modified < date){
+		lifetime = (date - modified) / 10;
+		if (FRESHHEURISTICMAX < lifetime){
+			lifetime = FRESHHEURISTICMAX;
+		}
+	}
+	else{
+		return -1;
+	}
+	return lifetime > age ? lifetime - age : 0;
+}
+
+/* When a response with this head goes stale, in seconds since the epoch. Sets *storable as freshLifetime does and counts those that are not. */
+long freshUntil(char *head, size_t headLen, int *storable){
+	long lifetime = freshLifetime(head, headLen, storable);
+
+	if (!*storable){
+		__atomic_add_fetch(&freshUncacheable, 1, __ATOMIC_RELAXED);
+	}
+	return time(NULL) + (0 > lifetime ? freshDefaultTtl : lifetime);
+}
+
+/* TRUE if an object that expires then is still fresh; stale ones are counted. */
+int freshCheck(long expires){
+	if (time(NULL) < expires){
+		return TRUE;
+	}
+	__atomic_add_fetch(&freshStale, 1, __ATOMIC_RELAXED);
+	return FALSE;
+}
+
+/* Seconds past expiry the stored response with this head may be sent while it is revalidated: its stale-while-revalidate, else the default, but none if it must be revalidated first. */
+long freshStaleWindow(char *head, size_t headLen){
+	char value[MAXLINE];
+	char *p;
+
+	if (!headerValue(head, headLen, "Cache-Control", value)){
+		return freshDefaultStale;
+	}
+	if (NULL != strcasestr(value, "must-revalidate") || NULL != strcasestr(value, "proxy-revalidate")){
+		return 0;
+	}
+	if (NULL != (p = strcasestr(value, "stale-while-revalidate="))){
+		return strtol(p + 23, NULL, 10);
+	}
+	return freshDefaultStale;
+}
+
+/* Writes the conditional headers that revalidate a stored response with this head to buf. Returns their length, 0 if it has no validators. */
+int freshValidators(char *head, size_t headLen, char *buf, size_t len){
+	char value[MAXLINE];
+	int n = 0;
+
+	if (headerValue(head, headLen, "ETag", value)){
+		n += snprintf(buf + n, len - n, "If-None-Match: %s\r\n", value);
+	}
+	if ((size_t)n < len && headerValue(head, headLen, "Last-Modified", value)){
+		n += snprintf(buf + n, len - n, "If-Modified-Since: %s\r\n", value);
+	}
+	if ((size_t)n >= len){
+		return 0;
+	}
+	if (0 < n){
+		__atomic_add_fetch(&freshRevalidations, 1, __ATOMIC_RELAXED);
+	}
+	return n;
+}
+
+/* A 304 with this head has confirmed the stored response: returns its new expiry. The 304's own freshness wins; without any, the stored response's lifetime starts over. */
+long freshRefresh(char *head, size_t headLen, char *stored, size_t storedLen){
+	long lifetime;
+	int storable;
+
+	__atomic_add_fetch(&freshNotModified, 1, __ATOMIC_RELAXED);
+	if (0 > (lifetime = freshLifetime(head, headLen, &storable)) && 0 > (lifetime = freshLifetime(stored, storedLen, &storable))){
+		lifetime = freshDefaultTtl;
+	}
+	return time(NULL) + lifetime;
+}
+
+/* Parses an HTTP date, in the preferred format or the obsolete RFC 850 one. Returns -1 if it is neither. */
+time_t httpDate(char *date){
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (NULL == strptime(date, "%a, %d %b %Y %H:%M:%S", &tm)){
+		memset(&tm, 0, sizeof(tm));
+		if (NULL == strptime(date, "%A, %d-%b-%y %H:%M:%S", &tm)){
+			return -1;
+		}
+	}
+	return timegm(&tm);
+}
+
+/* Copies the value of the first name header in head to value. Returns FALSE if there is none. */
+int headerValue(char *head, size_t headLen, char *name, char *value){
+	httpHeader *hdr;
+	httpHead h;
+
+	parseBegin(&h, TRUE);
+	if (0 > parseHead(&h, head, headLen) || NULL == (hdr = parseFind(&h, name)) || 0 == hdr->value.len){
+		return FALSE;
+	}
+	return 0 == spanCopy(hdr->value, value, MAXLINE);
+}
+
+/* Writes the freshness counters as "name value" lines to buf. Returns the length written. */
+int freshStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"fresh_stale %ld\n"
+		"fresh_revalidations %ld\n"
+		"fresh_not_modified %ld\n"
+		"fresh_uncacheable %ld\n",
+		__atomic_load_n(&freshStale, __ATOMIC_RELAXED),
+		__atomic_load_n(&freshRevalidations, __ATOMIC_RELAXED),
+		__atomic_load_n(&freshNotModified, __ATOMIC_RELAXED),
+		__atomic_load_n(&freshUncacheable, __ATOMIC_RELAXED));
+}
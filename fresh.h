@@ -0,0 +1,19 @@
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include "csapp.h"
+
+#define FRESHTTL 60				/* default seconds fresh for responses that say nothing */
+#define FRESHHEURISTICMAX 86400	/* cap on a lifetime guessed from Last-Modified */
+#define FRESHSTALE 10			/* default seconds a stale response may be sent while it is refreshed */
+
+void freshInit(long defaultTtl, long staleWindow);
+long freshLifetime(char *head, size_t headLen, int *storable);
+long freshUntil(char *head, size_t headLen, int *storable);
+int  freshCheck(long expires);
+long freshStaleWindow(char *head, size_t headLen);
+int  freshValidators(char *head, size_t headLen, char *buf, size_t len);
+long freshRefresh(char *head, size_t headLen, char *stored, size_t storedLen);
+int  freshStats(char *buf, size_t len);
+
+#endif /* __FRESH_H__ */
@@ -0,0 +1,255 @@
+/*
+ * ----------------------------------------------------------
+ * membench.c - Measures what a connection costs a running
+ *              proxy in resident memory.
+ *
+ * Reads the proxy's VmRSS from /proc/<pid>/status around
+ * each of these phases and reports the growth per connection:
+ *
+ * - idle: -n connections opened and left silent
+ * - active: each sends a miss for its own synthetic url with
+ *   -d ms of origin delay (tiny -b's /synth/), measured
+ *   halfway through the wait, so every one holds an origin
+ *   connection and a request in flight
+ * - kept-alive: the responses read, the connections the
+ *   proxy keeps open sit waiting for their next request
+ * - closed: all of them closed, which shows what the proxy
+ *   holds on to for the next burst; what closing gave back
+ *   is what each kept-alive connection really held
+ *
+ * usage: membench -p pid [-n conns] [-d ms] [-s bytes]
+ *                 -x proxyhost:port host port
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "parse.h"
+
+#define SETTLE 1000		/* ms to let the proxy catch up before a reading */
+
+/* One connection and the response coming back on it. */
+typedef struct memConn{
+	int fd;
+	char head[MAXLINE];
+	size_t len;
+	httpHead h;
+	long remaining;		/* body bytes to come; -1 until the head is in */
+} memConn;
+
+long rss(int pid);
+int  openConn(struct sockaddr_in *addr);
+int  readSome(memConn *c);
+void report(char *phase, long before, long after, int conns);
+void sleepMs(long ms);
+void usage(char *prog);
+
+int main(int argc, char **argv)
+{
+	int pid = 0, conns = 1000, delay = 2000, opt, i, open, left;
+	long size = 10240, base, idle, active, kept, closed;
+	char *proxy = NULL, *colon, host[MAXLINE], req[MAXLINE];
+	struct sockaddr_in addr;
+	struct addrinfo hints, *res;
+	struct pollfd *fds;
+	memConn *c;
+
+	while (-1 != (opt = getopt(argc, argv, "p:n:d:s:x:"))){
+		switch (opt){
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'n':
+			conns = atoi(optarg);
+			break;
+		case 'd':
+			delay = atoi(optarg);
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		case 'x':
+			proxy = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || 0 >= pid || 0 >= conns || NULL == proxy || NULL == (colon = strrchr(proxy, ':'))){
+		usage(argv[0]);
+	}
+	snprintf(host, sizeof(host), "%.*s", (int)(colon - proxy), proxy);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (0 != getaddrinfo(host, colon + 1, &hints, &res)){
+		fprintf(stderr, "Error: cannot resolve %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&addr, res->ai_addr, sizeof(addr));
+	freeaddrinfo(res);
+
+	Signal(SIGPIPE, SIG_IGN);
+	c = Calloc(conns, sizeof(memConn));
+	fds = Calloc(conns, sizeof(struct pollfd));
+	printf("%d connections, %d ms origin delay, %ld byte objects\n", conns, delay, size);
+	printf("%-12s %12s %12s\n", "phase", "rss KB", "per conn");
+	base = rss(pid);
+	printf("%-12s %12ld\n", "before", base);
+
+	for (i = 0; i < conns; i++){
+		if (0 > (c[i].fd = openConn(&addr))){
+			fprintf(stderr, "Error: connection %d: %s\n", i, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	sleepMs(SETTLE);
+	report("idle", base, idle = rss(pid), conns);
+
+	for (i = 0; i < conns; i++){
+		snprintf(req, sizeof(req), "GET http://%s:%s/synth/membench-%d-%d?size=%ld&delay=%d HTTP/1.1\r\nHost: %s:%s\r\n\r\n",
+			argv[optind], argv[optind + 1], getpid(), i, size, delay, argv[optind], argv[optind + 1]);
+		if ((ssize_t)strlen(req) != write(c[i].fd, req, strlen(req))){
+			fprintf(stderr, "Error: sending on connection %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+		c[i].remaining = -1;
+		parseBegin(&c[i].h, TRUE);
+	}
+	sleepMs(delay / 2);
+	report("active", base, active = rss(pid), conns);
+
+	/* Read every response; a connection the proxy closes after its response is simply done. */
+	for (left = conns; 0 < left; ){
+		for (i = open = 0; i < conns; i++){
+			if (0 <= c[i].fd && 0 != c[i].remaining){
+				fds[open].fd = c[i].fd;
+				fds[open++].events = POLLIN;
+			}
+		}
+		if (0 >= poll(fds, open, 10 * delay + SETTLE)){
+			fprintf(stderr, "Error: %d responses never came\n", left);
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < conns; i++){
+			if (0 <= c[i].fd && 0 != c[i].remaining && 0 != readSome(&c[i])){
+				left--;
+			}
+		}
+	}
+	sleepMs(SETTLE);
+	/* A connection the proxy closed after answering reads as ended, without blocking. */
+	for (i = open = 0; i < conns; i++){
+		if (0 <= c[i].fd && 0 == recv(c[i].fd, req, 1, MSG_PEEK | MSG_DONTWAIT)){
+			close(c[i].fd);
+			c[i].fd = -1;
+		}
+		open += 0 <= c[i].fd;
+	}
+	kept = rss(pid);
+	if (0 < open){
+		report("kept-alive", base, kept, open);
+	}
+	else{
+		printf("%-12s %12ld %12s\n", "kept-alive", kept, "(all closed)");
+	}
+
+	for (i = 0; i < conns; i++){
+		if (0 <= c[i].fd){
+			close(c[i].fd);
+		}
+	}
+	sleepMs(SETTLE);
+	closed = rss(pid);
+	printf("%-12s %12ld %+12ld (retained)\n", "closed", closed, closed - base);
+	/* What closing gave back is what a kept-alive connection really held; the rest is the allocator's. */
+	if (0 < open){
+		report("held", closed, kept, open);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* The resident set of process pid, in KB. */
+long rss(int pid){
+	char path[64], line[256];
+	long kb = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if (NULL == (fp = fopen(path, "r"))){
+		fprintf(stderr, "Error: cannot read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	while (NULL != fgets(line, sizeof(line), fp)){
+		if (1 == sscanf(line, "VmRSS: %ld", &kb)){
+			break;
+		}
+	}
+	fclose(fp);
+	return kb;
+}
+
+/* A new blocking connection to addr, or -1. */
+int openConn(struct sockaddr_in *addr){
+	int fd;
+
+	if (0 > (fd = socket(AF_INET, SOCK_STREAM, 0))){
+		return -1;
+	}
+	if (0 > connect(fd, (SA *)addr, sizeof(*addr))){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Reads what has arrived of c's response without blocking. Returns TRUE once it is complete, or the connection has ended. */
+int readSome(memConn *c){
+	char buf[MAXLINE];
+	httpHeader *hdr;
+	ssize_t n;
+	int done;
+
+	while (0 < (n = recv(c->fd, 0 > c->remaining ? c->head + c->len : buf, 0 > c->remaining ? MAXLINE - c->len : MAXLINE, MSG_DONTWAIT))){
+		if (0 <= c->remaining){
+			c->remaining = n >= c->remaining ? 0 : c->remaining - n;
+		}
+		else if (0 > (done = parseHead(&c->h, c->head, c->len += n))){
+			break;
+		}
+		else if (1 == done){
+			hdr = parseFind(&c->h, "Content-Length");
+			c->remaining = NULL == hdr ? 0 : strtol(hdr->value.p, NULL, 10) - (long)(c->len - c->h.len);
+			c->remaining = 0 > c->remaining ? 0 : c->remaining;
+		}
+		if (0 == c->remaining){
+			return TRUE;
+		}
+	}
+	if (0 > n && 0 != c->remaining && (EAGAIN == errno || EWOULDBLOCK == errno)){
+		return FALSE;
+	}
+	close(c->fd);
+	c->fd = -1;
+	return TRUE;
+}
+
+/* Prints a phase's RSS and its growth over before, per connection. */
+void report(char *phase, long before, long after, int conns){
+	printf("%-12s %12ld %9.1f KB\n", phase, after, (double)(after - before) / conns);
+}
+
+/* Sleeps ms milliseconds. */
+void sleepMs(long ms){
+	struct timespec ts = { ms / 1000, ms % 1000 * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+void usage(char *prog){
+	fprintf(stderr, "usage: %s -p pid [-n conns] [-d ms] [-s bytes] -x proxyhost:port host port\n", prog);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,38 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "csapp.h"
+
+#define METRICSPATH "/metrics"
+#define METRICSUB 8							/* buckets per power of two, so values are within 12.5% */
+#define METRICBUCKETS ((40 - 2) * METRICSUB)	/* up to 2^40 ns, about 18 minutes */
+#define METRICSBUF 65536					/* room for the whole exposition */
+
+/* Latency histograms, in nanoseconds. */
+enum { METRIC_PARSE, METRIC_LOOKUP, METRIC_CONNECT, METRIC_TTFB, METRIC_RELAY, METRIC_REQUEST, NUMHISTS };
+
+/* Event counters. */
+enum { METRIC_REQUESTS, METRIC_HITS, METRIC_MISSES, METRIC_CACHE_BYTES, METRIC_ORIGIN_BYTES,
+	METRIC_CONNS_OPENED, METRIC_CONNS_CLOSED, NUMCOUNTERS };
+
+/* One thread's counts. Only the thread holding it writes to it, so updates need no locked instructions; readers add up every slot. Each starts on its own cache line. */
+typedef struct metricSlot{
+	long counters[NUMCOUNTERS];
+	long sums[NUMHISTS];
+	long buckets[NUMHISTS][METRICBUCKETS];
+	struct metricSlot *next;		/* every slot ever made */
+	struct metricSlot *nextFree;	/* slots whose thread has exited */
+} __attribute__((aligned(64))) metricSlot;
+
+extern __thread metricSlot *metricMine;
+
+metricSlot *metricClaim();
+void metricPark();
+void metricCount(int counter, long n);
+long metricNow();
+long metricObserve(int hist, long since);
+int  metricBucket(long ns);
+long metricBucketTop(int b);
+int  metricsExpose(char *buf, size_t len);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,259 @@
+/*
+ * ----------------------------------------------------------
+ * parse.c - Incremental HTTP head parser that points into
+ *           the buffer it is given instead of copying out of
+ *           it.
+ *
+ * - the method, uri, status and each header's name and value
+ *   come back as spans (pointer, length) of the read buffer;
+ *   nothing is copied and header values may hold spaces
+ * - a head can be fed as it arrives: parseHead remembers the
+ *   lines it has done and where the newline search stopped,
+ *   and says whether the head is complete yet
+ * - line ends, colons and the spaces of the start line are
+ *   found by scanFor, 32 bytes at a time with AVX2 or 16 with
+ *   SSE2 where the compiler targets them, else a byte at a
+ *   time; parseSimd switches it off for comparison (see
+ *   parsebench.c)
+ * - blank lines before a request line are skipped; a header
+ *   line without a colon, or folded onto the one before, is
+ *   malformed
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "csapp.h"
+#include "proxy.h"
+#include "parse.h"
+
+int parseSimd = TRUE;
+
+int  parseRequestLine(httpHead *h, char *line, char *end);
+int  parseStatusLine(httpHead *h, char *line, char *end);
+int  parseVersion(httpHead *h, char *p, char *end);
+int  parseNumber(char **p, char *end);
+
+/* Starts h on a new head: a response if response is set, else a request. */
+void parseBegin(httpHead *h, int response){
+	h->base = NULL;
+	h->off = h->scan = 0;
+	h->response = response;
+	h->started = FALSE;
+	h->start.p = h->method.p = h->uri.p = NULL;
+	h->start.len = h->method.len = h->uri.len = 0;
+	h->status = 0;
+	h->major = 1;
+	h->minor = 0;
+	h->numHeaders = 0;
+	h->len = 0;
+}
+
+/* Parses what has arrived of a head in buf[0..len). Returns 1 once it is complete (h->len long), 0 if more is needed and -1 if it is malformed. Call again with the same buffer, grown; a buffer that has moved is parsed from the start. */
+int parseHead(httpHead *h, char *buf, size_t len){
+	char *line, *nl, *lineEnd, *end = buf + len;
+
+	if (buf != h->base){
+		parseBegin(h, h->response);
+		h->base = buf;
+	}
+	while(1){
+		line = buf + h->off;
+		if (end == (nl = scanFor(buf + h->scan, end, '\n', '\n'))){
+			h->scan = len;
+			return 0;
+		}
+		h->off = h->scan = nl + 1 - buf;
+		lineEnd = nl > line && '\r' == nl[-1] ? nl - 1 : nl;
+
+		if (lineEnd == line){
+			/* Tolerate blank lines between requests. */
+			if (!h->started){
+				if (h->response){
+					return -1;
+				}
+				continue;
+			}
+			h->len = h->off;
+			return 1;
+		}
+		if (!h->started){
+			if (0 > (h->response ? parseStatusLine(h, line, lineEnd) : parseRequestLine(h, line, lineEnd))){
+				return -1;
+			}
+			h->start.p = line;
+			h->start.len = lineEnd - line;
+			h->started = TRUE;
+		}
+		else if (PARSEMAXHEADERS <= h->numHeaders || !parseHeaderLine(line, nl + 1 - line, &h->headers[h->numHeaders])){
+			return -1;
+		}
+		else{
+			h->numHeaders++;
+		}
+	}
+}
+
+/* Splits one header line (its line ending optional) into *hdr. Returns FALSE if it is not a header line. */
+int parseHeaderLine(char *line, size_t len, httpHeader *hdr){
+	char *colon, *v, *end = line + len;
+
+	while (end > line && ('\n' == end[-1] || '\r' == end[-1])){
+		end--;
+	}
+	colon = scanFor(line, end, ':', ':');
+	/* No whitespace may come before the colon, nor start a (folded) line. */
+	if (end == colon || line == colon || ' ' == *line || '\t' == *line || ' ' == colon[-1] || '\t' == colon[-1]){
+		return FALSE;
+	}
+	for (v = colon + 1; v < end && (' ' == *v || '\t' == *v); v++)
+		;
+	while (end > v && (' ' == end[-1] || '\t' == end[-1])){
+		end--;
+	}
+	hdr->name.p = line;
+	hdr->name.len = colon - line;
+	hdr->value.p = v;
+	hdr->value.len = end - v;
+	return TRUE;
+}
+
+/* The first header called name in h, or NULL. */
+httpHeader *parseFind(httpHead *h, char *name){
+	int i;
+
+	for (i = 0; i < h->numHeaders; i++){
+		if (spanIs(h->headers[i].name, name)){
+			return &h->headers[i];
+		}
+	}
+	return NULL;
+}
+
+/* TRUE if s is lit, ignoring case. */
+int spanIs(span s, char *lit){
+	return strlen(lit) == s.len && 0 == strncasecmp(s.p, lit, s.len);
+}
+
+/* TRUE if word appears anywhere in s, ignoring case. */
+int spanHas(span s, char *word){
+	size_t n = strlen(word), i;
+
+	for (i = 0; i + n <= s.len; i++){
+		if (0 == strncasecmp(s.p + i, word, n)){
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Copies s into buf as a string. Returns -1 if it does not fit in len bytes. */
+int spanCopy(span s, char *buf, size_t len){
+	if (s.len >= len){
+		return -1;
+	}
+	memcpy(buf, s.p, s.len);
+	buf[s.len] = 0;
+	return 0;
+}
+
+/* The first a or b in [p, end), or end. */
+char *scanFor(char *p, char *end, char a, char b){
+#if defined(__AVX2__)
+	if (parseSimd){
+		__m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), v;
+		unsigned int mask;
+
+		for (; 32 <= end - p; p += 32){
+			v = _mm256_loadu_si256((__m256i *)p);
+			if (0 != (mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb))))){
+				return p + __builtin_ctz(mask);
+			}
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	if (parseSimd){
+		__m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+		unsigned int mask;
+
+		for (; 16 <= end - p; p += 16){
+			v = _mm_loadu_si128((__m128i *)p);
+			if (0 != (mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb))))){
+				return p + __builtin_ctz(mask);
+			}
+		}
+	}
+#endif
+	for (; p < end; p++){
+		if (a == *p || b == *p){
+			return p;
+		}
+	}
+	return end;
+}
+
+/* Parses "METHOD uri HTTP/x.y" into h. Returns -1 unless it has all three parts. */
+int parseRequestLine(httpHead *h, char *line, char *end){
+	char *sp;
+
+	sp = scanFor(line, end, ' ', '\t');
+	h->method.p = line;
+	h->method.len = sp - line;
+	for (line = sp; line < end && (' ' == *line || '\t' == *line); line++)
+		;
+	sp = scanFor(line, end, ' ', '\t');
+	h->uri.p = line;
+	h->uri.len = sp - line;
+	for (line = sp; line < end && (' ' == *line || '\t' == *line); line++)
+		;
+	if (0 == h->method.len || 0 == h->uri.len || line == end){
+		return -1;
+	}
+	/* An unrecognised version is taken as HTTP/1.0. */
+	parseVersion(h, line, end);
+	return 0;
+}
+
+/* Parses "HTTP/x.y status reason" into h. Returns -1 if it is not a status line. */
+int parseStatusLine(httpHead *h, char *line, char *end){
+	char *p;
+
+	if (0 > parseVersion(h, line, end)){
+		return -1;
+	}
+	p = scanFor(line, end, ' ', '\t');
+	for (; p < end && ' ' == *p; p++)
+		;
+	return 0 > (h->status = parseNumber(&p, end)) ? -1 : 0;
+}
+
+/* Reads the version at p into h. Returns -1, leaving it alone, unless it is HTTP/x.y. */
+int parseVersion(httpHead *h, char *p, char *end){
+	int major, minor;
+
+	if (5 > end - p || 0 != strncmp("HTTP/", p, 5)){
+		return -1;
+	}
+	p += 5;
+	if (0 > (major = parseNumber(&p, end)) || p == end || '.' != *p++ || 0 > (minor = parseNumber(&p, end))){
+		return -1;
+	}
+	h->major = major;
+	h->minor = minor;
+	return 0;
+}
+
+/* Reads the decimal number at *p, moving past it. Returns -1 if there is none. */
+int parseNumber(char **p, char *end){
+	int n = 0;
+	char *start = *p;
+
+	for (; *p < end && '0' <= **p && '9' >= **p && 100000 > n; (*p)++){
+		n = 10 * n + (**p - '0');
+	}
+	return start == *p ? -1 : n;
+}
@@ -0,0 +1,49 @@
+#ifndef __PARSE_H__
+#define __PARSE_H__
+
+#include "csapp.h"
+
+#define PARSEMAXHEADERS 64	/* header lines kept per head; more is malformed */
+
+/* A run of bytes inside the buffer being parsed; not NUL-terminated. */
+typedef struct span{
+	char *p;
+	size_t len;
+} span;
+
+/* One header line: its name, and its value without surrounding whitespace or the line ending. */
+typedef struct httpHeader{
+	span name;
+	span value;
+} httpHeader;
+
+/* A request or response head, parsed as much as has arrived. */
+typedef struct httpHead{
+	char *base;				/* buffer parsed so far; a different one starts over */
+	size_t off;				/* start of the first line not yet parsed */
+	size_t scan;			/* where the search for its end resumes */
+	int response;
+	int started;			/* the start line has been parsed */
+	span start;				/* the request or status line, without its line ending */
+	span method;			/* requests */
+	span uri;
+	int status;				/* responses */
+	int major;
+	int minor;
+	int numHeaders;
+	httpHeader headers[PARSEMAXHEADERS];
+	size_t len;				/* length of the head, blank line included, once complete */
+} httpHead;
+
+extern int parseSimd;
+
+void parseBegin(httpHead *h, int response);
+int  parseHead(httpHead *h, char *buf, size_t len);
+int  parseHeaderLine(char *line, size_t len, httpHeader *hdr);
+httpHeader *parseFind(httpHead *h, char *name);
+int  spanIs(span s, char *lit);
+int  spanHas(span s, char *word);
+int  spanCopy(span s, char *buf, size_t len);
+char *scanFor(char *p, char *end, char a, char b);
+
+#endif /* __PARSE_H__ */
@@ -0,0 +1,305 @@
+/*
+ * ----------------------------------------------------------
+ * policy.c - Eviction policies and the TinyLFU admission
+ *            filter for the cache's shards.
+ *
+ * - each size class of a shard keeps its own queues, so room
+ *   for an object is made among objects of its size; see
+ *   slab.c
+ * - clock: one queue; hits set a bit, and the hand gives
+ *   lines with it set a second chance at the head (default)
+ * - lru: one queue; every hit moves its line to the head,
+ *   which needs the shard's write lock on every hit
+ * - sieve: one FIFO queue that never reorders; the hand
+ *   walks from the tail towards the head clearing bits and
+ *   evicts the first line without one
+ * - s3fifo: new lines go to a small FIFO queue that gets
+ *   SMALLSHARE percent of its class; lines hit while there
+ *   move on to the main queue, the rest are evicted and
+ *   remembered in a ghost table, so that a url which comes
+ *   back soon goes straight to the main queue
+ * - TinyLFU: a count-min sketch of recent requests, halved
+ *   as it fills; a newcomer is admitted only if it has been
+ *   asked for more often than the line it would evict, so
+ *   a scan of one-off urls cannot flush the hot set
+ * ----------------------------------------------------------
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "policy.h"
+
+void queuePush(cacheShard *sp, int queue, int index);
+void queueUnlink(cacheShard *sp, int index);
+void oneQueueInsert(cacheShard *sp, int index);
+void oneQueueRemove(cacheShard *sp, int index, int evicted);
+void markHit(cacheShard *sp, int index);
+int  clockVictim(cacheShard *sp, cacheClass *cp);
+void lruHit(cacheShard *sp, int index);
+int  lruVictim(cacheShard *sp, cacheClass *cp);
+int  sieveVictim(cacheShard *sp, cacheClass *cp);
+void sieveRemove(cacheShard *sp, int index, int evicted);
+void s3fifoInsert(cacheShard *sp, int index);
+void s3fifoHit(cacheShard *sp, int index);
+int  s3fifoVictim(cacheShard *sp, cacheClass *cp);
+void s3fifoRemove(cacheShard *sp, int index, int evicted);
+unsigned long sketchSlot(cacheShard *sp, unsigned long hash, int row);
+int  sketchEstimate(cacheShard *sp, unsigned long hash);
+
+cachePolicy policies[] = {
+	{"clock", FALSE, oneQueueInsert, markHit, clockVictim, oneQueueRemove},
+	{"lru", TRUE, oneQueueInsert, lruHit, lruVictim, oneQueueRemove},
+	{"sieve", FALSE, oneQueueInsert, markHit, sieveVictim, sieveRemove},
+	{"s3fifo", FALSE, s3fifoInsert, s3fifoHit, s3fifoVictim, s3fifoRemove},
+	{NULL, FALSE, NULL, NULL, NULL, NULL}
+};
+
+/* The policy called name, or NULL. */
+cachePolicy *policyFind(char *name){
+	cachePolicy *p;
+
+	for (p = policies; NULL != p->name; p++){
+		if (0 == strcmp(name, p->name)){
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Empties the queues of sp's classes and sizes its ghost table and sketch to its line limit. */
+void policyInit(cacheShard *sp){
+	unsigned long width = 64;
+	cacheClass *cp;
+
+	for (cp = sp->classes; cp < sp->classes + SLABCLASSES; cp++){
+		cp->head[QUEUE_MAIN] = cp->tail[QUEUE_MAIN] = -1;
+		cp->head[QUEUE_SMALL] = cp->tail[QUEUE_SMALL] = -1;
+		cp->queued[QUEUE_MAIN] = cp->queued[QUEUE_SMALL] = 0;
+		cp->hand = -1;
+		cp->lines = 0;
+	}
+
+	while (width < 4 * (unsigned long)sp->maxLines){
+		width <<= 1;
+	}
+	/* A shard rebuilt after a worker died keeps its history. */
+	if (NULL == sp->ghost){
+		sp->ghost = cacheCalloc(width, sizeof(unsigned long));
+		sp->sketch = cacheCalloc(SKETCHROWS * width, 1);
+		sp->sketchAdds = 0;
+	}
+	sp->ghostMask = width - 1;
+	sp->sketchMask = width - 1;
+}
+
+/* Insert a line at the head of one of its class's queues. */
+void queuePush(cacheShard *sp, int queue, int index){
+	cacheClass *cp = &sp->classes[cache[index].cls];
+
+	cache[index].queue = queue;
+	cache[index].prev = -1;
+	cache[index].next = cp->head[queue];
+	if (0 <= cp->head[queue]){
+		cache[cp->head[queue]].prev = index;
+	}
+	else{
+		cp->tail[queue] = index;
+	}
+	cp->head[queue] = index;
+	cp->queued[queue] += cacheSlot(index)->size;
+}
+
+/* Remove a line from whichever queue it is in. */
+void queueUnlink(cacheShard *sp, int index){
+	cacheClass *cp = &sp->classes[cache[index].cls];
+	int queue = cache[index].queue;
+
+	if (0 <= cache[index].prev){
+		cache[cache[index].prev].next = cache[index].next;
+	}
+	else{
+		cp->head[queue] = cache[index].next;
+	}
+	if (0 <= cache[index].next){
+		cache[cache[index].next].prev = cache[index].prev;
+	}
+	else{
+		cp->tail[queue] = cache[index].prev;
+	}
+	cp->queued[queue] -= cacheSlot(index)->size;
+}
+
+/* New lines go to the head of the only queue. */
+void oneQueueInsert(cacheShard *sp, int index){
+	queuePush(sp, QUEUE_MAIN, index);
+}
+
+/* Unlinks a line of a single-queue policy. */
+void oneQueueRemove(cacheShard *sp, int index, int evicted){
+	queueUnlink(sp, index);
+}
+
+/* Sets the line's referenced bit; safe under the read lock. */
+void markHit(cacheShard *sp, int index){
+	__atomic_store_n(&cache[index].referenced, TRUE, __ATOMIC_RELAXED);
+}
+
+/* Sweep the CLOCK hand from the tail: referenced lines lose their bit and go back to the head. */
+int clockVictim(cacheShard *sp, cacheClass *cp){
+	int index;
+
+	if (0 > cp->tail[QUEUE_MAIN]){
+		return -1;
+	}
+	while (__atomic_exchange_n(&cache[index = cp->tail[QUEUE_MAIN]].referenced, FALSE, __ATOMIC_RELAXED)){
+		queueUnlink(sp, index);
+		queuePush(sp, QUEUE_MAIN, index);
+	}
+	return index;
+}
+
+/* Moves the line to the head. Needs the write lock, which exclusiveHits asks for. */
+void lruHit(cacheShard *sp, int index){
+	if (sp->classes[cache[index].cls].head[QUEUE_MAIN] != index){
+		queueUnlink(sp, index);
+		queuePush(sp, QUEUE_MAIN, index);
+	}
+}
+
+/* The least recently used line is always at the tail. */
+int lruVictim(cacheShard *sp, cacheClass *cp){
+	return cp->tail[QUEUE_MAIN];
+}
+
+/* Walk the hand towards the head, wrapping at it, clearing bits until a line without one turns up. */
+int sieveVictim(cacheShard *sp, cacheClass *cp){
+	int index = 0 <= cp->hand ? cp->hand : cp->tail[QUEUE_MAIN];
+
+	if (0 > index){
+		return -1;
+	}
+	while (__atomic_exchange_n(&cache[index].referenced, FALSE, __ATOMIC_RELAXED)){
+		if (0 > (index = cache[index].prev)){
+			index = cp->tail[QUEUE_MAIN];
+		}
+	}
+	cp->hand = index;
+	return index;
+}
+
+/* Unlinks a line, first stepping the hand past it if it points there. */
+void sieveRemove(cacheShard *sp, int index, int evicted){
+	cacheClass *cp = &sp->classes[cache[index].cls];
+
+	if (cp->hand == index){
+		cp->hand = cache[index].prev;
+	}
+	queueUnlink(sp, index);
+}
+
+/* A url evicted from the small queue not long ago goes straight to the main one. */
+void s3fifoInsert(cacheShard *sp, int index){
+	unsigned long hash = cache[index].hash;
+
+	if (hash == sp->ghost[hash & sp->ghostMask]){
+		sp->ghost[hash & sp->ghostMask] = 0;
+		queuePush(sp, QUEUE_MAIN, index);
+		return;
+	}
+	queuePush(sp, QUEUE_SMALL, index);
+}
+
+/* Counts hits up to 3; safe under the read lock, a lost increment only costs a little accuracy. */
+void s3fifoHit(cacheShard *sp, int index){
+	int hits = __atomic_load_n(&cache[index].referenced, __ATOMIC_RELAXED);
+
+	if (3 > hits){
+		__atomic_store_n(&cache[index].referenced, hits + 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Evicts from the small queue while it is over its share of the class, promoting lines that were hit there; otherwise from the main queue, reinserting lines that were hit and counting them down. */
+int s3fifoVictim(cacheShard *sp, cacheClass *cp){
+	int index;
+
+	while (0 <= cp->tail[QUEUE_SMALL] || 0 <= cp->tail[QUEUE_MAIN]){
+		if (0 <= cp->tail[QUEUE_SMALL]
+			&& ((cp->queued[QUEUE_SMALL] + cp->queued[QUEUE_MAIN]) * SMALLSHARE / 100 <= cp->queued[QUEUE_SMALL] || 0 > cp->tail[QUEUE_MAIN])){
+			index = cp->tail[QUEUE_SMALL];
+			if (0 == cache[index].referenced){
+				return index;
+			}
+			cache[index].referenced = 0;
+			queueUnlink(sp, index);
+			queuePush(sp, QUEUE_MAIN, index);
+			continue;
+		}
+		index = cp->tail[QUEUE_MAIN];
+		if (0 == cache[index].referenced){
+			return index;
+		}
+		cache[index].referenced--;
+		queueUnlink(sp, index);
+		queuePush(sp, QUEUE_MAIN, index);
+	}
+	return -1;
+}
+
+/* Unlinks a line; one evicted from the small queue leaves its hash in the ghost table. */
+void s3fifoRemove(cacheShard *sp, int index, int evicted){
+	unsigned long hash = cache[index].hash;
+
+	if (evicted && QUEUE_SMALL == cache[index].queue){
+		sp->ghost[hash & sp->ghostMask] = hash;
+	}
+	queueUnlink(sp, index);
+}
+
+/* Where row's counter for hash is; each row mixes the hash differently. */
+unsigned long sketchSlot(cacheShard *sp, unsigned long hash, int row){
+	hash += (row + 1) * 0x9e3779b97f4a7c15UL;
+	hash = (hash ^ (hash >> 31)) * 0xbf58476d1ce4e5b9UL;
+	hash ^= hash >> 29;
+	return row * (sp->sketchMask + 1) + (hash & sp->sketchMask);
+}
+
+/* Counts a request for hash. Safe under the read lock: counters are bytes, and a lost increment only costs a little accuracy. */
+void sketchAdd(cacheShard *sp, unsigned long hash){
+	unsigned char count;
+	unsigned long slot;
+	int row;
+
+	for (row = 0; row < SKETCHROWS; row++){
+		slot = sketchSlot(sp, hash, row);
+		count = __atomic_load_n(&sp->sketch[slot], __ATOMIC_RELAXED);
+		if (SKETCHMAX > count){
+			__atomic_store_n(&sp->sketch[slot], count + 1, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(&sp->sketchAdds, 1, __ATOMIC_RELAXED);
+}
+
+/* How often hash has been asked for recently: its smallest counter. */
+int sketchEstimate(cacheShard *sp, unsigned long hash){
+	int row, count, least = SKETCHMAX;
+
+	for (row = 0; row < SKETCHROWS; row++){
+		count = __atomic_load_n(&sp->sketch[sketchSlot(sp, hash, row)], __ATOMIC_RELAXED);
+		least = count < least ? count : least;
+	}
+	return least;
+}
+
+/* TRUE if candidate has been asked for more often than victim. Caller holds the write lock, so this is also where the sketch is halved once it has seen ten requests per counter. */
+int sketchAdmit(cacheShard *sp, unsigned long candidate, unsigned long victim){
+	unsigned long i;
+
+	if (10 * (sp->sketchMask + 1) <= sp->sketchAdds){
+		for (i = 0; i < SKETCHROWS * (sp->sketchMask + 1); i++){
+			sp->sketch[i] >>= 1;
+		}
+		sp->sketchAdds = 0;
+	}
+	return sketchEstimate(sp, candidate) > sketchEstimate(sp, victim);
+}
@@ -0,0 +1,34 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+#define SKETCHROWS 4
+#define SKETCHMAX 15		/* counters saturate here, like 4-bit ones */
+#define SMALLSHARE 10		/* S3-FIFO: percent of a class's bytes for the small queue */
+#define POLICYNAMES "clock, lru, sieve or s3fifo"	/* what policyFind knows, for usage texts */
+
+/* The queues a size class keeps its lines in. Single-queue policies use only QUEUE_MAIN. */
+enum { QUEUE_MAIN, QUEUE_SMALL };
+
+/*
+ * An eviction policy, run over each size class of a shard
+ * separately. Every hook runs under the shard's write lock
+ * except hit, which runs under the read lock unless the
+ * policy sets exclusiveHits.
+ */
+typedef struct cachePolicy{
+	char *name;
+	int exclusiveHits;
+	void (*insert)(cacheShard *sp, int index);				/* a line has just been linked */
+	void (*hit)(cacheShard *sp, int index);
+	int  (*victim)(cacheShard *sp, cacheClass *cp);			/* the next line of the class to evict, -1 if none */
+	void (*remove)(cacheShard *sp, int index, int evicted);	/* a line is being unlinked */
+} cachePolicy;
+
+cachePolicy *policyFind(char *name);
+void policyInit(cacheShard *sp);
+void sketchAdd(cacheShard *sp, unsigned long hash);
+int  sketchAdmit(cacheShard *sp, unsigned long candidate, unsigned long victim);
+
+#endif /* __POLICY_H__ */
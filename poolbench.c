@@ -0,0 +1,190 @@
+/*
+ * ----------------------------------------------------------
+ * poolbench.c - Compares the two ways proxy hands accepted
+ *               connections to threads.
+ *
+ * - spawn: malloc the connfd and create a detached thread
+ *   per connection, as proxy does by default
+ * - pool: pool_submit to prespawned workers with their own
+ *   work-stealing queues, as proxy -w does
+ *
+ * Each connection is one end of a socketpair holding a small
+ * request; the handler reads it to EOF, spins for the given
+ * number of microseconds and closes it. Reports connections
+ * per second and the delay between handing a connection off
+ * and a thread starting on it.
+ *
+ * usage: poolbench [-n conns] [-w workers] [-q depth] [-u usecs]
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <sched.h>
+#include "csapp.h"
+#include "sbuf.h"
+
+#define MAXFDS 65536
+
+void handler(int fd);
+void *spawnThread(void *vargp);
+double runSpawn(int conns);
+double runPool(int conns, int workers, int depth);
+int makeConn();
+double now();
+void report(char *name, int conns, double secs);
+
+double handedOff[MAXFDS];	/* when each fd was handed to a thread */
+double delaySum;
+double delayMax;
+long finished;
+int work;
+pthread_mutex_t statLock = PTHREAD_MUTEX_INITIALIZER;
+
+int main(int argc, char **argv)
+{
+	int conns = 100000;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int depth = 64;
+	int opt;
+
+	while (-1 != (opt = getopt(argc, argv, "n:w:q:u:"))){
+		switch (opt){
+		case 'n':
+			conns = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'u':
+			work = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n conns] [-w workers] [-q depth] [-u usecs]\n", argv[0]);
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	Signal(SIGPIPE, SIG_IGN);
+	printf("%d connections, %d us of work each\n", conns, work);
+	report("spawn-per-accept", conns, runSpawn(conns));
+	report("work-stealing pool", conns, runPool(conns, workers, depth));
+	exit(EXIT_SUCCESS);
+}
+
+/* Hand every connection to a freshly spawned detached thread. Returns elapsed seconds. */
+double runSpawn(int conns){
+	pthread_t tid;
+	double start = now();
+	int i, *connfd;
+
+	finished = 0;
+	delaySum = delayMax = 0;
+	for (i = 0; i < conns; i++){
+		connfd = Malloc(sizeof(int));
+		*connfd = makeConn();
+		handedOff[*connfd] = now();
+		while (0 != pthread_create(&tid, NULL, spawnThread, connfd)){
+			sched_yield();
+		}
+	}
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < conns){
+		sched_yield();
+	}
+	return now() - start;
+}
+
+/* Hand every connection to the pool, retrying while all queues are full. Returns elapsed seconds. */
+double runPool(int conns, int workers, int depth){
+	static pool_t pool;
+	double start;
+	long full = 0;
+	int i, fd;
+
+	pool_init(&pool, workers, depth, handler);
+	printf("pool: %d workers, queue depth %d\n", workers, depth);
+
+	finished = 0;
+	delaySum = delayMax = 0;
+	start = now();
+	for (i = 0; i < conns; i++){
+		fd = makeConn();
+		handedOff[fd] = now();
+		while (!pool_submit(&pool, fd)){
+			full++;
+			sched_yield();
+		}
+	}
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < conns){
+		sched_yield();
+	}
+	if (full){
+		printf("pool: queues were full %ld times\n", full);
+	}
+	return now() - start;
+}
+
+/* Thread body for the spawn path. */
+void *spawnThread(void *vargp){
+	int connfd = *((int *)vargp);
+
+	Pthread_detach(pthread_self());
+	free(vargp);
+	handler(connfd);
+	return NULL;
+}
+
+/* Read the request, do the configured amount of work and close. */
+void handler(int fd){
+	char buf[256];
+	double start = now(), delay = start - handedOff[fd];
+
+	while (0 < read(fd, buf, sizeof(buf)))
+		;
+	while (now() - start < work / 1e6)
+		;
+	close(fd);
+
+	pthread_mutex_lock(&statLock);
+	delaySum += delay;
+	if (delay > delayMax){
+		delayMax = delay;
+	}
+	pthread_mutex_unlock(&statLock);
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+}
+
+/* Create a connection that already holds a request and is closed by the peer. */
+int makeConn(){
+	static char req[] = "GET http://localhost/ HTTP/1.0\r\n\r\n";
+	int sv[2];
+
+	while (0 > socketpair(AF_UNIX, SOCK_STREAM, 0, sv)){
+		/* Out of descriptors: wait for handlers to close some. */
+		sched_yield();
+	}
+	if (MAXFDS <= sv[1]){
+		app_error("too many descriptors open");
+	}
+	rio_writen(sv[0], req, strlen(req));
+	close(sv[0]);
+	return sv[1];
+}
+
+/* Monotonic time in seconds. */
+double now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print throughput and hand-off delay for one run. */
+void report(char *name, int conns, double secs){
+	printf("%-20s %10.0f conns/s  hand-off delay avg %8.1f us  max %10.1f us\n",
+	       name, conns / secs, 1e6 * delaySum / conns, 1e6 * delayMax);
+}
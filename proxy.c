@@ -6,362 +6,1432 @@
  *
  * Utilizes threading:
  * 
- * - spawns NTHREADS threads
- * - threads block on sbufremove (in thread) until client's
- *   connection request is processed and pushed into FIFO 
- *   queue
- * - mutex prevents multiple threads accessing same client
- *   request
+ * - by default spawns a detached thread per connection
+ * - with -w prespawns that many workers instead; each has
+ *   its own bounded lock-free queue (see sbuf.c), the
+ *   acceptor hands connfds out round robin and idle workers
+ *   steal from busy ones
+ * - a worker never waits on a keep-alive client for its next
+ *   request: with nothing buffered it parks the connection
+ *   in the acceptor's epoll set, which queues it again once
+ *   bytes arrive, so idle clients hold no worker
+ * - connections are admitted, or turned away with a fast 503
+ *   or 429, by admit.c: an overall budget, per-address limits
+ *   and a target for time spent queued for a worker; a full
+ *   set of queues, or a thread that cannot be created, is
+ *   refused the same way
+ * - a client gets --header-timeout for a whole request head,
+ *   an origin --connect-timeout and --first-byte-timeout,
+ *   and a response may not stall for --idle-timeout either
+ *   way; a connection that runs out of time is closed, so a
+ *   slowloris cannot hold a thread or a slot for good (see
+ *   deadline.c)
+ * - a connection waiting for its next request holds no
+ *   buffer and its thread no metrics slot; the rio_t and
+ *   the lines a request is worked through come from a
+ *   shared pool once bytes arrive (see bufpool.c), so a
+ *   connection thread needs only THREADSTACK of stack
+ * 
+ * Supports event-driven mode (-e):
+ *
+ * - runs one epoll loop per core (or -n loops) over
+ *   non-blocking, edge-triggered sockets; see event.c
+ * - thread-per-connection remains the default
+ *
+ * Supports multiple processes (-P):
+ *
+ * - forks that many workers, each accepting on its own
+ *   SO_REUSEPORT socket and running any of the front ends
+ *   above (event mode then defaults to one loop each)
+ * - they share one cache in shared memory, and a supervisor
+ *   restarts any that die without losing it; see
+ *   supervise.c
+ * - everything but the cache is per worker: connection
+ *   limits, the upstream pool, the resolver, shared misses,
+ *   the disk tier (which gets its share of --disk-bytes)
+ *   and most counters on the status page
+ * 
+ * Keeps client connections open:
+ *
+ * - HTTP/1.1 clients (and 1.0 ones asking for keep-alive)
+ *   can send further, even pipelined, requests on the same
+ *   connection; they are answered in order
+ * - hits and misses alike carry a Content-Length; a body of
+ *   unknown length is held back up to the largest cacheable
+ *   object to get one, and
+ *   past that is chunked for 1.1 clients or ended by close
+ * - cached objects keep their head without a Connection
+ *   header, which is added per client as they are sent,
+ *   along with "X-Cache: HIT" so clients can tell them apart
+ *   from responses fetched for them (see client.c)
+ * - event mode (-e) still answers one request per connection
+ * - request and response heads are parsed in place, as
+ *   spans of the buffer they were read into; see parse.c
+ *
+ * Talks to origins over pooled HTTP/1.1 connections:
+ *
+ * - idle keep-alive connections are kept per (host, port)
+ *   and reused; see upstream.c
+ * - responses are framed by Content-Length or chunked
+ *   encoding (de-chunked, then reframed for the client) so
+ *   the connection can go back to the pool afterwards
+ * - host names go through a caching resolver with its own
+ *   threads (see resolver.c), so lookups neither serialize
+ *   behind a global lock nor block the event loops
+ * - pool and resolver counters are served at STATUSPATH
+ * - request totals and per-stage latency histograms are
+ *   served at METRICSPATH in Prometheus text format, along
+ *   with those counters; see metrics.c
  * 
  * Supports Caching:
  *
- * - caches items that are smaller than MAXOBJ
- * - if cache is full it uses LRU to evict the oldest item
- * - the cache has maximum capacity MAXCACHE
+ * - caches items that are smaller than --max-object (MAXOBJ)
+ * - if cache is full it evicts by --cache-policy: CLOCK (an
+ *   approximation of LRU, the default), strict LRU, SIEVE
+ *   or S3-FIFO; --cache-admission tinylfu additionally keeps
+ *   one-off urls from displacing popular ones; see policy.c
+ * - the cache has maximum capacity --cache-bytes (MAXCACHE)
+ *   in at most --cache-lines (NUMLINES) objects
+ * - the cache is split into shards by url hash, each with
+ *   its own lock and share of the budget; a hit only takes
+ *   a read lock, unless the policy is strict LRU or the
+ *   cache is shared between worker processes (-P), where
+ *   every lookup takes the shard's process-shared mutex
+ * - cached objects are immutable and reference counted, so
+ *   a slow client pins only its own object while it is sent
+ * - lookups are hashed and the CLOCK list is intrusive, so
+ *   every cache operation is O(1); see cache.c
+ * - concurrent misses on one url share a single origin
+ *   fetch and stream it as it arrives; see flight.c
+ * - with --cache-file, the cache's lines and objects are a
+ *   mapping of that file, so a restart picks up where the
+ *   last run left off; torn entries fail a checksum and are
+ *   dropped on first hit
+ * - with --disk-dir, larger objects go to a disk tier
+ *   with its own budget and are sent with sendfile(); see
+ *   diskcache.c
+ * - only 200s that allow it are cached, each for its
+ *   freshness lifetime; a stale copy is revalidated with a
+ *   conditional request and sent again if the origin
+ *   answers 304 (event mode fetches it again in full);
+ *   see fresh.c
+ * - popular objects are refreshed in the background just
+ *   before they expire, and a recently expired one is sent
+ *   stale while it is refreshed; see refresh.c
  * 
  * by: Benjamin Shih (bshih1) & Rentaro Matsukata (rmatsuka)
  * ----------------------------------------------------------
  */
 
 #define _GNU_SOURCE
-#define PORT 80
-#define TRUE 1
-#define FALSE 0
-#define NUMLINES 100
-#define MAXCACHE 1048576
-#define MAXOBJ 102400
-
-#ifdef DEBUG
-#define dbg_printf(...) printf(__VA_ARGS__)
-#else
-#define dbg_printf(...)
-#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
-
-typedef struct cacheLine{
-	pthread_mutex_t mutex;
-	int size;
-	int LRUstamp;
-	char *data;
-	char url[MAXLINE];
-} cacheLine;
+#include "proxy.h"
+#include "event.h"
+#include "sbuf.h"
+#include "cache.h"
+#include "policy.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "relay.h"
+#include "flight.h"
+#include "diskcache.h"
+#include "fresh.h"
+#include "refresh.h"
+#include "metrics.h"
+#include "admit.h"
+#include "deadline.h"
+#include "bufpool.h"
+#include "supervise.h"
 
 /* FUNCTION PROTOTYPES */
-void lockCacheW();
-void lockCacheR();
-void unlockCache();
-int  cacheCheck(char *url);
-int  cacheVacancy();
-int  leastRecentlyUsed();
-void cacheLineFree(int cacheIndex);
 void *thread(void *vargp);
-void cacheAlloc(int cacheIndex, char *content, char *url, size_t size);
-void procRequest(int connfd);
-void genRequest(int connfd, rio_t *browserio, char *uri, char* host, char* filePath, int numPort);
-void initCache();
-
-cacheLine cache[NUMLINES];
-int overallCacheSize = 0;
-int occupiedCacheLines = 0;
-pthread_rwlock_t cacheLock;
-pthread_mutex_t openLock;
-int timeStamp = 1;
+void serveConn(int connfd);
+void servePooled(int connfd);
+void serveTurn(int connfd, int park);
+int  parkConn(int connfd);
+void shedLate(pool_t *pp);
+int  procRequest(int connfd, int park);
+int  readableNow(int fd);
+int  waitReadable(int fd);
+int  handleRequest(int connfd, rio_t *browserio);
+int  hitLookup(char *uri, char *host, char *filePath, int numPort, cacheObj **obj, diskObj **dobj);
+int  hitSend(int connfd, cacheObj *obj, diskObj *dobj, int keepAlive);
+void hitRelease(cacheObj *obj, diskObj *dobj);
+int  fetchOrigin(int connfd, char *uri, char *host, char *filePath, int numPort, struct iovec *headers, int numHeaders, int chunkedOk, int keepAlive, flight *f, char *staleHead, size_t staleLen, long *refreshed, char *scratch);
+int  missRequest(int connfd, char *uri, char *host, char *filePath, int numPort, httpHead *req, int chunkedOk, int keepAlive, cacheObj *stale, diskObj *diskStale);
+int  forwardIov(httpHead *req, int revalidating, struct iovec *iov);
+void usage(char *name);
+int  sendObject(int connfd, cacheObj *obj, int keepAlive);
+char *responseHead(char *head, size_t headLen, long long bodyLen, size_t *keptLen);
+int  appendBuf(char **buf, size_t *len, size_t *cap, char *data, size_t n);
+int  appendSpan(char **buf, size_t *len, size_t *cap, char *start, char *end);
+int  readHead(rio_t *rp, httpHead *h, char **buf, size_t *len, size_t *cap, long *first);
+
+/* A keep-alive connection a worker has handed back to the acceptor until its next request arrives. */
+typedef struct parkedConn{
+	int fd;
+	deadline dl;		/* the header timeout, while it waits */
+} parkedConn;
+
+void unpark(pool_t *pp, parkedConn *pc);
+
 int port;
+int parkfd = -1;	/* -w: the acceptor's epoll set of parked connections, and its listening socket */
+
+/* Options without a short form. */
+enum { OPT_UPSTREAM_PER_HOST = 256, OPT_UPSTREAM_IDLE, OPT_UPSTREAM_TIMEOUT, OPT_UPSTREAM_RETRIES,
+	OPT_DNS_THREADS, OPT_DNS_TTL, OPT_DNS_NEGATIVE_TTL, OPT_HOSTS, OPT_DISK_DIR, OPT_DISK_BYTES, OPT_DISK_MAX_OBJECT,
+	OPT_CACHE_FILE, OPT_CACHE_BYTES, OPT_CACHE_LINES, OPT_MAX_OBJECT, OPT_CACHE_POLICY, OPT_CACHE_ADMISSION, OPT_CACHE_TTL,
+	OPT_STALE_WHILE_REVALIDATE, OPT_REFRESH_THREADS, OPT_MAX_CONNS, OPT_CLIENT_CONNS, OPT_CLIENT_RATE, OPT_CLIENT_BURST,
+	OPT_QUEUE_TARGET, OPT_HEADER_TIMEOUT, OPT_CONNECT_TIMEOUT, OPT_FIRST_BYTE_TIMEOUT, OPT_IDLE_TIMEOUT };
 
 int main(int argc, char *argv [])
 {
-	int *connfd, listenfd;
+	int *connfd, listenfd, clientfd, opt, reason;
+	int eventMode = FALSE;
+	int loops = 0;
+	int workers = 0;
+	int procs = 0;
+	int depth = QUEUEDEPTH;
+	int poolPerHost = 8, poolIdle = 256, poolTimeout = 30, poolRetries = 1;
+	int dnsThreads = 2, dnsTtl = 60, dnsNegativeTtl = 10;
+	char *hostsFile = NULL;
+	char *diskDir = NULL;
+	char *cacheFile = NULL;
+	long long cacheBytes = MAXCACHE, maxObject = MAXOBJ;
+	int cacheLines = NUMLINES, admission = FALSE;
+	long cacheTtl = FRESHTTL, staleWindow = FRESHSTALE;
+	int refreshThreads = 2;
+	long maxConns = ADMITCONNS, queueTarget = ADMITTARGET;
+	int clientConns = 0;
+	double clientRate = 0, clientBurst = 0;
+	double headerTimeout = DEADLINEHEADER, connectTimeout = DEADLINECONNECT, firstByteTimeout = DEADLINEFIRSTBYTE, idleTimeout = DEADLINEIDLE;
+	cachePolicy *policy = policyFind("clock");
+	long long diskBytes = 1LL << 30, diskMaxObject = 256LL << 20;
+	pool_t pool;
+	struct epoll_event ev, events[PARKEVENTS];
+	int i, n, one = 1;
 	struct sockaddr_in addr;
 	unsigned int len;
+	pthread_attr_t attr;
+	static struct option longOpts[] = {
+		{"event", no_argument, NULL, 'e'},
+		{"loops", required_argument, NULL, 'n'},
+		{"workers", required_argument, NULL, 'w'},
+		{"procs", required_argument, NULL, 'P'},
+		{"queue-depth", required_argument, NULL, 'q'},
+		{"upstream-per-host", required_argument, NULL, OPT_UPSTREAM_PER_HOST},
+		{"upstream-idle", required_argument, NULL, OPT_UPSTREAM_IDLE},
+		{"upstream-timeout", required_argument, NULL, OPT_UPSTREAM_TIMEOUT},
+		{"upstream-retries", required_argument, NULL, OPT_UPSTREAM_RETRIES},
+		{"dns-threads", required_argument, NULL, OPT_DNS_THREADS},
+		{"dns-ttl", required_argument, NULL, OPT_DNS_TTL},
+		{"dns-negative-ttl", required_argument, NULL, OPT_DNS_NEGATIVE_TTL},
+		{"hosts", required_argument, NULL, OPT_HOSTS},
+		{"disk-dir", required_argument, NULL, OPT_DISK_DIR},
+		{"disk-bytes", required_argument, NULL, OPT_DISK_BYTES},
+		{"disk-max-object", required_argument, NULL, OPT_DISK_MAX_OBJECT},
+		{"cache-file", required_argument, NULL, OPT_CACHE_FILE},
+		{"cache-bytes", required_argument, NULL, OPT_CACHE_BYTES},
+		{"cache-lines", required_argument, NULL, OPT_CACHE_LINES},
+		{"max-object", required_argument, NULL, OPT_MAX_OBJECT},
+		{"cache-policy", required_argument, NULL, OPT_CACHE_POLICY},
+		{"cache-admission", required_argument, NULL, OPT_CACHE_ADMISSION},
+		{"cache-ttl", required_argument, NULL, OPT_CACHE_TTL},
+		{"stale-while-revalidate", required_argument, NULL, OPT_STALE_WHILE_REVALIDATE},
+		{"refresh-threads", required_argument, NULL, OPT_REFRESH_THREADS},
+		{"max-conns", required_argument, NULL, OPT_MAX_CONNS},
+		{"client-conns", required_argument, NULL, OPT_CLIENT_CONNS},
+		{"client-rate", required_argument, NULL, OPT_CLIENT_RATE},
+		{"client-burst", required_argument, NULL, OPT_CLIENT_BURST},
+		{"queue-target", required_argument, NULL, OPT_QUEUE_TARGET},
+		{"header-timeout", required_argument, NULL, OPT_HEADER_TIMEOUT},
+		{"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+		{"first-byte-timeout", required_argument, NULL, OPT_FIRST_BYTE_TIMEOUT},
+		{"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+		{NULL, 0, NULL, 0}
+	};
 
-	if (2 != argc){
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(EXIT_SUCCESS);
+	while (-1 != (opt = getopt_long(argc, argv, "en:w:P:q:", longOpts, NULL))){
+		switch (opt){
+		case 'e':
+			eventMode = TRUE;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 'P':
+			procs = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case OPT_UPSTREAM_PER_HOST:
+			poolPerHost = atoi(optarg);
+			break;
+		case OPT_UPSTREAM_IDLE:
+			poolIdle = atoi(optarg);
+			break;
+		case OPT_UPSTREAM_TIMEOUT:
+			poolTimeout = atoi(optarg);
+			break;
+		case OPT_UPSTREAM_RETRIES:
+			poolRetries = atoi(optarg);
+			break;
+		case OPT_DNS_THREADS:
+			dnsThreads = atoi(optarg);
+			break;
+		case OPT_DNS_TTL:
+			dnsTtl = atoi(optarg);
+			break;
+		case OPT_DNS_NEGATIVE_TTL:
+			dnsNegativeTtl = atoi(optarg);
+			break;
+		case OPT_HOSTS:
+			hostsFile = optarg;
+			break;
+		case OPT_DISK_DIR:
+			diskDir = optarg;
+			break;
+		case OPT_DISK_BYTES:
+			diskBytes = parseSize(optarg);
+			break;
+		case OPT_DISK_MAX_OBJECT:
+			diskMaxObject = parseSize(optarg);
+			break;
+		case OPT_CACHE_FILE:
+			cacheFile = optarg;
+			break;
+		case OPT_CACHE_BYTES:
+			cacheBytes = parseSize(optarg);
+			break;
+		case OPT_CACHE_LINES:
+			cacheLines = atoi(optarg);
+			break;
+		case OPT_MAX_OBJECT:
+			maxObject = parseSize(optarg);
+			break;
+		case OPT_CACHE_POLICY:
+			if (NULL == (policy = policyFind(optarg))){
+				usage(argv[0]);
+			}
+			break;
+		case OPT_CACHE_ADMISSION:
+			if (0 == strcmp("tinylfu", optarg)){
+				admission = TRUE;
+			}
+			else if (0 != strcmp("none", optarg)){
+				usage(argv[0]);
+			}
+			break;
+		case OPT_CACHE_TTL:
+			cacheTtl = atol(optarg);
+			break;
+		case OPT_STALE_WHILE_REVALIDATE:
+			staleWindow = atol(optarg);
+			break;
+		case OPT_REFRESH_THREADS:
+			refreshThreads = atoi(optarg);
+			break;
+		case OPT_MAX_CONNS:
+			maxConns = atol(optarg);
+			break;
+		case OPT_CLIENT_CONNS:
+			clientConns = atoi(optarg);
+			break;
+		case OPT_CLIENT_RATE:
+			clientRate = atof(optarg);
+			break;
+		case OPT_CLIENT_BURST:
+			clientBurst = atof(optarg);
+			break;
+		case OPT_QUEUE_TARGET:
+			queueTarget = atol(optarg);
+			break;
+		case OPT_HEADER_TIMEOUT:
+			headerTimeout = atof(optarg);
+			break;
+		case OPT_CONNECT_TIMEOUT:
+			connectTimeout = atof(optarg);
+			break;
+		case OPT_FIRST_BYTE_TIMEOUT:
+			firstByteTimeout = atof(optarg);
+			break;
+		case OPT_IDLE_TIMEOUT:
+			idleTimeout = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
 
-	/* Create mutex. */
-	if (0 != (pthread_rwlock_init(&cacheLock, NULL)) || 0 != (pthread_mutex_init(&openLock, NULL))){
-		fprintf(stderr, "Error opening listenfd\n");
-		exit(1);
+	if (1 != argc - optind || (eventMode && 0 < workers) || 0 >= depth || 0 > procs || SUPERVISEMAX < procs || 0 >= dnsThreads || 0 >= diskBytes || 0 >= diskMaxObject
+		|| 0 >= cacheLines || 0 >= maxObject || cacheBytes < maxObject || 0 > cacheTtl
+		|| 0 > staleWindow || 0 > refreshThreads || 0 > maxConns || 0 > clientConns || 0 > clientRate || 0 > clientBurst
+		|| 0 > queueTarget || 0 > headerTimeout || 0 > connectTimeout || 0 > firstByteTimeout || 0 > idleTimeout){
+		usage(argv[0]);
 	}
 
-	port = atoi(argv[1]);
+	port = atoi(argv[optind]);
 	Signal(SIGPIPE, SIG_IGN);
-    initCache();
+    initCache(cacheFile, cacheBytes, cacheLines, maxObject, policy, admission, procs);
+
+	/* Worker processes fork off here, with the cache shared and before anything has started a thread; the supervisor stays in superviseRun. */
+	if (0 < procs){
+		if (0 > (listenfd = openReusePort(port))){
+			fprintf(stderr, "Error opening port %d for worker processes.\n", port);
+			exit(1);
+		}
+		close(listenfd);
+		cacheWorker = superviseRun(procs);
+		/* The disk tier is each worker's own, so each gets its share. */
+		diskBytes /= procs;
+	}
+	freshInit(cacheTtl, staleWindow);
+	upstreamInit(poolPerHost, poolIdle, poolTimeout, poolRetries);
+	resolverInit(dnsThreads, dnsTtl, dnsNegativeTtl, hostsFile);
+	if (NULL != diskDir){
+		diskInit(diskDir, diskBytes, diskMaxObject);
+	}
+	refreshInit(refreshThreads);
+	/* A burst of a second's worth unless told otherwise. */
+	admitInit(maxConns, clientConns, clientRate, 0 < clientBurst ? clientBurst : clientRate, queueTarget);
+	deadlineInit(headerTimeout * 1000, connectTimeout * 1000, firstByteTimeout * 1000, idleTimeout * 1000);
+	bufPoolInit();
 	pthread_t concurrThread;
 
-	/* Opens the port provided on the command line. */
-	if(0 > (listenfd = open_listenfd(port))){
+	/* Opens the port provided on the command line; worker processes each bind it alongside the others. */
+	if(0 > (listenfd = 0 < procs ? openReusePort(port) : open_listenfd(port))){
 		fprintf(stderr, "Error opening port with open_listenfd.\n");
 		exit(1);
 	}
 
-	while(1){
-		if (NULL == (connfd = malloc(sizeof(int)))){
-			fprintf(stderr, "Error allocating memory for connfd.\n");
-			continue;
+	/* One epoll loop per core drives every connection; never returns. */
+	if (eventMode){
+		if (0 >= loops){
+			loops = 0 < procs ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
 		}
+		eventRun(listenfd, loops);
+	}
 
+	/* Prespawned workers: the acceptor only queues connfds, sheds those that wait too long for a worker, and watches the parked ones for their next request. */
+	if (0 < workers){
+		pool_init(&pool, workers, depth, servePooled);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (0 > (parkfd = epoll_create1(EPOLL_CLOEXEC)) || 0 > epoll_ctl(parkfd, EPOLL_CTL_ADD, listenfd, &ev)){
+			fprintf(stderr, "Error creating the acceptor's epoll set.\n");
+			exit(1);
+		}
+		while(1){
+			/* Workers held by long connections never come to look, so check the queues twice a target whether or not anyone connects. */
+			shedLate(&pool);
+			if (0 > (n = epoll_wait(parkfd, events, PARKEVENTS, 0 < queueTarget ? queueTarget / 2 + 1 : -1))){
+				if (EINTR != errno){
+					fprintf(stderr, "Error waiting in the acceptor.\n");
+				}
+				continue;
+			}
+			for (i = 0; i < n; i++){
+				if (NULL != events[i].data.ptr){
+					unpark(&pool, events[i].data.ptr);
+					continue;
+				}
+				len = sizeof(addr);
+				if(0 > (clientfd = accept(listenfd, (SA *) &addr, &len))){
+					fprintf(stderr, "Error accepting connfd.\n");
+					continue;
+				}
+				if (ADMIT_OK != (reason = admitConn(clientfd, &addr))){
+					admitRefuse(clientfd, reason);
+					close(clientfd);
+					continue;
+				}
+				/* Set up here rather than in serveTurn, which a parked connection goes through again; see serveConn. */
+				setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				/* Every queue full is overload too; admit_refused_busy counts it. */
+				if (!pool_submit(&pool, clientfd)){
+					admitRefuse(clientfd, ADMIT_BUSY);
+					admitDone(clientfd);
+					close(clientfd);
+				}
+				else{
+					metricCount(METRIC_CONNS_OPENED, 1);
+				}
+			}
+		}
+	}
+
+	/* A connection's thread keeps its buffers in the pool, so it needs far less stack than the default reserves. */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREADSTACK);
+	while(1){
 		len = sizeof(addr);
 
-		if(0 > (*connfd = accept(listenfd, (SA *) &addr, &len))){
+		if(0 > (clientfd = accept(listenfd, (SA *) &addr, &len))){
 			fprintf(stderr, "Error accepting connfd.\n");
 			continue;
 		}
+		if (ADMIT_OK != (reason = admitConn(clientfd, &addr))){
+			admitRefuse(clientfd, reason);
+			close(clientfd);
+			continue;
+		}
 
-		if (0 != pthread_create(&concurrThread, NULL, thread, connfd)){
-			fprintf(stderr, "Error creating multiple threads.\n");
+		/* A thread that cannot be had is overload as well: the client is refused rather than dropped, and nothing leaks. */
+		if (NULL == (connfd = malloc(sizeof(int)))){
+			fprintf(stderr, "Error allocating memory for connfd.\n");
+			admitRefuse(clientfd, ADMIT_BUSY);
+			admitDone(clientfd);
+			close(clientfd);
 			continue;
 		}
+		*connfd = clientfd;
+		if (0 != pthread_create(&concurrThread, &attr, thread, connfd)){
+			fprintf(stderr, "Error creating multiple threads.\n");
+			admitRefuse(clientfd, ADMIT_BUSY);
+			admitDone(clientfd);
+			close(clientfd);
+			free(connfd);
+		}
 	}
 	exit(EXIT_SUCCESS);
 }
 
-/* Request a webpage from the server. */
-void genRequest(int connfd, rio_t *browserio, char *uri, char* host, char* filePath, int numPort){
-	char header[MAXLINE];
-	char content[MAXLINE];
-	char pageBuf[MAXLINE];
-	char cacheBuf[MAXOBJ];
-	char forward[MAXLINE];
-	char req[MAXLINE];
+/* Refuses the connections at the heads of pool's queues that have waited past the queue target. Called by the acceptor, the only thread that submits. */
+void shedLate(pool_t *pp){
+	int i, fd, reason;
+	wsq_t *q;
 
-	int cacheIndex;
-	size_t size = 0;
-	int bufSize;	
-	rio_t read_response;
+	for (i = 0; i < pp->n; i++){
+		q = &pp->workers[i].q;
+		while (0 <= (fd = wsq_peek(q)) && ADMIT_LATE == admitStart(fd)){
+			/* A worker may take it first, leaving one that is not late to be queued again. */
+			if (0 > (fd = wsq_take(q))){
+				break;
+			}
+			if (ADMIT_LATE != (reason = admitStart(fd))){
+				if (pool_submit(pp, fd)){
+					break;
+				}
+				reason = ADMIT_BUSY;
+			}
+			admitRefuse(fd, reason);
+			admitDone(fd);
+			metricCount(METRIC_CONNS_CLOSED, 1);
+			close(fd);
+		}
+	}
+}
+
+/* A parked connection has something to read, or has run out of time: queues it for a worker again, or closes it. Called by the acceptor, the only thread that submits. */
+void unpark(pool_t *pp, parkedConn *pc){
+	int fd = pc->fd, fired;
+
+	epoll_ctl(parkfd, EPOLL_CTL_DEL, fd, NULL);
+	deadlineCancel(&pc->dl);
+	fired = deadlineFired(&pc->dl);
+	free(pc);
+	if (!fired){
+		/* Its wait for a worker, and the queue target, start over from its new request. */
+		admitRequeue(fd);
+		if (pool_submit(pp, fd)){
+			return;
+		}
+		admitRefuse(fd, ADMIT_BUSY);
+	}
+	admitDone(fd);
+	metricCount(METRIC_CONNS_CLOSED, 1);
+	close(fd);
+}
+
+/* Looks uri up in memory, then on disk, pinning what it finds in *obj or *dobj for the caller to release. Returns TRUE if that copy can be sent: it is fresh or, given where to refresh it from, recently stale and being refreshed; see refreshCheck. */
+int hitLookup(char *uri, char *host, char *filePath, int numPort, cacheObj **obj, diskObj **dobj){
+	char *head;
+	size_t headLen;
+	long fetched, expires;
+
+	*dobj = NULL;
+	/* The url's shard is locked only for the lookup; the pinned object outlives eviction. */
+	if (NULL != (*obj = cacheGet(uri))){
+		head = (*obj)->data;
+		headLen = (*obj)->hdrLen;
+		fetched = __atomic_load_n(&(*obj)->fetched, __ATOMIC_RELAXED);
+		expires = __atomic_load_n(&(*obj)->expires, __ATOMIC_RELAXED);
+	}
+	/* Objects too big for memory may be in the disk tier. */
+	else if (NULL != (*dobj = diskGet(uri))){
+		head = (*dobj)->head;
+		headLen = (*dobj)->hdrLen;
+		fetched = __atomic_load_n(&(*dobj)->fetched, __ATOMIC_RELAXED);
+		expires = __atomic_load_n(&(*dobj)->expires, __ATOMIC_RELAXED);
+	}
+	else{
+		return FALSE;
+	}
+	if (NULL == host){
+		return freshCheck(expires);
+	}
+	return refreshCheck(uri, host, filePath, numPort, head, headLen, fetched, expires);
+}
 
-	pthread_mutex_lock(&openLock);
-	int serverfd = open_clientfd(host, numPort);
-	pthread_mutex_unlock(&openLock);
+/* Sends a copy found by hitLookup. Returns TRUE if the connection can carry another request. */
+int hitSend(int connfd, cacheObj *obj, diskObj *dobj, int keepAlive){
+	if (NULL != obj){
+		metricCount(METRIC_CACHE_BYTES, obj->size);
+		dbg_printf("Cache hit. Reading from cache.\n");
+		return 0 == sendObject(connfd, obj, keepAlive) && keepAlive;
+	}
+	metricCount(METRIC_CACHE_BYTES, dobj->hdrLen + dobj->bodyLen);
+	dbg_printf("Disk hit. Sending from disk.\n");
+	return 0 == diskSend(connfd, dobj, keepAlive) && keepAlive;
+}
+
+/* Unpins whatever hitLookup found. */
+void hitRelease(cacheObj *obj, diskObj *dobj){
+	if (NULL != obj){
+		cacheRelease(obj);
+	}
+	if (NULL != dobj){
+		diskRelease(dobj);
+	}
+}
+
+/* Answers a cache miss, or revalidates a stale copy, sharing one origin fetch among concurrent requests for the same uri. Returns TRUE if the connection can carry another request. */
+int missRequest(int connfd, char *uri, char *host, char *filePath, int numPort, httpHead *req, int chunkedOk, int keepAlive, cacheObj *stale, diskObj *diskStale){
+	struct iovec headers[PARSEMAXHEADERS];
+	cacheObj *obj;
+	diskObj *dobj;
+	flight *f;
+	char *staleHead = NULL;
+	size_t staleLen = 0;
+	long refreshed = 0;
+	int leader, alive, numHeaders;
 
-    /* Ignores the request if there is an error. */
-	if (0 > serverfd){
-		if (-1 != serverfd){
-			fprintf(stderr, "DNS error\n");
+	if (NULL != stale || NULL != diskStale){
+		staleHead = NULL != stale ? stale->data : diskStale->head;
+		staleLen = NULL != stale ? stale->hdrLen : diskStale->hdrLen;
+	}
+	numHeaders = forwardIov(req, NULL != staleHead, headers);
+
+	if (NULL != (f = flightJoin(uri, &leader)) && !leader){
+		alive = flightFollow(f, connfd, keepAlive);
+		flightRelease(f);
+		if (0 <= alive){
+			return alive;
+		}
+		/* The leader's response was too big to share, or it found the stale copy still good and renewed it. */
+		if (hitLookup(uri, NULL, NULL, 0, &obj, &dobj)){
+			alive = hitSend(connfd, obj, dobj, keepAlive);
+			hitRelease(obj, dobj);
+			return alive;
+		}
+		hitRelease(obj, dobj);
+		f = NULL;
+	}
+	/* The previous leader may have cached it between our lookup and taking its place. */
+	else if (NULL != f){
+		if (hitLookup(uri, NULL, NULL, 0, &obj, &dobj)){
+			flightBypass(f);
+			flightEnd(f);
+			alive = hitSend(connfd, obj, dobj, keepAlive);
+			hitRelease(obj, dobj);
+			return alive;
+		}
+		hitRelease(obj, dobj);
+	}
+
+	alive = genRequest(connfd, uri, host, filePath, numPort, headers, numHeaders, chunkedOk, keepAlive, f, staleHead, staleLen, &refreshed);
+	/* Not modified: renew the stale copy, and only then wake followers to look for it, then send it. */
+	if (0 < refreshed){
+		if (NULL != stale){
+			__atomic_store_n(&stale->fetched, time(NULL), __ATOMIC_RELAXED);
+			__atomic_store_n(&stale->expires, refreshed, __ATOMIC_RELAXED);
 		}
 		else{
-			fprintf(stderr, "Unix error\n");
+			__atomic_store_n(&diskStale->fetched, time(NULL), __ATOMIC_RELAXED);
+			__atomic_store_n(&diskStale->expires, refreshed, __ATOMIC_RELAXED);
 		}
-		return;
+		if (NULL != f){
+			flightBypass(f);
+		}
+	}
+	if (NULL != f){
+		flightEnd(f);
+	}
+	if (0 < refreshed){
+		deadlineArm(deadlineMine, DEADLINE_IDLE, connfd, -1);
+		alive = hitSend(connfd, stale, diskStale, alive);
 	}
-    /* Read and parse HTTP request headers. */
-	sprintf(req, "GET /%s HTTP/1.0\r\n", filePath);
-	rio_writen(serverfd, req, strlen(req));
-	sprintf(req, "Host: %s\r\n", host);
-	rio_writen(serverfd, req, strlen(req));
+	return alive;
+}
+
+/* Request a webpage from the server over a pooled HTTP/1.1 connection, conditionally if staleHead is the head of a stale copy. Returns TRUE if the client connection can carry another request. If the origin says the stale copy is still good, nothing is sent to the client and *refreshed is its new expiry. */
+int genRequest(int connfd, char *uri, char *host, char *filePath, int numPort, struct iovec *headers, int numHeaders, int chunkedOk, int keepAlive, flight *f, char *staleHead, size_t staleLen, long *refreshed){
+	char *scratch;
+	int alive;
+
+	/* The lines it builds and reads only live as long as the fetch, so they come from the pool rather than the thread's stack. */
+	if (NULL == (scratch = bufGet())){
+		fprintf(stderr, "Error allocating memory for request.\n");
+		return FALSE;
+	}
+	alive = fetchOrigin(connfd, uri, host, filePath, numPort, headers, numHeaders, chunkedOk, keepAlive, f, staleHead, staleLen, refreshed, scratch);
+	bufPut(scratch);
+	return alive;
+}
+
+/* Does genRequest's work with scratch, a BUFPOOLSIZE buffer, holding its request, status and framing lines. */
+int fetchOrigin(int connfd, char *uri, char *host, char *filePath, int numPort, struct iovec *headers, int numHeaders, int chunkedOk, int keepAlive, flight *f, char *staleHead, size_t staleLen, long *refreshed, char *scratch){
+	/* Host and path are cut from a uri shorter than MAXLINE, so the first line and Host fit in two. */
+	char *start = scratch;
+	char *pageBuf = scratch + 2 * MAXLINE;
+	char *forward = scratch + 3 * MAXLINE;
+	char *cacheBuf;
+	char *head = NULL, *raw = NULL, *kept;
+	size_t headLen = 0, headCap = 0, rawLen = 0, rawCap = 0, baseLen, keptLen;
+	struct iovec req[PARSEMAXHEADERS + 3], sent[PARSEMAXHEADERS + 3];
+	int reqCnt = 0;
+	httpHead h;
+	httpHeader *hdr;
+
+	size_t size = 0;
+	ssize_t bufSize;
+	long long contentLength = -1, moved;
+	long expires;
+	int status, storable, i;
+	long stamp;
+	int chunked = FALSE, noBody, upKeepAlive, framed, complete, chunkOut = FALSE, clientOk = TRUE, shared = FALSE, attempt;
+	bodyReader body;
+	diskWriter *disk = NULL;
+	upstream *up;
+
+	/* The request is the client's header lines where they lie, between a few generated ones, so it goes out in one writev. */
+	req[reqCnt].iov_base = start;
+	req[reqCnt++].iov_len = snprintf(start, 2 * MAXLINE, "GET /%s HTTP/1.1\r\nHost: %s\r\n", filePath, host);
+	memcpy(req + reqCnt, headers, numHeaders * sizeof(struct iovec));
+	reqCnt += numHeaders;
+	if (NULL != staleHead && 0 < (req[reqCnt].iov_len = freshValidators(staleHead, staleLen, forward, MAXLINE))){
+		req[reqCnt++].iov_base = forward;
+	}
+	req[reqCnt].iov_base = "Connection: keep-alive\r\n\r\n";
+	req[reqCnt++].iov_len = 26;
 
-	while (0 < (bufSize = rio_readlineb(browserio, forward, MAXLINE))){
-		if (0 == strcmp("\r\n", forward)){
+	/* Send it and read the status line, retrying once the origin has closed a reused connection. */
+	for (attempt = 0; ; attempt++){
+		stamp = metricNow();
+		if (NULL == (up = upstreamGet(host, numPort))){
+			return FALSE;
+		}
+		stamp = metricObserve(METRIC_CONNECT, stamp);
+		/* relayWritev uses up the iovecs it is given, so each attempt sends a fresh copy. */
+		memcpy(sent, req, reqCnt * sizeof(struct iovec));
+		deadlineArm(deadlineMine, DEADLINE_FIRST_BYTE, up->fd, connfd);
+		if (0 == relayWritev(up->fd, sent, reqCnt) && 0 < (bufSize = rio_readlineb(&up->rio, pageBuf, MAXLINE))){
+			stamp = metricObserve(METRIC_TTFB, stamp);
 			break;
-        }
+		}
+		if (deadlineFired(deadlineMine) || !upstreamRetry(up, attempt)){
+			fprintf(stderr, "Error reading from server.\n");
+			upstreamClose(up);
+			return FALSE;
+		}
+		upstreamClose(up);
+	}
+
+	/* Read the rest of the head after the status line and parse it in place. The rest only has to keep coming, from the origin and into the client. */
+	deadlineArm(deadlineMine, DEADLINE_IDLE, up->fd, connfd);
+	parseBegin(&h, TRUE);
+	if (0 > appendBuf(&raw, &rawLen, &rawCap, pageBuf, bufSize) || 1 != readHead(&up->rio, &h, &raw, &rawLen, &rawCap, NULL)){
+		fprintf(stderr, "Error reading response headers.\n");
+		upstreamClose(up);
+		free(raw);
+		return FALSE;
+	}
+	status = h.status;
+	upKeepAlive = 1 < h.major || (1 == h.major && 1 <= h.minor);
+	appendSpan(&head, &headLen, &headCap, h.start.p, h.start.p + h.start.len);
+
+	/* Keep the response headers, noting the framing and dropping hop-by-hop ones; the framing sent on is our own. */
+	for (i = 0; i < h.numHeaders; i++){
+		hdr = &h.headers[i];
+		if (spanIs(hdr->name, "Content-Length")){
+			contentLength = strtoll(hdr->value.p, NULL, 10);
+			continue;
+		}
+		else if (spanIs(hdr->name, "Transfer-Encoding")){
+			chunked = spanHas(hdr->value, "chunked");
+			continue;
+		}
+		else if (spanIs(hdr->name, "Connection")){
+			if (spanHas(hdr->value, "close")){
+				upKeepAlive = FALSE;
+			}
+			else if (spanHas(hdr->value, "keep-alive")){
+				upKeepAlive = TRUE;
+			}
+			continue;
+		}
+		else if (spanIs(hdr->name, "Keep-Alive") || spanIs(hdr->name, "Proxy-Connection")){
+			continue;
+		}
+		appendSpan(&head, &headLen, &headCap, hdr->name.p, hdr->value.p + hdr->value.len);
+	}
+	free(raw);
+	if (NULL == head){
+		fprintf(stderr, "Error allocating memory for response.\n");
+		upstreamClose(up);
+		return FALSE;
+	}
+
+	/* Not modified: there is no body, and the caller renews and sends the stale copy instead, waking followers once it has. */
+	if (304 == status && NULL != staleHead){
+		*refreshed = freshRefresh(head, headLen, staleHead, staleLen);
+		if (upKeepAlive){
+			upstreamPut(up);
+		}
+		else{
+			upstreamClose(up);
+		}
+		free(head);
+		return keepAlive;
+	}
+	expires = freshUntil(head, headLen, &storable);
+
+	noBody = (100 <= status && 200 > status) || 204 == status || 304 == status;
+	if (noBody){
+		contentLength = 0;
+	}
+	else if (chunked){
+		contentLength = -1;
+	}
+	framed = noBody || chunked || 0 <= contentLength;
+	bodyInit(&body, &up->rio, chunked, contentLength);
 
-		*header = *content = 0;
-		sscanf(forward, "%[A-Za-z0-9-]: %s", header, content);
+	/* Heap rather than stack, since followers may still be reading it after we return. */
+	if (NULL == (cacheBuf = malloc(cacheMaxObject))){
+		fprintf(stderr, "Error allocating memory for response.\n");
+		upstreamClose(up);
+		free(head);
+		return FALSE;
+	}
 
+	/* Without a length from the origin, hold up to the largest cacheable object's worth of the body so the client still gets one. */
+	if (!noBody && 0 > contentLength){
+		while (cacheMaxObject > size && 0 < (bufSize = bodyRead(&body, cacheBuf + size, cacheMaxObject - size))){
+			size += bufSize;
+		}
+		if (cacheMaxObject == size){
+			bufSize = bodyRead(&body, pageBuf, MAXLINE);
+		}
+		/* Past its deadline the origin's sockets read as ended, which is not the end of the body. */
+		if (0 > bufSize || deadlineFired(deadlineMine)){
+			fprintf(stderr, "Error reading response body.\n");
+			upstreamClose(up);
+			free(cacheBuf);
+			free(head);
+			return FALSE;
+		}
+		if (0 == bufSize){
+			contentLength = size;
+		}
+	}
 
-		if (0 == strcasecmp("Connection", header) || 0 == strcasecmp("Proxy-Connection", header)){
-			sprintf(forward, "%s: %s\r\n", header, "close");
+	/* Concurrent misses share this fetch if it may be stored and its body will fit; they get the head now and the body as it fills. A private or no-store answer was meant for this client alone. */
+	baseLen = headLen;
+	if (NULL != f){
+		if (!storable || (!noBody && (0 > contentLength || cacheMaxObject < contentLength))){
+			flightBypass(f);
 		}
-		/* Parse the headers for host and keep alive. */
-		if (0 != strcasecmp("Host", header) && 0 != strcasecmp("Keep-Alive", header)){
-			rio_writen(serverfd, forward, strlen(forward));
+		else if (0 == flightHead(f, head, baseLen, cacheBuf, noBody ? -1 : contentLength)){
+			shared = TRUE;
+			flightFill(f, size);
 		}
 	}
-	
-	sprintf(req, "Connection: close\r\n");
-	rio_writen(serverfd, req, strlen(req));
-	
-	/* Append carriage return. */
-	sprintf(req, "\r\n");
-	rio_writen(serverfd, req, strlen(req));
-	rio_readinitb(&read_response, serverfd);
 
-	/* Display web page. */
-	while(0 < (bufSize = rio_readlineb(&read_response, pageBuf, MAXLINE))){
-		rio_writen(connfd, pageBuf, bufSize);
-		if(MAXOBJ >= (size + bufSize)){
-			memcpy (cacheBuf + size, pageBuf, bufSize);
+	/* Frame the response for the client: by length where known, else chunked for HTTP/1.1 or by closing. */
+	if (noBody){
+		forward[0] = 0;
+	}
+	else if (0 <= contentLength){
+		sprintf(forward, "Content-Length: %lld\r\n", contentLength);
+	}
+	else if (chunkedOk && keepAlive){
+		sprintf(forward, "Transfer-Encoding: chunked\r\n");
+		chunkOut = TRUE;
+	}
+	else{
+		forward[0] = 0;
+		keepAlive = FALSE;
+	}
+	appendBuf(&head, &headLen, &headCap, forward, strlen(forward));
+	sprintf(forward, "Connection: %s\r\n\r\n", keepAlive ? "keep-alive" : "close");
+	if (0 > appendBuf(&head, &headLen, &headCap, forward, strlen(forward))){
+		fprintf(stderr, "Error allocating memory for response.\n");
+		upstreamClose(up);
+		if (!shared){
+			free(cacheBuf);
 		}
+		free(head);
+		return FALSE;
+	}
+	clientOk = (ssize_t)headLen == rio_writen(connfd, head, headLen);
+
+	/* Display web page, starting with whatever was held back. */
+	if (0 < size){
+		clientOk = 0 <= relayOut(connfd, cacheBuf, size, chunkOut) && clientOk;
+		if (cacheMaxObject == size && 0 < bufSize){
+			clientOk = 0 <= relayOut(connfd, pageBuf, bufSize, chunkOut) && clientOk;
+			size += bufSize;
+		}
+	}
+
+	/* A body that may fit is read straight into cacheBuf and written from there, so the cache copy costs nothing. */
+	bufSize = 0;
+	while (!body.done && cacheMaxObject > size && cacheMaxObject >= contentLength && 0 < (bufSize = bodyRead(&body, cacheBuf + size, cacheMaxObject - size))){
 		size += bufSize;
-	} 
+		if (shared){
+			flightFill(f, size);
+		}
+		clientOk = 0 <= relayOut(connfd, cacheBuf + size - bufSize, bufSize, chunkOut) && clientOk;
+	}
 
-    /* Lock cache before writing to it, and unlock once the writing has been completed. */
-	lockCacheW();
-	if (MAXOBJ >= size){
-		/* Evict the least recently used cache line so that we can insert the new data. */
-		while (MAXCACHE < (overallCacheSize + size) || NUMLINES <= occupiedCacheLines){
-			cacheIndex = leastRecentlyUsed();
-			cacheLineFree(cacheIndex);
+	/* The rest is too big for memory. The disk tier, if it will take it, is written as the client is. */
+	if (!body.done && 0 <= bufSize && storable && (0 > contentLength || cacheMaxObject < contentLength) && NULL != (disk = diskBegin(contentLength))){
+		diskWrite(disk, cacheBuf, cacheMaxObject < size ? cacheMaxObject : size);
+		if (cacheMaxObject < size){
+			diskWrite(disk, pageBuf, size - cacheMaxObject);
+		}
+		/* Nothing is cached in memory past this point, so cacheBuf is free to relay through. */
+		while (0 < (bufSize = bodyRead(&body, cacheBuf, cacheMaxObject))){
+			clientOk = 0 <= relayOut(connfd, cacheBuf, bufSize, chunkOut) && clientOk;
+			diskWrite(disk, cacheBuf, bufSize);
+			size += bufSize;
+		}
+	}
+	/* Otherwise, unless it needs chunk framing, it moves origin to client without a copy. */
+	else if (!body.done && 0 <= bufSize){
+		moved = chunkOut ? bodyCopy(&body, connfd, TRUE) : bodySplice(&body, connfd);
+		if (0 < moved){
+			size += moved;
 		}
+	}
+	complete = body.done && !deadlineFired(deadlineMine);
+	metricObserve(METRIC_RELAY, stamp);
+	metricCount(METRIC_ORIGIN_BYTES, baseLen + size);
+	if (complete && chunkOut){
+		clientOk = 5 == rio_writen(connfd, "0\r\n\r\n", 5) && clientOk;
+	}
+
+	if (complete && framed && upKeepAlive){
+		upstreamPut(up);
+	}
+	else{
+		upstreamClose(up);
+	}
 
-		cacheIndex = cacheVacancy();
-		if (0 <= cacheIndex){
-			cacheAlloc(cacheIndex, cacheBuf, uri, size);
+	if (complete && storable && cacheMaxObject >= size){
+		cacheResponse(uri, head, baseLen, cacheBuf, size, expires);
+	}
+	if (NULL != disk){
+		if (complete && NULL != (kept = responseHead(head, baseLen, size, &keptLen))){
+			diskCommit(disk, uri, kept, keptLen, expires);
+			free(kept);
 		}
+		else{
+			diskAbort(disk);
+		}
+	}
+	if (!shared){
+		free(cacheBuf);
 	}
-	unlockCache();
-	close(serverfd);
+	free(head);
+	return complete && clientOk && keepAlive;
 }
 
+/* Rewrites a response head for a complete, unencoded body of bodyLen bytes: framing and hop-by-hop headers give way to a Content-Length. Returns it malloc'd, without its blank line, or NULL. */
+char *responseHead(char *head, size_t headLen, long long bodyLen, size_t *keptLen){
+	char length[64];
+	char *kept = NULL;
+	size_t keptCap = 0;
+	int status, i;
+	httpHead h;
+	span name;
 
-/* If there are no vacant lines, returns -1. Otherwise, returns the index of the vacant line. */
-int cacheVacancy(){
-	int i;
-	for(i = 0; i < NUMLINES; i++){
-		if(0 == cache[i].LRUstamp){
-			return i;
+	*keptLen = 0;
+	parseBegin(&h, TRUE);
+	if (0 > parseHead(&h, head, headLen) || !h.started){
+		return NULL;
+	}
+	status = h.status;
+
+	/* The status line stays; header lines are kept unless they frame or manage the connection. */
+	appendSpan(&kept, keptLen, &keptCap, h.start.p, h.start.p + h.start.len);
+	for (i = 0; i < h.numHeaders; i++){
+		name = h.headers[i].name;
+		if (filterHeader(name) && !spanIs(name, "Content-Length") && !spanIs(name, "Transfer-Encoding")){
+			appendSpan(&kept, keptLen, &keptCap, name.p, h.headers[i].value.p + h.headers[i].value.len);
 		}
 	}
-	return -1;
-}
 
-/* Checks the cache for the url. */
-int cacheCheck(char* url){
-    int i;
-	for(i = 0; i < NUMLINES; i++){
-		if(0 < cache[i].LRUstamp && 0 == strcmp(url, cache[i].url)){
-			return i;
+	if (!((100 <= status && 200 > status) || 204 == status || 304 == status)){
+		sprintf(length, "Content-Length: %lld\r\n", bodyLen);
+		if (0 > appendBuf(&kept, keptLen, &keptCap, length, strlen(length))){
+			free(kept);
+			return NULL;
 		}
 	}
-	return -1;
+	return kept;
 }
 
-/* Find the LRU cached object. */
-int leastRecentlyUsed(){
-	int i;
-	int leastRecent = -1;
-	for(i= 0; i < NUMLINES; i++){
-		if(0 < cache[i].LRUstamp && (0 > leastRecent ||  cache[leastRecent].LRUstamp > cache[i].LRUstamp)){
-			leastRecent = i;
-        }
+/* Builds an object from a response head and its complete, unencoded body, in the cache's own memory if cached (see cacheReserve) and on the heap if not; see responseHead. */
+cacheObj *responseObj(char *uri, char *head, size_t headLen, char *body, size_t bodyLen, int cached){
+	char *kept;
+	size_t keptLen;
+	cacheObj *obj = NULL;
+
+	if (NULL != (kept = responseHead(head, headLen, bodyLen, &keptLen))
+		&& NULL != (obj = cached ? cacheReserve(uri, keptLen + 2 + bodyLen) : cacheObjNew(uri, NULL, keptLen + 2 + bodyLen))){
+		memcpy(obj->data, kept, keptLen);
+		memcpy(obj->data + keptLen, "\r\n", 2);
+		memcpy(obj->data + keptLen + 2, body, bodyLen);
+		obj->hdrLen = keptLen;
 	}
-	return leastRecent;
+	free(kept);
+	return obj;
 }
 
-/* Lock cache for writing. */
-void lockCacheW(){
-    if(pthread_rwlock_wrlock(&cacheLock)){
-        fprintf(stderr, "Error during cache write lock.\n");
-        exit(-1);
-    }
+/* Caches a complete response under uri until expires; see responseObj. */
+void cacheResponse(char *uri, char *head, size_t headLen, char *body, size_t bodyLen, long expires){
+	cacheObj *obj;
+
+	if (NULL != (obj = responseObj(uri, head, headLen, body, bodyLen, TRUE))){
+		obj->fetched = time(NULL);
+		obj->expires = expires;
+		cacheCommit(obj);
+	}
 }
 
-/* Lock cache for reading. */
-void lockCacheR(){
-    if(pthread_rwlock_rdlock(&cacheLock)){
-        fprintf(stderr, "Error during cache read lock.\n");
-        exit(-1);
-    }
+/* Points iov[0..2] at obj's response with the Connection header for the client, and X-Cache for a cached copy, in between. Returns the total length. */
+size_t objectIov(cacheObj *obj, int keepAlive, struct iovec *iov){
+	iov[0].iov_base = obj->data;
+	iov[0].iov_len = obj->hdrLen;
+	/* Copies from the cache say so; the proxy's own pages live on the heap. */
+	if (0 > obj->line){
+		iov[1].iov_base = keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+	}
+	else{
+		iov[1].iov_base = keepAlive ? "X-Cache: HIT\r\nConnection: keep-alive\r\n" : "X-Cache: HIT\r\nConnection: close\r\n";
+	}
+	iov[1].iov_len = strlen(iov[1].iov_base);
+	iov[2].iov_base = obj->data + obj->hdrLen;
+	iov[2].iov_len = obj->size - obj->hdrLen;
+	return obj->size + iov[1].iov_len;
 }
 
-/* Unlocks the cache if it has been locked for reading or writing. */
-void unlockCache(){
-    if(pthread_rwlock_unlock(&cacheLock)){
-        fprintf(stderr, "Error during cache unlock.\n");
-        exit(-1);
-    }
+/* Sends a cached response to a blocking client socket. Returns -1 if the client has gone. */
+int sendObject(int connfd, cacheObj *obj, int keepAlive){
+	struct iovec iov[3];
+
+	objectIov(obj, keepAlive, iov);
+	return relayWritev(connfd, iov, 3);
 }
 
-/* Frees all memory associated with the specified cache line and updates the properties of the cache. */
-void cacheLineFree(int index){
-	free(cache[index].data);
-	cache[index].data = NULL;
+/* Appends n bytes to the growable buffer *buf. Returns -1 if it cannot grow. */
+int appendBuf(char **buf, size_t *len, size_t *cap, char *data, size_t n){
+	char *p;
+	size_t newCap = *cap ? *cap : MAXLINE;
 
-	occupiedCacheLines--;
-	overallCacheSize -= cache[index].size;
-	cache[index].LRUstamp = 0;
+	while (newCap < *len + n){
+		newCap *= 2;
+	}
+	if (newCap != *cap){
+		if (NULL == (p = realloc(*buf, newCap))){
+			return -1;
+		}
+		*buf = p;
+		*cap = newCap;
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+	return 0;
 }
 
-/* Initializes the cache. */
-void initCache(){
-    int i;
-	for(i = 0; i < NUMLINES; i++){
-    	cache[i].LRUstamp = 0;
-		pthread_mutex_init(&cache[i].mutex, NULL);
+/* Appends the line from start to end, and a CRLF, to the growable buffer *buf. Returns -1 if it cannot grow. */
+int appendSpan(char **buf, size_t *len, size_t *cap, char *start, char *end){
+	if (0 > appendBuf(buf, len, cap, start, end - start)){
+		return -1;
 	}
+	return appendBuf(buf, len, cap, "\r\n", 2);
 }
 
- /* Processes requests that use GET. */
-void procRequest(int connfd){
-	int numPort = 0;
-	int cacheIndex;
-	size_t n;
-	char scheme[MAXLINE];
-	char req[MAXLINE];
-	char uri[MAXLINE];
-	char method[MAXLINE];
-	char host[MAXLINE];
-	char filePath[MAXLINE];
-	char version[MAXLINE];
+/* Reads a head into the growable *buf a line at a time, so nothing after it is consumed, parsing each line as it comes. Sets *first, if given, to when its first line arrived. Returns 1 once it is complete, 0 if the connection ends first and -1 if it is malformed or over MAXHEAD. */
+int readHead(rio_t *rp, httpHead *h, char **buf, size_t *len, size_t *cap, long *first){
+	ssize_t n;
+	char *p;
+	int done;
 
-	rio_t browserio;
-	rio_readinitb(&browserio, connfd);
-	n = rio_readlineb(&browserio, req, MAXLINE);
+	while(1){
+		if (MAXLINE > *cap - *len){
+			if (MAXHEAD <= *cap || NULL == (p = realloc(*buf, *cap ? 2 * *cap : MAXLINE))){
+				return -1;
+			}
+			*buf = p;
+			*cap = *cap ? 2 * *cap : MAXLINE;
+		}
+		if (0 >= (n = rio_readlineb(rp, *buf + *len, *cap - *len))){
+			return 0;
+		}
+		if (NULL != first && 0 == *len){
+			*first = metricNow();
+		}
+		*len += n;
+		if (0 != (done = parseHead(h, *buf, *len))){
+			return done;
+		}
+	}
+}
 
-	filePath[0] = '\0';
-	host[0] = '\0';
+/* Points iov at the header lines of req, in place, that go on to the origin: all but hop-by-hop ones and, when revalidating, the client's own validators, which ours replace since it gets the whole response either way. Adjacent lines share an iovec. Returns how many were used. */
+int forwardIov(httpHead *req, int revalidating, struct iovec *iov){
+	char *line, *next, *end = req->base + req->len;
+	httpHeader *hdr;
+	int i, n = 0;
 
-	if (0 < n && 0 != strcmp("\r\n", req)){
-		/* Parse the method, uri, and version into their own separate variables. */
-		if (3 != sscanf(req, "%s %s %s", method, uri, version)){
-			fprintf(stderr, "Error parsing GET instruction.\n");
-			return;
+	for (i = 0; i < req->numHeaders; i++){
+		hdr = &req->headers[i];
+		if (!filterHeader(hdr->name) || (revalidating && (spanIs(hdr->name, "If-None-Match") || spanIs(hdr->name, "If-Modified-Since")))){
+			continue;
 		}
-		
-		/* Subsequently, parse uri into host, path, and port number. */
-		if (0 == strcasecmp("GET", method)){
-			if (1 >= sscanf(uri, "%[A-Za-z0-9+.-]://%[^/]%s", scheme, host, filePath)){
-				return;
-			}
+		line = hdr->name.p;
+		next = scanFor(hdr->value.p + hdr->value.len, end, '\n', '\n') + 1;
+		if (0 < n && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == line){
+			iov[n - 1].iov_len += next - line;
+		}
+		else{
+			iov[n].iov_base = line;
+			iov[n++].iov_len = next - line;
+		}
+	}
+	return n;
+}
 
-			if (strcasecmp("http", scheme)){
-				fprintf(stderr, "Error using specified transfer protocol.\n");
-				return;
-			}
+/* TRUE if the header called name should be sent on to the next hop; hop-by-hop headers are not. */
+int filterHeader(span name){
+	/* Host is regenerated and connection management belongs to each hop. */
+	return !spanIs(name, "Host") && !spanIs(name, "Keep-Alive")
+		&& !spanIs(name, "Connection") && !spanIs(name, "Proxy-Connection");
+}
 
-			/* Delete the / from the file path. */
-			if ('/' == filePath[0]){
-				memmove(filePath, 1 + filePath, strlen(filePath));
-			}
+/* Processes requests that use GET, one after another for as long as the client keeps the connection. Between requests it holds no buffer, and its thread no metrics slot. With park, it stops instead of waiting for a request that has not arrived. Returns TRUE if it stopped so, with the connection still open. */
+int procRequest(int connfd, int park){
+	rio_t *browserio = NULL;
+	int more;
 
-			char *p = strchr(host, ':');
-			if (NULL == p){
-				numPort = PORT;
+	do{
+		/* A client gets so long for a whole head, however it trickles in, counting from when the last response was done. */
+		deadlineArm(deadlineMine, DEADLINE_HEADER, connfd, -1);
+		if (NULL == browserio){
+			if (park && !readableNow(connfd)){
+				return TRUE;
 			}
-			else{
-				sscanf(1 + p, "%d", &numPort);
-				*p = 0;
-            }
-
-			/* Read the cache. Lock while it's in use, and unlock when finished. */
-			lockCacheR();
-			cacheIndex = cacheCheck(uri);
-			unlockCache();
-
-			if(0 <= cacheIndex){
-				rio_writen(connfd, cache[cacheIndex].data, cache[cacheIndex].size);
-				pthread_mutex_lock(&cache[cacheIndex].mutex);
-				cache[cacheIndex].LRUstamp = timeStamp++;
-				pthread_mutex_unlock(&cache[cacheIndex].mutex);
-				dbg_printf("Cache hit. Reading from cache.\n");
-			} 
-            else{
-				if (0 != numPort && NULL != filePath && NULL != host){
-					genRequest(connfd, &browserio, uri, host, filePath, numPort);
-					dbg_printf("Cache miss. Reading from server.\n");
-				} 
-				else{
-					fprintf(stderr, "Error during url parsing.\n");
-				}	
+			if (!waitReadable(connfd)){
+				return FALSE;
 			}
+			if (NULL == (browserio = (rio_t *)bufGet())){
+				fprintf(stderr, "Error allocating memory for request.\n");
+				return FALSE;
+			}
+			rio_readinitb(browserio, connfd);
+		}
+		more = handleRequest(connfd, browserio);
+		/* Pipelined requests are already buffered in browserio and are answered in order; otherwise it goes back until the next one arrives. */
+		if (0 >= browserio->rio_cnt){
+			bufPut((char *)browserio);
+			browserio = NULL;
 		}
 		dbg_printf("Request successfully processed.\n");
+	} while (more);
+	bufPut((char *)browserio);
+	return FALSE;
+}
+
+/* TRUE if fd has something to read, or has ended, already. */
+int readableNow(int fd){
+	struct pollfd p;
+
+	p.fd = fd;
+	p.events = POLLIN;
+	return 0 != poll(&p, 1, 0);
+}
+
+/* Waits until fd has something to read, or has ended. A thread that has to wait parks its metrics slot first. Returns FALSE on error. */
+int waitReadable(int fd){
+	struct pollfd p;
+
+	if (readableNow(fd)){
+		return TRUE;
+	}
+	p.fd = fd;
+	p.events = POLLIN;
+	metricPark();
+	while (0 > poll(&p, 1, -1)){
+		if (EINTR != errno){
+			return FALSE;
+		}
 	}
+	return TRUE;
+}
+
+/* Reads and answers one request. Returns TRUE if the connection can carry another. */
+int handleRequest(int connfd, rio_t *browserio){
+	int numPort = 0, keepAlive, done, hit, reason, i;
+	long parsed;
+	cacheObj *obj = NULL;
+	diskObj *dobj = NULL;
+	char *uri, *host, *filePath;
+	char *raw = NULL;
+	size_t rawLen = 0, rawCap = 0;
+	httpHead h;
+	httpHeader *hdr;
+
+	/* The uri and what it is split into come from the pool, like the rio_t they are read through. */
+	if (NULL == (uri = bufGet())){
+		fprintf(stderr, "Error allocating memory for request.\n");
+		return FALSE;
+	}
+	host = uri + MAXLINE;
+	filePath = uri + 2 * MAXLINE;
+
+	/* Read and parse the whole head; the method, uri and headers are then spans of raw. */
+	parseBegin(&h, FALSE);
+	if (1 != (done = readHead(browserio, &h, &raw, &rawLen, &rawCap, &parsed)) || 0 > spanCopy(h.uri, uri, MAXLINE)){
+		if (0 != done && !deadlineFired(deadlineMine)){
+			fprintf(stderr, "Error parsing GET instruction.\n");
+		}
+		free(raw);
+		bufPut(uri);
+		return FALSE;
+	}
+	/* From here on the response just has to keep moving. */
+	deadlineArm(deadlineMine, DEADLINE_IDLE, connfd, -1);
+	parsed = metricObserve(METRIC_PARSE, parsed);
+	metricCount(METRIC_REQUESTS, 1);
+	keepAlive = 1 < h.major || (1 == h.major && 1 <= h.minor);
+
+	/* Note whether the client wants the connection kept; the headers to forward stay where they are in raw. */
+	for (i = 0; i < h.numHeaders; i++){
+		hdr = &h.headers[i];
+		if (spanIs(hdr->name, "Connection") || spanIs(hdr->name, "Proxy-Connection")){
+			if (spanHas(hdr->value, "close")){
+				keepAlive = FALSE;
+			}
+			else if (spanHas(hdr->value, "keep-alive")){
+				keepAlive = TRUE;
+			}
+		}
+	}
+
+	/* A client past its rate is told so, and its connection closed. */
+	if (ADMIT_OK != (reason = admitRequest(connfd))){
+		admitRefuse(connfd, reason);
+		keepAlive = FALSE;
+	}
+	/* Requests for the proxy itself rather than an origin. */
+	else if (spanIs(h.method, "GET") && (0 == strcmp(STATUSPATH, uri) || 0 == strcmp(METRICSPATH, uri))){
+		if (NULL == (obj = 0 == strcmp(STATUSPATH, uri) ? statusObj(uri) : metricsObj(uri))){
+			keepAlive = FALSE;
+		}
+		else{
+			keepAlive = 0 == sendObject(connfd, obj, keepAlive) && keepAlive;
+			cacheRelease(obj);
+			obj = NULL;
+		}
+	}
+	/* Subsequently, parse uri into host, path, and port number. */
+	else if (!spanIs(h.method, "GET") || 0 > parseUri(uri, host, filePath, &numPort)){
+		keepAlive = FALSE;
+	}
+	else if (0 == numPort){
+		fprintf(stderr, "Error during url parsing.\n");
+		keepAlive = FALSE;
+	}
+	/* Read the cache, in memory and then on disk; a stale copy found there is revalidated rather than fetched again. */
+	else{
+		hit = hitLookup(uri, host, filePath, numPort, &obj, &dobj);
+		metricObserve(METRIC_LOOKUP, parsed);
+		if (hit){
+			metricCount(METRIC_HITS, 1);
+			keepAlive = hitSend(connfd, obj, dobj, keepAlive);
+		}
+		else{
+			metricCount(METRIC_MISSES, 1);
+			keepAlive = missRequest(connfd, uri, host, filePath, numPort, &h, 1 < h.major || (1 == h.major && 1 <= h.minor), keepAlive, obj, dobj);
+			dbg_printf("Cache miss. Reading from server.\n");
+		}
+	}
+
+	metricObserve(METRIC_REQUEST, parsed);
+	hitRelease(obj, dobj);
+	free(raw);
+	bufPut(uri);
+	return keepAlive;
+}
+
+/* Splits an absolute http uri into host, file path (without the leading /) and port. Returns -1 if it is not one. */
+int parseUri(char *uri, char *host, char *filePath, int *numPort){
+	char scheme[MAXLINE];
+	char *p;
+
+	filePath[0] = '\0';
+	host[0] = '\0';
+	*numPort = 0;
+
+	if (1 >= sscanf(uri, "%[A-Za-z0-9+.-]://%[^/]%s", scheme, host, filePath)){
+		return -1;
+	}
+
+	if (strcasecmp("http", scheme)){
+		fprintf(stderr, "Error using specified transfer protocol.\n");
+		return -1;
+	}
+
+	/* Delete the / from the file path. */
+	if ('/' == filePath[0]){
+		memmove(filePath, 1 + filePath, strlen(filePath));
+	}
+
+	p = strchr(host, ':');
+	if (NULL == p){
+		*numPort = PORT;
+	}
+	else{
+		sscanf(1 + p, "%d", numPort);
+		*p = 0;
+	}
+	return 0;
+}
+
+/* Builds the status page response (proxy counters as "name value" lines) as an uncached object. */
+cacheObj *statusObj(char *uri){
+	char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+	char body[MAXLINE];
+
+	return responseObj(uri, head, strlen(head), body, statusText(body, sizeof(body)), FALSE);
+}
+
+/* Builds the metrics page response: histograms and totals, then the status page's counters, in Prometheus text format. */
+cacheObj *metricsObj(char *uri){
+	char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
+	char *body;
+	cacheObj *obj;
+	int n;
+
+	if (NULL == (body = malloc(METRICSBUF))){
+		return NULL;
+	}
+	/* Each stops short of the end of what it is given, so the two together fit. */
+	n = metricsExpose(body, METRICSBUF);
+	n += statusText(body + n, METRICSBUF - n);
+	obj = responseObj(uri, head, strlen(head), body, n, FALSE);
+	free(body);
+	return obj;
+}
+
+/* Writes every module's counters as "name value" lines to buf, as many as fit. Returns the length written, always less than len. */
+int statusText(char *body, size_t len){
+	int (*stats[])(char *, size_t) = { cacheStats, upstreamStats, resolverStats, relayStats, flightStats, diskStats,
+		freshStats, refreshStats, admitStats, deadlineStats, bufStats, superviseStats };
+	size_t n = 0;
+	int i, wrote;
+
+	if (0 == len){
+		return 0;
+	}
+	body[0] = 0;
+	/* Each module reports what it wanted to write, which past the end is more than it did. */
+	for (i = 0; i < (int)(sizeof(stats) / sizeof(stats[0])) && n < len - 1; i++){
+		if (0 < (wrote = stats[i](body + n, len - n))){
+			n = n + wrote < len ? n + wrote : len - 1;
+		}
+	}
+	return n;
+}
+
+/* Prints the command line synopsis and exits. */
+void usage(char *name){
+	fprintf(stderr, "usage: %s [-P procs] [-e [-n loops] | -w workers [-q depth]] <port>\n", name);
+	fprintf(stderr, "  -e, --event          serve connections from epoll loops instead of a thread each\n");
+	fprintf(stderr, "  -n, --loops N        number of event loops (default: one per core)\n");
+	fprintf(stderr, "  -w, --workers N      serve connections from N prespawned workers\n");
+	fprintf(stderr, "  -q, --queue-depth N  connections queued per worker before refusing (default: %d)\n", QUEUEDEPTH);
+	fprintf(stderr, "  -P, --procs N        fork N worker processes on SO_REUSEPORT sockets, sharing the cache (max: %d)\n", SUPERVISEMAX);
+	fprintf(stderr, "  --upstream-per-host N  idle origin connections kept per host:port, 0 disables (default: 8)\n");
+	fprintf(stderr, "  --upstream-idle N      idle origin connections kept in total (default: 256)\n");
+	fprintf(stderr, "  --upstream-timeout S   seconds an idle origin connection is kept (default: 30)\n");
+	fprintf(stderr, "  --upstream-retries N   resends after a reused connection turns out stale (default: 1)\n");
+	fprintf(stderr, "  --dns-threads N        resolver threads (default: 2)\n");
+	fprintf(stderr, "  --dns-ttl S            seconds a resolved name is cached (default: 60)\n");
+	fprintf(stderr, "  --dns-negative-ttl S   seconds a failed name is cached (default: 10)\n");
+	fprintf(stderr, "  --hosts FILE           consult an /etc/hosts style file before DNS\n");
+	fprintf(stderr, "  --cache-bytes N[KMG]   in-memory cache budget (default: %d)\n", MAXCACHE);
+	fprintf(stderr, "  --cache-lines N        most objects the in-memory cache holds (default: %d)\n", NUMLINES);
+	fprintf(stderr, "  --max-object N[KMG]    largest object the in-memory cache holds (default: %d)\n", MAXOBJ);
+	fprintf(stderr, "  --cache-policy P       eviction policy: %s (default: clock)\n", POLICYNAMES);
+	fprintf(stderr, "  --cache-admission A    admission filter: none or tinylfu (default: none)\n");
+	fprintf(stderr, "  --cache-ttl S          seconds a response that gives no lifetime stays fresh (default: %d)\n", FRESHTTL);
+	fprintf(stderr, "  --stale-while-revalidate S  seconds past expiry a response that gives none is sent while refreshed (default: %d)\n", FRESHSTALE);
+	fprintf(stderr, "  --refresh-threads N    background refreshes run at once, 0 disables (default: 2)\n");
+	fprintf(stderr, "  --disk-dir DIR         keep objects over --max-object in a disk tier in DIR\n");
+	fprintf(stderr, "  --disk-bytes N[KMG]    disk tier budget (default: 1G)\n");
+	fprintf(stderr, "  --disk-max-object N[KMG]  largest object the disk tier keeps (default: 256M)\n");
+	fprintf(stderr, "  --cache-file FILE      back the in-memory cache with FILE and reattach to it on restart\n");
+	fprintf(stderr, "  --max-conns N          client connections open at once; more get a 503, 0 for no limit (default: %d)\n", ADMITCONNS);
+	fprintf(stderr, "  --client-conns N       connections open at once from one address; more get a 429 (default: no limit)\n");
+	fprintf(stderr, "  --client-rate R        requests a second from one address; more get a 429 (default: no limit)\n");
+	fprintf(stderr, "  --client-burst N       requests one address may send at once within its rate (default: a second's worth)\n");
+	fprintf(stderr, "  --queue-target MS      connections queued for a worker longer than this get a 503, 0 for never (default: %d)\n", ADMITTARGET);
+	fprintf(stderr, "  --header-timeout S     seconds to wait for a whole request head, keep-alive waits included (default: %d)\n", DEADLINEHEADER);
+	fprintf(stderr, "  --connect-timeout S    seconds to wait for an origin name lookup or connect (default: %d)\n", DEADLINECONNECT);
+	fprintf(stderr, "  --first-byte-timeout S seconds to wait for an origin's response after sending it a request (default: %d)\n", DEADLINEFIRSTBYTE);
+	fprintf(stderr, "  --idle-timeout S       seconds a response may go without moving a byte (default: %d)\n", DEADLINEIDLE);
+	fprintf(stderr, "  (a timeout of 0 waits for ever; connections that run out of time are closed)\n");
+	fprintf(stderr, "GET %s on the proxy itself returns its counters.\n", STATUSPATH);
+	exit(EXIT_SUCCESS);
+}
+
+/* Hands idle connfd to the acceptor, which queues it for a worker again when its next request arrives, or closes it if the header timeout runs out first. Returns FALSE if it could not. */
+int parkConn(int connfd){
+	struct epoll_event ev;
+	parkedConn *pc;
+
+	if (NULL == (pc = malloc(sizeof(parkedConn)))){
+		return FALSE;
+	}
+	pc->fd = connfd;
+	deadlineClear(&pc->dl);
+	deadlineArm(&pc->dl, DEADLINE_HEADER, connfd, -1);
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = pc;
+	/* Once added it is the acceptor's, which may be done with it before this returns. */
+	if (0 > epoll_ctl(parkfd, EPOLL_CTL_ADD, connfd, &ev)){
+		deadlineCancel(&pc->dl);
+		free(pc);
+		return FALSE;
+	}
+	return TRUE;
 }
 
 /* Spawn threads. */
@@ -369,29 +1439,47 @@ void *thread(void *vargp){
 	int connfd = *((int *)vargp);
     
 	Pthread_detach(pthread_self());
-    procRequest(connfd);
-    dbg_printf("Closing connection.\n\n");
-    close(connfd);
     free(vargp);
+    serveConn(connfd);
     
 	return NULL;
 }
 
-/* Dynamically allocating memory for a cache line that will hold the given web page. */
-void cacheAlloc(int cacheIndex, char *content, char *url, size_t size){
-	strcpy(cache[cacheIndex].url, url);
-	cache[cacheIndex].data = malloc(size);
-	if(!cache[cacheIndex].data){
-		dbg_printf("Error allocating memory for the data. Malloc unsuccessful.\n");
-		return;
-	}
+/* Serve a single client connection and close it. */
+void serveConn(int connfd){
+	int one = 1;
+
+	/* A miss goes out as a head and then the body; left to Nagle, every response after the first on a keep-alive connection would wait out the client's delayed ACK. */
+	setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	metricCount(METRIC_CONNS_OPENED, 1);
+	serveTurn(connfd, FALSE);
+}
+
+/* A worker's turn on a connection from its queue, which the acceptor has already set up. */
+void servePooled(int connfd){
+	serveTurn(connfd, TRUE);
+}
 
-	memcpy(cache[cacheIndex].data, content, size);
-	
-	cache[cacheIndex].LRUstamp = timeStamp;
-	cache[cacheIndex].size = size;
+/* Serves requests on connfd and closes it; with park, only those it has waiting, parking it rather than closing it if it is still open. */
+void serveTurn(int connfd, int park){
+	int reason, idle = FALSE;
+	deadline dl;
 
-    occupiedCacheLines++;
-	timeStamp++;
-	overallCacheSize += size;
+	deadlineClear(&dl);
+	deadlineMine = &dl;
+	if (ADMIT_OK == (reason = admitStart(connfd))){
+		idle = procRequest(connfd, park);
+	}
+	else{
+		admitRefuse(connfd, reason);
+	}
+	deadlineCancel(&dl);
+	deadlineMine = NULL;
+	if (idle && parkConn(connfd)){
+		return;
+	}
+	admitDone(connfd);
+	metricCount(METRIC_CONNS_CLOSED, 1);
+    dbg_printf("Closing connection.\n\n");
+    close(connfd);
 }
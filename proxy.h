@@ -0,0 +1,42 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "parse.h"
+
+struct flight;
+
+#define PORT 80
+#define TRUE 1
+#define FALSE 0
+
+/* Cache sizing defaults, overridden by --cache-lines, --cache-bytes and --max-object. */
+#define NUMLINES 100
+#define MAXCACHE 1048576
+#define MAXOBJ 102400
+#define QUEUEDEPTH 64
+#define PARKEVENTS 64	/* parked connections and accepts the -w acceptor takes per wait */
+#define MAXHEAD (8 * MAXLINE)	/* largest request or response head read */
+#define THREADSTACK (256 * 1024)	/* stack for a connection's thread */
+#define STATUSPATH "/proxy-status"
+
+#ifdef DEBUG
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+/* Request helpers shared by the threaded and event-driven front ends. */
+int  parseUri(char *uri, char *host, char *filePath, int *numPort);
+int  filterHeader(span name);
+cacheObj *statusObj(char *uri);
+cacheObj *metricsObj(char *uri);
+int  statusText(char *body, size_t len);
+cacheObj *responseObj(char *uri, char *head, size_t headLen, char *body, size_t bodyLen, int cached);
+int  genRequest(int connfd, char *uri, char *host, char *filePath, int numPort, struct iovec *headers, int numHeaders, int chunkedOk, int keepAlive, struct flight *f, char *staleHead, size_t staleLen, long *refreshed);
+void cacheResponse(char *uri, char *head, size_t headLen, char *body, size_t bodyLen, long expires);
+size_t objectIov(cacheObj *obj, int keepAlive, struct iovec *iov);
+
+#endif /* __PROXY_H__ */
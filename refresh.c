@@ -0,0 +1,246 @@
+/*
+ * ----------------------------------------------------------
+ * refresh.c - Background refresh of cached objects, so that
+ *             clients are not the ones kept waiting when a
+ *             popular object expires.
+ *
+ * - a stale copy still inside its stale-while-revalidate
+ *   window is sent at once and a refresh is queued for it
+ * - a fresh copy hit in the last REFRESHAHEAD percent of its
+ *   lifetime is refreshed too; only objects in demand get
+ *   hit that close to expiry, so the hot ones are renewed
+ *   before they ever go stale
+ * - there is at most one refresh per url queued or running,
+ *   and only --refresh-threads of them run at once, which is
+ *   all the load refreshes put on origins; past REFRESHQUEUE
+ *   waiting, new ones are dropped and clients revalidate for
+ *   themselves as before
+ * - a refresh is an ordinary conditional fetch (genRequest)
+ *   whose client is /dev/null: a 304 renews the copy in
+ *   place, anything else is cached as a miss would be
+ * - each refresh runs under its own deadline, as a client's
+ *   fetch does, so a stalled origin costs a refresh rather
+ *   than a refresh thread
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "diskcache.h"
+#include "fresh.h"
+#include "deadline.h"
+#include "refresh.h"
+
+refreshJob *refreshTable[REFRESHBUCKETS];
+refreshJob *refreshHead;	/* next to run */
+refreshJob *refreshTail;
+int refreshWaiting;
+pthread_mutex_t refreshLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refreshReady = PTHREAD_COND_INITIALIZER;
+
+int refreshThreads;
+int devNull = -1;
+
+/* Counters for the status page. */
+long refreshQueued;
+long refreshDropped;
+long refreshStaleServed;
+long refreshDone;
+long refreshFailed;
+
+void *refreshThread(void *vargp);
+int  refreshSchedule(char *uri, char *host, char *filePath, int port);
+void refreshRun(refreshJob *job);
+void refreshFree(refreshJob *job);
+
+/* Starts threads refresh threads; with none, copies are only ever revalidated by the clients asking for them. */
+void refreshInit(int threads){
+	pthread_t tid;
+	int i;
+
+	if (0 >= threads){
+		return;
+	}
+	if (0 > (devNull = open("/dev/null", O_WRONLY | O_CLOEXEC))){
+		fprintf(stderr, "Error opening /dev/null; background refresh disabled.\n");
+		return;
+	}
+	for (i = 0; i < threads; i++){
+		if (0 != pthread_create(&tid, NULL, refreshThread, NULL)){
+			fprintf(stderr, "Error creating refresh thread.\n");
+			exit(1);
+		}
+		pthread_detach(tid);
+	}
+	refreshThreads = threads;
+}
+
+/* TRUE if a copy of uri that expires then, fetched then, may be sent: it is fresh, or stale by less than its window and being refreshed. Queues a refresh if it is stale or soon will be. */
+int refreshCheck(char *uri, char *host, char *filePath, int port, char *head, size_t headLen, long fetched, long expires){
+	if (freshCheck(expires)){
+		if (0 < refreshThreads && time(NULL) >= expires - (expires - fetched) * REFRESHAHEAD / 100){
+			refreshSchedule(uri, host, filePath, port);
+		}
+		return TRUE;
+	}
+	if (0 < refreshThreads && time(NULL) < expires + freshStaleWindow(head, headLen) && refreshSchedule(uri, host, filePath, port)){
+		__atomic_add_fetch(&refreshStaleServed, 1, __ATOMIC_RELAXED);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Queues a refresh of uri unless one is already queued or running. Returns FALSE if there is none and none could be queued. */
+int refreshSchedule(char *uri, char *host, char *filePath, int port){
+	unsigned long hash = cacheHash(uri);
+	refreshJob **bucket = &refreshTable[hash % REFRESHBUCKETS];
+	refreshJob *job;
+
+	pthread_mutex_lock(&refreshLock);
+	for (job = *bucket; NULL != job; job = job->hnext){
+		if (hash == job->hash && 0 == strcmp(uri, job->uri)){
+			pthread_mutex_unlock(&refreshLock);
+			return TRUE;
+		}
+	}
+	if (REFRESHQUEUE <= refreshWaiting){
+		pthread_mutex_unlock(&refreshLock);
+		__atomic_add_fetch(&refreshDropped, 1, __ATOMIC_RELAXED);
+		return FALSE;
+	}
+	if (NULL == (job = calloc(1, sizeof(refreshJob))) || NULL == (job->uri = strdup(uri))
+		|| NULL == (job->host = strdup(host)) || NULL == (job->filePath = strdup(filePath))){
+		pthread_mutex_unlock(&refreshLock);
+		refreshFree(job);
+		return FALSE;
+	}
+	job->port = port;
+	job->hash = hash;
+	job->hnext = *bucket;
+	*bucket = job;
+	if (NULL != refreshTail){
+		refreshTail->next = job;
+	}
+	else{
+		refreshHead = job;
+	}
+	refreshTail = job;
+	refreshWaiting++;
+	pthread_cond_signal(&refreshReady);
+	pthread_mutex_unlock(&refreshLock);
+
+	__atomic_add_fetch(&refreshQueued, 1, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+/* Runs queued refreshes one at a time, forever. A job stays findable until it is done, so its url is not queued twice. */
+void *refreshThread(void *vargp){
+	refreshJob *job, **p;
+
+	while(1){
+		pthread_mutex_lock(&refreshLock);
+		while (NULL == refreshHead){
+			pthread_cond_wait(&refreshReady, &refreshLock);
+		}
+		job = refreshHead;
+		if (NULL == (refreshHead = job->next)){
+			refreshTail = NULL;
+		}
+		refreshWaiting--;
+		pthread_mutex_unlock(&refreshLock);
+
+		refreshRun(job);
+
+		pthread_mutex_lock(&refreshLock);
+		for (p = &refreshTable[job->hash % REFRESHBUCKETS]; *p != job; p = &(*p)->hnext)
+			;
+		*p = job->hnext;
+		pthread_mutex_unlock(&refreshLock);
+		refreshFree(job);
+	}
+	return NULL;
+}
+
+/* Revalidates the cached copy of job's url, or fetches it afresh if the copy has gone. */
+void refreshRun(refreshJob *job){
+	cacheObj *obj;
+	diskObj *dobj = NULL;
+	char *head = NULL;
+	size_t headLen = 0;
+	long fetched = 0, expires = 0, refreshed = 0;
+	deadline dl;
+	int ok;
+
+	if (NULL != (obj = cacheGet(job->uri))){
+		head = obj->data;
+		headLen = obj->hdrLen;
+		fetched = __atomic_load_n(&obj->fetched, __ATOMIC_RELAXED);
+		expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+	}
+	else if (NULL != (dobj = diskGet(job->uri))){
+		head = dobj->head;
+		headLen = dobj->hdrLen;
+		fetched = __atomic_load_n(&dobj->fetched, __ATOMIC_RELAXED);
+		expires = __atomic_load_n(&dobj->expires, __ATOMIC_RELAXED);
+	}
+
+	/* A client may have revalidated it while this waited. */
+	if (NULL != head && time(NULL) < expires - (expires - fetched) * REFRESHAHEAD / 100){
+		ok = TRUE;
+	}
+	else{
+		/* As a keep-alive HTTP/1.1 client, so that the result says whether the whole response arrived. */
+		deadlineClear(&dl);
+		deadlineMine = &dl;
+		ok = genRequest(devNull, job->uri, job->host, job->filePath, job->port, NULL, 0, TRUE, TRUE, NULL, head, headLen, &refreshed);
+		deadlineCancel(&dl);
+		deadlineMine = NULL;
+	}
+	if (0 < refreshed){
+		if (NULL != obj){
+			__atomic_store_n(&obj->fetched, time(NULL), __ATOMIC_RELAXED);
+			__atomic_store_n(&obj->expires, refreshed, __ATOMIC_RELAXED);
+		}
+		else{
+			__atomic_store_n(&dobj->fetched, time(NULL), __ATOMIC_RELAXED);
+			__atomic_store_n(&dobj->expires, refreshed, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(ok ? &refreshDone : &refreshFailed, 1, __ATOMIC_RELAXED);
+
+	if (NULL != obj){
+		cacheRelease(obj);
+	}
+	if (NULL != dobj){
+		diskRelease(dobj);
+	}
+}
+
+/* Frees a job and whatever of it was allocated. */
+void refreshFree(refreshJob *job){
+	if (NULL != job){
+		free(job->uri);
+		free(job->host);
+		free(job->filePath);
+		free(job);
+	}
+}
+
+/* Writes the refresh counters as "name value" lines to buf. Returns the length written. */
+int refreshStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"refresh_queued %ld\n"
+		"refresh_dropped %ld\n"
+		"refresh_stale_served %ld\n"
+		"refresh_done %ld\n"
+		"refresh_failed %ld\n",
+		__atomic_load_n(&refreshQueued, __ATOMIC_RELAXED),
+		__atomic_load_n(&refreshDropped, __ATOMIC_RELAXED),
+		__atomic_load_n(&refreshStaleServed, __ATOMIC_RELAXED),
+		__atomic_load_n(&refreshDone, __ATOMIC_RELAXED),
+		__atomic_load_n(&refreshFailed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,25 @@
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+
+#define REFRESHBUCKETS 256
+#define REFRESHQUEUE 256	/* most refreshes waiting for a thread */
+#define REFRESHAHEAD 10		/* percent of a lifetime, before expiry, in which a hit refreshes it */
+
+/* A background refresh of one url, queued or running. */
+typedef struct refreshJob{
+	char *uri;
+	char *host;
+	char *filePath;
+	int port;
+	unsigned long hash;
+	struct refreshJob *hnext;	/* bucket chain */
+	struct refreshJob *next;	/* queue */
+} refreshJob;
+
+void refreshInit(int threads);
+int  refreshCheck(char *uri, char *host, char *filePath, int port, char *head, size_t headLen, long fetched, long expires);
+int  refreshStats(char *buf, size_t len);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,292 @@
+/*
+ * ----------------------------------------------------------
+ * relay.c - Moves response bodies from origin to client.
+ *
+ * - the head is still read a line at a time through rio;
+ *   the body then moves in RELAYBUF sized reads straight
+ *   from the socket, draining rio's buffer first
+ * - bodies that will not be cached and need no reframing
+ *   are spliced through a pipe, so their bytes never pass
+ *   through user space
+ * - a body sent on chunked costs one writev per chunk
+ * - read, write and splice calls are counted for the status
+ *   page and for relaybench
+ * - every one that moves bytes pushes the calling thread's
+ *   idle deadline back; see deadline.c
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "relay.h"
+#include "deadline.h"
+
+/* Counters for the status page. */
+long relayReads;
+long relayWrites;
+long relaySplices;
+long relaySpliced;
+
+ssize_t rioReadSome(rio_t *rp, char *buf, size_t n);
+
+/* Prepares br to read a body that is chunked, exactly length bytes long, or (length -1) ended by EOF. */
+void bodyInit(bodyReader *br, rio_t *rp, int chunked, long long length){
+	br->rp = rp;
+	br->chunked = chunked;
+	br->remaining = chunked ? 0 : length;
+	br->started = FALSE;
+	br->done = FALSE;
+}
+
+/* Reads up to n bytes of the body, without chunk framing, into buf. Returns the count, 0 once it has ended, -1 if malformed or truncated. */
+ssize_t bodyRead(bodyReader *br, char *buf, size_t n){
+	char line[MAXLINE];
+	char *end;
+	ssize_t got;
+
+	if (br->done){
+		return 0;
+	}
+	if (br->chunked && 0 == br->remaining){
+		/* Each chunk's data is followed by its own CRLF, then the next chunk's size. */
+		if (br->started && 0 >= rio_readlineb(br->rp, line, MAXLINE)){
+			return -1;
+		}
+		br->started = TRUE;
+		if (0 >= rio_readlineb(br->rp, line, MAXLINE)){
+			return -1;
+		}
+		br->remaining = strtoll(line, &end, 16);
+		if (end == line || 0 > br->remaining){
+			return -1;
+		}
+		if (0 == br->remaining){
+			/* Trailers end at a blank line. */
+			do{
+				if (0 >= rio_readlineb(br->rp, line, MAXLINE)){
+					return -1;
+				}
+			} while (0 != strcmp("\r\n", line));
+			br->done = TRUE;
+			return 0;
+		}
+	}
+	if (0 == br->remaining){
+		br->done = TRUE;
+		return 0;
+	}
+
+	if (0 < br->remaining && (long long)n > br->remaining){
+		n = br->remaining;
+	}
+	if (0 > (got = rioReadSome(br->rp, buf, n))){
+		return -1;
+	}
+	if (0 == got){
+		/* Only a body without any framing may end at EOF. */
+		if (0 > br->remaining){
+			br->done = TRUE;
+			return 0;
+		}
+		return -1;
+	}
+	if (0 < br->remaining){
+		br->remaining -= got;
+	}
+	return got;
+}
+
+/* Returns what rio has buffered, or else the result of one read straight into buf, rather than waiting for all n bytes. */
+ssize_t rioReadSome(rio_t *rp, char *buf, size_t n){
+	ssize_t got;
+
+	if (0 < rp->rio_cnt){
+		got = (size_t)rp->rio_cnt < n ? rp->rio_cnt : (ssize_t)n;
+		memcpy(buf, rp->rio_bufptr, got);
+		rp->rio_bufptr += got;
+		rp->rio_cnt -= got;
+		return got;
+	}
+	while (1){
+		__atomic_add_fetch(&relayReads, 1, __ATOMIC_RELAXED);
+		if (0 <= (got = read(rp->rio_fd, buf, n)) || EINTR != errno){
+			if (0 < got){
+				deadlineTouch(deadlineMine);
+			}
+			return got;
+		}
+	}
+}
+
+/* Moves the rest of an unchunked body to connfd through a pipe. Returns the bytes moved, or -1 if either side fails. */
+long long bodySplice(bodyReader *br, int connfd){
+	int pipefd[2];
+	long long moved = 0, buffered;
+	ssize_t n, out;
+	size_t want;
+
+	if (br->chunked){
+		return bodyCopy(br, connfd, FALSE);
+	}
+
+	/* Bytes rio already pulled in have to be written from there. */
+	if (0 < br->rp->rio_cnt && 0 != br->remaining){
+		n = br->rp->rio_cnt;
+		if (0 < br->remaining && n > br->remaining){
+			n = br->remaining;
+		}
+		if (0 > relayOut(connfd, br->rp->rio_bufptr, n, FALSE)){
+			return -1;
+		}
+		br->rp->rio_bufptr += n;
+		br->rp->rio_cnt -= n;
+		if (0 < br->remaining){
+			br->remaining -= n;
+		}
+		moved += n;
+	}
+
+	/* A pipe per body rather than per thread, so threads that exit leave nothing open. */
+	if (0 > pipe2(pipefd, O_CLOEXEC)){
+		n = bodyCopy(br, connfd, FALSE);
+		return 0 > n ? -1 : moved + n;
+	}
+	fcntl(pipefd[1], F_SETPIPE_SZ, SPLICEPIPE);
+	buffered = moved;
+
+	while (0 != br->remaining){
+		want = 0 > br->remaining || SPLICEPIPE < br->remaining ? SPLICEPIPE : br->remaining;
+		__atomic_add_fetch(&relaySplices, 1, __ATOMIC_RELAXED);
+		if (0 > (n = splice(br->rp->rio_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE))){
+			if (EINTR == errno){
+				continue;
+			}
+			/* Sockets that cannot splice still relay, just through a buffer. */
+			if (EINVAL == errno && buffered == moved){
+				close(pipefd[0]);
+				close(pipefd[1]);
+				n = bodyCopy(br, connfd, FALSE);
+				return 0 > n ? -1 : moved + n;
+			}
+			break;
+		}
+		if (0 == n){
+			if (0 > br->remaining){
+				br->remaining = 0;
+			}
+			break;
+		}
+		if (0 < br->remaining){
+			br->remaining -= n;
+		}
+		deadlineTouch(deadlineMine);
+
+		/* Drain the pipe into the client before filling it again. */
+		while (0 < n){
+			__atomic_add_fetch(&relaySplices, 1, __ATOMIC_RELAXED);
+			if (0 > (out = splice(pipefd[0], NULL, connfd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE))){
+				if (EINTR == errno){
+					continue;
+				}
+				break;
+			}
+			n -= out;
+			moved += out;
+			__atomic_add_fetch(&relaySpliced, out, __ATOMIC_RELAXED);
+			deadlineTouch(deadlineMine);
+		}
+		if (0 < n){
+			break;
+		}
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	if (0 != br->remaining){
+		return -1;
+	}
+	br->done = TRUE;
+	return moved;
+}
+
+/* Moves the rest of the body to connfd through a RELAYBUF buffer, as chunks if chunked. Returns the bytes moved, or -1 if either side fails. */
+long long bodyCopy(bodyReader *br, int connfd, int chunked){
+	char *buf;
+	long long moved = 0;
+	ssize_t n;
+
+	if (NULL == (buf = malloc(RELAYBUF))){
+		return -1;
+	}
+	while (0 < (n = bodyRead(br, buf, RELAYBUF))){
+		if (0 > relayOut(connfd, buf, n, chunked)){
+			n = -1;
+			break;
+		}
+		moved += n;
+	}
+	free(buf);
+	return 0 > n ? -1 : moved;
+}
+
+/* Sends n body bytes to the client, as one chunk if chunked. Returns -1 if the client has gone. */
+int relayOut(int connfd, char *data, size_t n, int chunked){
+	struct iovec iov[3];
+	char line[32];
+
+	if (!chunked){
+		iov[0].iov_base = data;
+		iov[0].iov_len = n;
+		return relayWritev(connfd, iov, 1);
+	}
+	iov[0].iov_base = line;
+	iov[0].iov_len = sprintf(line, "%zx\r\n", n);
+	iov[1].iov_base = data;
+	iov[1].iov_len = n;
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+	return relayWritev(connfd, iov, 3);
+}
+
+/* Writes all of iov[0, cnt) to a blocking fd; iov is consumed. Returns -1 if the peer has gone. */
+int relayWritev(int fd, struct iovec *iov, int cnt){
+	ssize_t n;
+
+	while (0 < cnt){
+		__atomic_add_fetch(&relayWrites, 1, __ATOMIC_RELAXED);
+		if (0 > (n = writev(fd, iov, cnt))){
+			if (EINTR == errno){
+				continue;
+			}
+			return -1;
+		}
+		deadlineTouch(deadlineMine);
+		/* Skip what went out; a short write leaves the rest of its iovec. */
+		while (0 < cnt && (size_t)n >= iov->iov_len){
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (0 < cnt){
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Writes the relay counters as "name value" lines to buf. Returns the length written. */
+int relayStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"relay_reads %ld\n"
+		"relay_writes %ld\n"
+		"relay_splices %ld\n"
+		"relay_spliced_bytes %ld\n",
+		__atomic_load_n(&relayReads, __ATOMIC_RELAXED),
+		__atomic_load_n(&relayWrites, __ATOMIC_RELAXED),
+		__atomic_load_n(&relaySplices, __ATOMIC_RELAXED),
+		__atomic_load_n(&relaySpliced, __ATOMIC_RELAXED));
+}
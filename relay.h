@@ -0,0 +1,27 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+
+#define RELAYBUF 65536		/* bytes moved per read/write once the head is parsed */
+#define SPLICEPIPE 1048576	/* pipe size asked for when splicing */
+
+/* Reads one response body whatever its framing: chunked, a Content-Length, or until EOF. */
+typedef struct bodyReader{
+	rio_t *rp;
+	int chunked;
+	long long remaining;	/* left in the body, or the current chunk; -1 until EOF */
+	int started;			/* a chunk has been read, so its trailing CRLF is due */
+	int done;
+} bodyReader;
+
+void bodyInit(bodyReader *br, rio_t *rp, int chunked, long long length);
+ssize_t bodyRead(bodyReader *br, char *buf, size_t n);
+long long bodySplice(bodyReader *br, int connfd);
+long long bodyCopy(bodyReader *br, int connfd, int chunked);
+int  relayOut(int connfd, char *data, size_t n, int chunked);
+int  relayWritev(int fd, struct iovec *iov, int cnt);
+int  relayStats(char *buf, size_t len);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,248 @@
+/*
+ * ----------------------------------------------------------
+ * relaybench.c - Compares ways of relaying a response body
+ *                from origin to client.
+ *
+ * - lines: rio_readlineb and a write per "line", as proxy
+ *   originally relayed bodies; binary data has a newline
+ *   every 256 bytes or so
+ * - rio: rio_readnb and rio_writen in MAXLINE pieces
+ * - bulk: bodyRead in RELAYBUF reads and relayOut, the path
+ *   proxy takes for bodies it may cache (see relay.c)
+ * - splice: bodySplice through a pipe, the path proxy takes
+ *   for bodies it will not cache
+ *
+ * An origin thread writes a head and a binary body of the
+ * given size over loopback TCP; the relay parses the head
+ * and moves the body to a second connection that a sink
+ * thread drains. Reports throughput and the relay's read,
+ * write and splice calls (reads and writes as counted by
+ * /proc/thread-self/io).
+ *
+ * usage: relaybench [-s megabytes] [-n rounds]
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include "csapp.h"
+#include "proxy.h"
+#include "relay.h"
+
+typedef struct bench{
+	int fd;
+	size_t size;
+} bench;
+
+long long relayLines(rio_t *rp, int connfd, size_t size);
+long long relayRio(rio_t *rp, int connfd, size_t size);
+long long relayBulk(rio_t *rp, int connfd, size_t size);
+long long relaySplice(rio_t *rp, int connfd, size_t size);
+void run(char *name, long long (*relay)(rio_t *, int, size_t), size_t size, int rounds);
+void *origin(void *vargp);
+void *sink(void *vargp);
+void tcpPair(int *a, int *b);
+long ioCalls();
+double now();
+
+extern long relaySplices;
+char *body;
+
+int main(int argc, char **argv)
+{
+	size_t size = 16;
+	int rounds = 5;
+	int opt;
+	size_t i;
+
+	while (-1 != (opt = getopt(argc, argv, "s:n:"))){
+		switch (opt){
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s megabytes] [-n rounds]\n", argv[0]);
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	Signal(SIGPIPE, SIG_IGN);
+	size <<= 20;
+	body = Malloc(size);
+	srand(1);
+	for (i = 0; i < size; i++){
+		body[i] = rand();
+	}
+
+	printf("%zu MB body, %d rounds each\n", size >> 20, rounds);
+	run("lines", relayLines, size, rounds);
+	run("rio", relayRio, size, rounds);
+	run("bulk", relayBulk, size, rounds);
+	run("splice", relaySplice, size, rounds);
+	exit(EXIT_SUCCESS);
+}
+
+/* Relay rounds bodies with relay and print the averages. */
+void run(char *name, long long (*relay)(rio_t *, int, size_t), size_t size, int rounds){
+	bench up, down;
+	pthread_t originTid, sinkTid;
+	long calls = 0, splices = 0, before;
+	double secs = 0, start;
+	char line[MAXLINE];
+	rio_t rio;
+	int i, relayIn, relayOutFd;
+	void *got;
+
+	for (i = 0; i < rounds; i++){
+		tcpPair(&up.fd, &relayIn);
+		tcpPair(&relayOutFd, &down.fd);
+		up.size = down.size = size;
+		Pthread_create(&originTid, NULL, origin, &up);
+		Pthread_create(&sinkTid, NULL, sink, &down);
+
+		start = now();
+		before = ioCalls();
+		splices -= __atomic_load_n(&relaySplices, __ATOMIC_RELAXED);
+
+		/* The head is always parsed a line at a time, as proxy does. */
+		rio_readinitb(&rio, relayIn);
+		while (0 < rio_readlineb(&rio, line, MAXLINE) && 0 != strcmp("\r\n", line))
+			;
+		if ((long long)size != relay(&rio, relayOutFd, size)){
+			app_error("relay came up short");
+		}
+
+		/* ioCalls itself costs one read per call. */
+		calls += ioCalls() - before - 1;
+		splices += __atomic_load_n(&relaySplices, __ATOMIC_RELAXED);
+		close(relayOutFd);
+		Pthread_join(sinkTid, &got);
+		secs += now() - start;
+		Pthread_join(originTid, NULL);
+		close(relayIn);
+		if ((size_t)got != size){
+			app_error("sink got the wrong number of bytes");
+		}
+	}
+
+	printf("%-8s %8.1f MB/s  %9ld read/write calls  %7ld splice calls  per body\n",
+	       name, (double)size * rounds / secs / (1 << 20), calls / rounds, splices / rounds);
+}
+
+/* The body relayed the way proxy originally did it: a write per line. */
+long long relayLines(rio_t *rp, int connfd, size_t size){
+	char buf[MAXLINE];
+	long long moved = 0;
+	ssize_t n;
+
+	while (0 < (n = rio_readlineb(rp, buf, MAXLINE))){
+		rio_writen(connfd, buf, n);
+		moved += n;
+	}
+	return moved;
+}
+
+/* The body in MAXLINE pieces through rio. */
+long long relayRio(rio_t *rp, int connfd, size_t size){
+	char buf[MAXLINE];
+	long long moved = 0;
+	ssize_t n;
+
+	while (0 < (n = rio_readnb(rp, buf, MAXLINE))){
+		rio_writen(connfd, buf, n);
+		moved += n;
+	}
+	return moved;
+}
+
+/* The body through bodyRead and relayOut in RELAYBUF reads. */
+long long relayBulk(rio_t *rp, int connfd, size_t size){
+	bodyReader br;
+
+	bodyInit(&br, rp, FALSE, size);
+	return bodyCopy(&br, connfd, FALSE);
+}
+
+/* The body spliced through a pipe. */
+long long relaySplice(rio_t *rp, int connfd, size_t size){
+	bodyReader br;
+
+	bodyInit(&br, rp, FALSE, size);
+	return bodySplice(&br, connfd);
+}
+
+/* Write a head and the body, then close. */
+void *origin(void *vargp){
+	bench *b = vargp;
+	char head[MAXLINE];
+
+	sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n", b->size);
+	rio_writen(b->fd, head, strlen(head));
+	rio_writen(b->fd, body, b->size);
+	close(b->fd);
+	return NULL;
+}
+
+/* Drain the connection to EOF and return the byte count. */
+void *sink(void *vargp){
+	bench *b = vargp;
+	char buf[RELAYBUF];
+	size_t got = 0;
+	ssize_t n;
+
+	while (0 < (n = read(b->fd, buf, sizeof(buf)))){
+		got += n;
+	}
+	close(b->fd);
+	return (void *)got;
+}
+
+/* A connected pair of loopback TCP sockets. */
+void tcpPair(int *a, int *b){
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int listenfd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (0 > (listenfd = socket(AF_INET, SOCK_STREAM, 0)) || 0 > bind(listenfd, (SA *)&sa, sizeof(sa))
+		|| 0 > listen(listenfd, 1) || 0 > getsockname(listenfd, (SA *)&sa, &len)
+		|| 0 > (*a = socket(AF_INET, SOCK_STREAM, 0)) || 0 > connect(*a, (SA *)&sa, sizeof(sa))
+		|| 0 > (*b = accept(listenfd, NULL, NULL))){
+		unix_error("cannot make a loopback connection");
+	}
+	close(listenfd);
+}
+
+/* Read and write system calls made by this thread so far. */
+long ioCalls(){
+	char buf[512];
+	char *p;
+	long calls = 0;
+	int fd, n = 0;
+
+	if (0 > (fd = open("/proc/thread-self/io", O_RDONLY)) || 0 >= (n = read(fd, buf, sizeof(buf) - 1))){
+		unix_error("cannot read /proc/thread-self/io");
+	}
+	close(fd);
+	buf[n] = '\0';
+	if (NULL != (p = strstr(buf, "syscr: "))){
+		calls += atol(p + 7);
+	}
+	if (NULL != (p = strstr(buf, "syscw: "))){
+		calls += atol(p + 7);
+	}
+	return calls;
+}
+
+/* Monotonic time in seconds. */
+double now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
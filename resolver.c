@@ -0,0 +1,342 @@
+/*
+ * ----------------------------------------------------------
+ * resolver.c - Caching host name resolver.
+ *
+ * - answers, positive and negative, are cached per name for
+ *   ttl and negativeTtl seconds
+ * - a name missing from the cache is queued for a small pool
+ *   of resolver threads; concurrent lookups of the same name
+ *   wait on that one query instead of issuing their own
+ * - threads that can block use resolveHost, waiting no longer
+ *   than they are given; the event loops use resolveAsync and
+ *   are called back when it is answered
+ * - an optional hosts file (IPv4 "address name..." lines) is
+ *   consulted before getaddrinfo, e.g. for local testing
+ * ----------------------------------------------------------
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "resolver.h"
+
+#define DNSBUCKETS 1024
+
+/* Entry states. */
+enum { DNS_PENDING, DNS_OK, DNS_FAILED };
+
+/* Someone waiting, from an event loop, for a pending entry. */
+typedef struct dnsWaiter{
+	void (*done)(void *);
+	void *arg;
+	struct dnsWaiter *next;
+} dnsWaiter;
+
+typedef struct dnsEntry{
+	char *name;
+	int state;
+	struct in_addr addr;
+	time_t expires;
+	int blocked;				/* threads in resolveHost still to read the answer */
+	dnsWaiter *waiters;
+	struct dnsEntry *next;		/* bucket chain */
+	struct dnsEntry *queued;	/* resolver queue */
+} dnsEntry;
+
+/* A hosts file line. */
+typedef struct hostsEntry{
+	char *name;
+	struct in_addr addr;
+	struct hostsEntry *next;
+} hostsEntry;
+
+dnsEntry *dnsTable[DNSBUCKETS];
+dnsEntry *queueHead;
+dnsEntry *queueTail;
+hostsEntry *hostsList;
+pthread_mutex_t dnsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dnsAnswered = PTHREAD_COND_INITIALIZER;
+pthread_cond_t dnsQueued = PTHREAD_COND_INITIALIZER;
+int dnsTtl = 60;
+int dnsNegativeTtl = 10;
+
+/* Counters for the status page. */
+long statLookups;
+long statCached;
+long statCoalesced;
+long statQueries;
+long statFailures;
+long statTimeouts;
+
+dnsEntry *dnsLookup(char *host, time_t now);
+void *resolverThread(void *vargp);
+int  resolveName(char *host, struct in_addr *addr);
+void loadHosts(char *hostsFile);
+
+/* Start threads resolver threads with the given cache lifetimes, reading hostsFile first if not NULL. */
+void resolverInit(int threads, int ttl, int negativeTtl, char *hostsFile){
+	pthread_t tid;
+	int i;
+
+	dnsTtl = ttl;
+	dnsNegativeTtl = negativeTtl;
+	if (NULL != hostsFile){
+		loadHosts(hostsFile);
+	}
+	for (i = 0; i < threads; i++){
+		if (0 != pthread_create(&tid, NULL, resolverThread, NULL)){
+			fprintf(stderr, "Error creating resolver thread.\n");
+			exit(1);
+		}
+	}
+}
+
+/* Resolves host into addr, waiting up to timeoutMs (0 for as long as it takes) if it has to be queried. Returns -1 if it does not resolve in time. */
+int resolveHost(char *host, struct in_addr *addr, long timeoutMs){
+	struct timespec until;
+	dnsEntry *ep;
+	int ok, err = 0;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeoutMs / 1000 + (until.tv_nsec + timeoutMs % 1000 * 1000000) / 1000000000;
+	until.tv_nsec = (until.tv_nsec + timeoutMs % 1000 * 1000000) % 1000000000;
+
+	pthread_mutex_lock(&dnsLock);
+	if (NULL == (ep = dnsLookup(host, time(NULL)))){
+		pthread_mutex_unlock(&dnsLock);
+		return -1;
+	}
+	ep->blocked++;
+	while (DNS_PENDING == ep->state && ETIMEDOUT != err){
+		err = 0 < timeoutMs ? pthread_cond_timedwait(&dnsAnswered, &dnsLock, &until) : pthread_cond_wait(&dnsAnswered, &dnsLock);
+	}
+	ep->blocked--;
+	/* Out of time, the query is left to finish for whoever asks next. */
+	if (DNS_PENDING == ep->state){
+		statTimeouts++;
+		pthread_mutex_unlock(&dnsLock);
+		return -1;
+	}
+	ok = DNS_OK == ep->state;
+	*addr = ep->addr;
+	pthread_mutex_unlock(&dnsLock);
+	return ok ? 0 : -1;
+}
+
+/*
+ * Resolves host into addr without blocking. Returns 1 if the
+ * answer was cached, -1 if the name is known not to resolve,
+ * and 0 if a query is in flight, in which case done(arg) is
+ * called from a resolver thread once it is answered; calling
+ * again then returns the cached answer.
+ */
+int resolveAsync(char *host, struct in_addr *addr, void (*done)(void *), void *arg){
+	dnsEntry *ep;
+	dnsWaiter *wp;
+	int ret;
+
+	pthread_mutex_lock(&dnsLock);
+	if (NULL == (ep = dnsLookup(host, time(NULL)))){
+		pthread_mutex_unlock(&dnsLock);
+		return -1;
+	}
+	if (DNS_PENDING == ep->state){
+		if (NULL == (wp = malloc(sizeof(dnsWaiter)))){
+			pthread_mutex_unlock(&dnsLock);
+			return -1;
+		}
+		wp->done = done;
+		wp->arg = arg;
+		wp->next = ep->waiters;
+		ep->waiters = wp;
+		ret = 0;
+	}
+	else{
+		ret = DNS_OK == ep->state ? 1 : -1;
+		*addr = ep->addr;
+	}
+	pthread_mutex_unlock(&dnsLock);
+	return ret;
+}
+
+/* Writes the resolver counters to buf, one "name value" per line. Returns the length written. */
+int resolverStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"dns_lookups %ld\n"
+		"dns_cached %ld\n"
+		"dns_coalesced %ld\n"
+		"dns_queries %ld\n"
+		"dns_failures %ld\n"
+		"dns_timeouts %ld\n",
+		__atomic_load_n(&statLookups, __ATOMIC_RELAXED),
+		__atomic_load_n(&statCached, __ATOMIC_RELAXED),
+		__atomic_load_n(&statCoalesced, __ATOMIC_RELAXED),
+		__atomic_load_n(&statQueries, __ATOMIC_RELAXED),
+		__atomic_load_n(&statFailures, __ATOMIC_RELAXED),
+		__atomic_load_n(&statTimeouts, __ATOMIC_RELAXED));
+}
+
+/*
+ * Finds the entry for host, creating and queueing a pending
+ * one if there is none or the cached answer has expired.
+ * Returns NULL only when out of memory. Caller holds dnsLock.
+ */
+dnsEntry *dnsLookup(char *host, time_t now){
+	unsigned long hash = 5381;
+	dnsEntry **p, *ep;
+	char *c;
+
+	for (c = host; *c; c++){
+		hash = 33 * hash + (unsigned char)tolower(*c);
+	}
+	statLookups++;
+
+	for (p = &dnsTable[hash % DNSBUCKETS]; NULL != (ep = *p); ){
+		if (0 == strcasecmp(host, ep->name)){
+			break;
+		}
+		/* Drop expired answers nobody is waiting on as we pass them. */
+		if (DNS_PENDING != ep->state && 0 == ep->blocked && now >= ep->expires){
+			*p = ep->next;
+			free(ep->name);
+			free(ep);
+			continue;
+		}
+		p = &ep->next;
+	}
+
+	if (NULL != ep){
+		if (DNS_PENDING == ep->state){
+			statCoalesced++;
+			return ep;
+		}
+		if (now < ep->expires){
+			statCached++;
+			return ep;
+		}
+	}
+	else{
+		if (NULL == (ep = calloc(1, sizeof(dnsEntry))) || NULL == (ep->name = strdup(host))){
+			free(ep);
+			return NULL;
+		}
+		ep->next = dnsTable[hash % DNSBUCKETS];
+		dnsTable[hash % DNSBUCKETS] = ep;
+	}
+
+	/* Missing or expired: queue a query. */
+	ep->state = DNS_PENDING;
+	ep->queued = NULL;
+	if (NULL == queueTail){
+		queueHead = ep;
+	}
+	else{
+		queueTail->queued = ep;
+	}
+	queueTail = ep;
+	pthread_cond_signal(&dnsQueued);
+	return ep;
+}
+
+/* Answers queued entries one at a time, then wakes everyone waiting on them. */
+void *resolverThread(void *vargp){
+	dnsEntry *ep;
+	dnsWaiter *wp, *next;
+	struct in_addr addr;
+	char *name;
+	int ok;
+
+	Pthread_detach(pthread_self());
+	while(1){
+		pthread_mutex_lock(&dnsLock);
+		while (NULL == queueHead){
+			pthread_cond_wait(&dnsQueued, &dnsLock);
+		}
+		ep = queueHead;
+		if (NULL == (queueHead = ep->queued)){
+			queueTail = NULL;
+		}
+		/* Pending entries are never freed, but copy the name so the query runs unlocked. */
+		name = strdup(ep->name);
+		pthread_mutex_unlock(&dnsLock);
+
+		ok = NULL != name && 0 == resolveName(name, &addr);
+		free(name);
+
+		pthread_mutex_lock(&dnsLock);
+		statQueries++;
+		if (ok){
+			ep->state = DNS_OK;
+			ep->addr = addr;
+			ep->expires = time(NULL) + dnsTtl;
+		}
+		else{
+			statFailures++;
+			ep->state = DNS_FAILED;
+			ep->expires = time(NULL) + dnsNegativeTtl;
+		}
+		wp = ep->waiters;
+		ep->waiters = NULL;
+		pthread_cond_broadcast(&dnsAnswered);
+		pthread_mutex_unlock(&dnsLock);
+
+		for (; NULL != wp; wp = next){
+			next = wp->next;
+			wp->done(wp->arg);
+			free(wp);
+		}
+	}
+	return NULL;
+}
+
+/* Looks host up in the hosts file, then with getaddrinfo. */
+int resolveName(char *host, struct in_addr *addr){
+	struct addrinfo hints, *res;
+	hostsEntry *hp;
+
+	for (hp = hostsList; NULL != hp; hp = hp->next){
+		if (0 == strcasecmp(host, hp->name)){
+			*addr = hp->addr;
+			return 0;
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (0 != getaddrinfo(host, NULL, &hints, &res)){
+		return -1;
+	}
+	*addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/* Reads "address name [alias...]" lines from an /etc/hosts style file. */
+void loadHosts(char *hostsFile){
+	char line[MAXLINE];
+	char *tok, *save;
+	struct in_addr addr;
+	hostsEntry *hp;
+	FILE *fp;
+
+	if (NULL == (fp = fopen(hostsFile, "r"))){
+		fprintf(stderr, "Error opening hosts file %s.\n", hostsFile);
+		exit(1);
+	}
+	while (NULL != fgets(line, MAXLINE, fp)){
+		if (NULL != (tok = strchr(line, '#'))){
+			*tok = '\0';
+		}
+		if (NULL == (tok = strtok_r(line, " \t\r\n", &save)) || 1 != inet_pton(AF_INET, tok, &addr)){
+			continue;
+		}
+		while (NULL != (tok = strtok_r(NULL, " \t\r\n", &save))){
+			hp = Malloc(sizeof(hostsEntry));
+			hp->name = strdup(tok);
+			hp->addr = addr;
+			hp->next = hostsList;
+			hostsList = hp;
+		}
+	}
+	fclose(fp);
+}
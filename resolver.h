@@ -0,0 +1,11 @@
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "csapp.h"
+
+void resolverInit(int threads, int ttl, int negativeTtl, char *hostsFile);
+int  resolveHost(char *host, struct in_addr *addr, long timeoutMs);
+int  resolveAsync(char *host, struct in_addr *addr, void (*done)(void *), void *arg);
+int  resolverStats(char *buf, size_t len);
+
+#endif /* __RESOLVER_H__ */
@@ -52,3 +52,166 @@ int sbuf_remove(sbuf_t *sp)
 /* $end sbuf_remove */
 /* $end sbufc */
 
+
+/* Create an empty work-stealing queue with room for at least n items */
+void wsq_init(wsq_t *qp, int n)
+{
+    long cap = 1;
+
+    while (cap < n)
+        cap <<= 1;
+    qp->buf = Calloc(cap, sizeof(int));
+    qp->n = cap;
+    qp->top = qp->bottom = 0;          /* Empty queue iff top == bottom */
+}
+
+/* Push item onto the bottom of qp. Only one thread may push. Returns 0 if qp is full */
+int wsq_push(wsq_t *qp, int item)
+{
+    long b = qp->bottom;
+    long t = __atomic_load_n(&qp->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= qp->n)
+        return 0;                          /* Full: let the caller see the overload */
+    __atomic_store_n(&qp->buf[b & (qp->n - 1)], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&qp->bottom, b + 1, __ATOMIC_SEQ_CST); /* Publish the item */
+    return 1;
+}
+
+/* Take the item at the top of qp. Safe from any thread. Returns -1 if qp is empty */
+int wsq_take(wsq_t *qp)
+{
+    long t, b;
+    int item;
+
+    while (1) {
+        t = __atomic_load_n(&qp->top, __ATOMIC_ACQUIRE);
+        b = __atomic_load_n(&qp->bottom, __ATOMIC_SEQ_CST);
+        if (t >= b)
+            return -1;
+        item = __atomic_load_n(&qp->buf[t & (qp->n - 1)], __ATOMIC_RELAXED);
+        /* If another taker got here first the slot may already be reused, so retry */
+        if (__atomic_compare_exchange_n(&qp->top, &t, t + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return item;
+    }
+}
+
+/* The item wsq_take would return next, left in place; -1 if qp is empty. A snapshot: another taker may get it first */
+int wsq_peek(wsq_t *qp)
+{
+    long t = __atomic_load_n(&qp->top, __ATOMIC_ACQUIRE);
+    long b = __atomic_load_n(&qp->bottom, __ATOMIC_SEQ_CST);
+
+    if (t >= b)
+        return -1;
+    return __atomic_load_n(&qp->buf[t & (qp->n - 1)], __ATOMIC_RELAXED);
+}
+
+/* Number of items currently queued in qp (a snapshot) */
+int wsq_size(wsq_t *qp)
+{
+    long b = __atomic_load_n(&qp->bottom, __ATOMIC_ACQUIRE);
+    long t = __atomic_load_n(&qp->top, __ATOMIC_ACQUIRE);
+    return b > t ? (int)(b - t) : 0;
+}
+
+/* Take from our own queue first, then try to steal from the others */
+static int pool_find(worker_t *wp)
+{
+    pool_t *pp = wp->pool;
+    int i, item;
+
+    if (0 <= (item = wsq_take(&wp->q)))
+        return item;
+    for (i = 1; i < pp->n; i++)
+        if (0 <= (item = wsq_take(&pp->workers[(wp->id + i) % pp->n].q)))
+            return item;
+    return -1;
+}
+
+/* Worker thread: serve connections until there is nothing left anywhere, then sleep */
+static void *pool_worker(void *vargp)
+{
+    worker_t *wp = vargp;
+    int connfd, idle;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (0 <= (connfd = pool_find(wp))) {
+            wp->pool->handler(connfd);
+            continue;
+        }
+
+        /* Announce we are idle, then look again so a concurrent push is not missed */
+        __atomic_store_n(&wp->idle, 1, __ATOMIC_SEQ_CST);
+        if (0 <= (connfd = pool_find(wp))) {
+            idle = 1;
+            /* If the acceptor already claimed us it will post; swallow that wakeup */
+            if (!__atomic_compare_exchange_n(&wp->idle, &idle, 0, 0,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                P(&wp->wake);
+            wp->pool->handler(connfd);
+            continue;
+        }
+        P(&wp->wake);                      /* The acceptor cleared idle before posting */
+    }
+    return NULL;
+}
+
+/* Prespawn nworkers workers, each with a queue of depth slots, that run handler on every connfd */
+void pool_init(pool_t *pp, int nworkers, int depth, void (*handler)(int))
+{
+    int i;
+
+    pp->workers = Calloc(nworkers, sizeof(worker_t));
+    pp->n = nworkers;
+    pp->next = 0;
+    pp->rejected = 0;
+    pp->handler = handler;
+    for (i = 0; i < nworkers; i++) {
+        worker_t *wp = &pp->workers[i];
+        wsq_init(&wp->q, depth);
+        Sem_init(&wp->wake, 0, 0);
+        wp->idle = 0;
+        wp->id = i;
+        wp->pool = pp;
+    }
+    for (i = 0; i < nworkers; i++)
+        Pthread_create(&pp->workers[i].tid, NULL, pool_worker, &pp->workers[i]);
+}
+
+/*
+ * Hand connfd to the pool: queue it round robin on the first
+ * worker with room, then wake one idle worker, which takes it
+ * from its own queue or steals it. Returns 0 without queueing
+ * if every queue is full. Only one thread may submit.
+ */
+int pool_submit(pool_t *pp, int connfd)
+{
+    int i, idle;
+    worker_t *wp;
+
+    for (i = 0; i < pp->n; i++) {
+        wp = &pp->workers[(pp->next + i) % pp->n];
+        if (wsq_push(&wp->q, connfd))
+            break;
+    }
+    if (i == pp->n) {
+        __atomic_add_fetch(&pp->rejected, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    pp->next = (pp->next + i + 1) % pp->n;
+
+    for (i = 0; i < pp->n; i++) {
+        wp = &pp->workers[(pp->next + i) % pp->n];
+        idle = 1;
+        if (__atomic_load_n(&wp->idle, __ATOMIC_SEQ_CST) &&
+            __atomic_compare_exchange_n(&wp->idle, &idle, 0, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            V(&wp->wake);
+            break;
+        }
+    }
+    return 1;
+}
@@ -21,5 +21,46 @@ void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
 
+/* 
+ * Bounded lock-free work-stealing queue. One producer (the
+ * acceptor) pushes at the bottom; the owning worker and any
+ * thieves take from the top with a CAS, so connections are
+ * still served in FIFO order.
+ */
+typedef struct {
+    int *buf;          /* Ring of n slots */
+    long n;            /* Capacity, a power of two */
+    long top;          /* buf[top%n] is the next item taken */
+    long bottom;       /* buf[bottom%n] is the next free slot */
+} wsq_t;
+
+void wsq_init(wsq_t *qp, int n);
+int wsq_push(wsq_t *qp, int item);
+int wsq_take(wsq_t *qp);
+int wsq_peek(wsq_t *qp);
+int wsq_size(wsq_t *qp);
+
+/* A worker of a pool: its own queue plus a semaphore to sleep on when idle. */
+typedef struct {
+    wsq_t q;           /* Connections handed to this worker */
+    sem_t wake;        /* Posted by the acceptor to wake an idle worker */
+    int idle;          /* Nonzero while the worker is (about to be) asleep */
+    int id;
+    struct pool *pool;
+    pthread_t tid;
+} worker_t;
+
+/* Prespawned workers that take connfds from their own queue or steal from each other. */
+typedef struct pool {
+    worker_t *workers;
+    int n;             /* Number of workers */
+    int next;          /* Round robin cursor, touched by the acceptor only */
+    long rejected;     /* Connections refused because every queue was full */
+    void (*handler)(int);
+} pool_t;
+
+void pool_init(pool_t *pp, int nworkers, int depth, void (*handler)(int));
+int pool_submit(pool_t *pp, int connfd);
+
 
 #endif /* __SBUF_H__ */
@@ -0,0 +1,303 @@
+/*
+ * ----------------------------------------------------------
+ * slab.c - Size-classed slab allocator for cached objects.
+ *
+ * - the cache's object memory is one preallocated arena cut
+ *   into equal slabs; nothing is malloc'd per object, so
+ *   memory stays within the configured cache size however
+ *   the mix of object sizes churns
+ * - chunk sizes grow by CHUNKGROWTH from CHUNKMIN up to a
+ *   whole slab; an object takes a chunk of the smallest
+ *   class it fits, wasting at most about a fifth of it
+ * - a slab is big enough for the largest cacheable object
+ *   unless that would leave a shard fewer than SHARDSLABS
+ *   of them; then slabs are smaller (down to SLABMIN) and
+ *   objects bigger than a slab take a run of adjacent ones,
+ *   so that a small cache can still have several shards
+ * - a free run is given to whichever class runs out of
+ *   room first and carved into that class's chunks lazily;
+ *   it becomes free again when its last chunk is given back
+ * - allocation pops a chunk given back earlier or carves the
+ *   next one; freeing pushes it, threading the free list
+ *   through the chunks themselves
+ * - every call is made under the owning shard's write lock
+ * ----------------------------------------------------------
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "slab.h"
+
+char *slabArena;
+size_t slabBytes;
+cacheSlab *slabs;
+size_t classSize[SLABCLASSES];
+int classChunks[SLABCLASSES];
+int classRun[SLABCLASSES];	/* slabs in each of the class's runs */
+int numClasses;
+
+unsigned char *claimed;		/* while restoring: one bit per chunk of the shard's slabs */
+int maxChunks;
+
+int  runTake(cacheShard *sp, int cls);
+void runSet(cacheShard *sp, int first, int cls);
+void slabPush(int *list, int slab);
+void slabUnlink(int *list, int slab);
+
+/* The slab size for objects of up to largest bytes, chunk header included, in shards of shardBytes: the next power of two, or a smaller one if that leaves a shard too few. */
+size_t slabSizeFor(size_t largest, size_t shardBytes){
+	size_t size = SLABMIN;
+
+	while (size < largest){
+		size <<= 1;
+	}
+	while (SLABMIN < size && shardBytes / size < SHARDSLABS){
+		size >>= 1;
+	}
+	return size;
+}
+
+/* Takes count slabs of bytes each at base, and works out the size classes that fit in them for objects of up to largest bytes. */
+void slabInit(char *base, size_t bytes, int count, size_t largest){
+	int most = (largest + bytes - 1) / bytes, run;
+	size_t size = CHUNKMIN;
+
+	slabArena = base;
+	slabBytes = bytes;
+	slabs = cacheCalloc(count, sizeof(cacheSlab));
+	numClasses = 0;
+	while (numClasses < SLABCLASSES - most && size < bytes / 2){
+		classSize[numClasses] = size;
+		classRun[numClasses] = 1;
+		classChunks[numClasses] = bytes / size;
+		numClasses++;
+		size = ((size_t)(size * CHUNKGROWTH) + 7) & ~7UL;
+	}
+	/* The rest take a whole slab, or a run of them for objects bigger than a slab. */
+	for (run = 1; run <= most; run++){
+		classSize[numClasses] = run * bytes;
+		classRun[numClasses] = run;
+		classChunks[numClasses] = 1;
+		numClasses++;
+	}
+	maxChunks = bytes / CHUNKMIN;
+}
+
+/* Gives sp slabs first to first + count - 1, all free, and empties its classes. */
+void slabShardInit(cacheShard *sp, int first, int count){
+	int i;
+
+	sp->firstSlab = first;
+	sp->numSlabs = count;
+	sp->freeSlabs = -1;
+	for (i = 0; i < SLABCLASSES; i++){
+		sp->classes[i].partial = -1;
+		sp->classes[i].slabs = 0;
+	}
+	for (i = first + count - 1; i >= first; i--){
+		slabs[i].cls = -1;
+		slabs[i].run = i;
+		slabPush(&sp->freeSlabs, i);
+	}
+}
+
+/* The smallest class whose chunks hold need bytes, or -1 if none does. */
+int slabClassFor(size_t need){
+	int lo = 0, hi = numClasses - 1, mid;
+
+	if (classSize[hi] < need){
+		return -1;
+	}
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (classSize[mid] < need){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Where chunk of slab, of class cls, starts. */
+char *chunkAddr(int cls, int slab, int chunk){
+	return slabArena + (size_t)slab * slabBytes + (size_t)chunk * classSize[cls];
+}
+
+/* Finds a chunk of class cls, giving the class a free run if it has no room. Returns -1 if there is none. */
+int chunkAlloc(cacheShard *sp, int cls, int *slab, int *chunk){
+	cacheClass *cp = &sp->classes[cls];
+	cacheSlab *sl;
+	int i;
+
+	if (0 > cp->partial){
+		if (0 > (i = runTake(sp, cls))){
+			return -1;
+		}
+		runSet(sp, i, cls);
+		slabs[i].carved = 0;
+		slabs[i].used = 0;
+		slabs[i].freeChunk = -1;
+		slabPush(&cp->partial, i);
+	}
+
+	sl = &slabs[*slab = cp->partial];
+	if (0 <= sl->freeChunk){
+		*chunk = sl->freeChunk;
+		sl->freeChunk = *(int *)chunkAddr(cls, *slab, *chunk);
+	}
+	else{
+		*chunk = sl->carved++;
+	}
+	if (classChunks[cls] == ++sl->used){
+		slabUnlink(&cp->partial, *slab);
+	}
+	return 0;
+}
+
+/* Gives a chunk back; its run is free again once none of its chunks is in use. */
+void chunkFree(cacheShard *sp, int slab, int chunk){
+	cacheSlab *sl = &slabs[slab];
+	cacheClass *cp = &sp->classes[sl->cls];
+
+	*(int *)chunkAddr(sl->cls, slab, chunk) = sl->freeChunk;
+	sl->freeChunk = chunk;
+	if (classChunks[sl->cls] == sl->used--){
+		slabPush(&cp->partial, slab);
+	}
+	if (0 == sl->used){
+		slabUnlink(&cp->partial, slab);
+		runSet(sp, slab, -1);
+	}
+}
+
+/* The first of classRun[cls] adjacent free slabs of sp, or -1 if there are not that many together. */
+int runTake(cacheShard *sp, int cls){
+	int i, n = 0;
+
+	if (1 == classRun[cls]){
+		return sp->freeSlabs;
+	}
+	for (i = sp->firstSlab; i < sp->firstSlab + sp->numSlabs; i++){
+		n = 0 > slabs[i].cls ? n + 1 : 0;
+		if (classRun[cls] == n){
+			return i - n + 1;
+		}
+	}
+	return -1;
+}
+
+/* Gives the run of free slabs from first to class cls, or with cls -1 frees the run starting there. */
+void runSet(cacheShard *sp, int first, int cls){
+	int owner = 0 <= cls ? cls : slabs[first].cls;
+	int run = classRun[owner], i;
+
+	for (i = first; i < first + run; i++){
+		if (0 <= cls){
+			slabUnlink(&sp->freeSlabs, i);
+		}
+		else{
+			slabPush(&sp->freeSlabs, i);
+		}
+		slabs[i].cls = cls;
+		slabs[i].run = first;
+	}
+	sp->classes[owner].slabs += 0 <= cls ? run : -run;
+}
+
+/* Starts rebuilding sp's slabs from the chunks its restored lines claim. */
+void slabRestoreBegin(cacheShard *sp){
+	claimed = Calloc(((size_t)sp->numSlabs * maxChunks + 7) / 8, 1);
+}
+
+/* TRUE if chunk of the run starting at slab, of class cls, is one of sp's. */
+int chunkInRange(cacheShard *sp, int cls, int slab, int chunk){
+	return 0 <= cls && numClasses > cls && sp->firstSlab <= slab && sp->firstSlab + sp->numSlabs >= slab + classRun[cls]
+		&& 0 <= chunk && classChunks[cls] > chunk;
+}
+
+/* Marks chunk of the run starting at slab in use by a restored line of class cls. FALSE if that cannot be so: out of range, overlapping another run, or claimed twice. */
+int chunkClaim(cacheShard *sp, int cls, int slab, int chunk){
+	size_t bit;
+	int i;
+
+	if (!chunkInRange(sp, cls, slab, chunk)){
+		return FALSE;
+	}
+	if (0 <= slabs[slab].cls && (cls != slabs[slab].cls || slab != slabs[slab].run)){
+		return FALSE;
+	}
+	for (i = slab; 0 > slabs[slab].cls && i < slab + classRun[cls]; i++){
+		if (0 <= slabs[i].cls){
+			return FALSE;
+		}
+	}
+	bit = (size_t)(slab - sp->firstSlab) * maxChunks + chunk;
+	if (claimed[bit / 8] & (1 << (bit % 8))){
+		return FALSE;
+	}
+	claimed[bit / 8] |= 1 << (bit % 8);
+
+	if (0 > slabs[slab].cls){
+		runSet(sp, slab, cls);
+		slabs[slab].carved = 0;
+		slabs[slab].used = 0;
+		slabs[slab].freeChunk = -1;
+	}
+	slabs[slab].used++;
+	if (slabs[slab].carved <= chunk){
+		slabs[slab].carved = chunk + 1;
+	}
+	return TRUE;
+}
+
+/* Chains up the unclaimed chunks of every run that was claimed from, and lists those with room. */
+void slabRestoreEnd(cacheShard *sp){
+	cacheSlab *sl;
+	size_t bit;
+	int i, c;
+
+	for (i = sp->firstSlab; i < sp->firstSlab + sp->numSlabs; i++){
+		sl = &slabs[i];
+		if (0 > sl->cls || i != sl->run){
+			continue;
+		}
+		for (c = sl->carved - 1; c >= 0; c--){
+			bit = (size_t)(i - sp->firstSlab) * maxChunks + c;
+			if (!(claimed[bit / 8] & (1 << (bit % 8)))){
+				*(int *)chunkAddr(sl->cls, i, c) = sl->freeChunk;
+				sl->freeChunk = c;
+			}
+		}
+		if (classChunks[sl->cls] > sl->used){
+			slabPush(&sp->classes[sl->cls].partial, i);
+		}
+	}
+	free(claimed);
+	claimed = NULL;
+}
+
+/* Puts slab at the front of list. */
+void slabPush(int *list, int slab){
+	slabs[slab].prev = -1;
+	slabs[slab].next = *list;
+	if (0 <= *list){
+		slabs[*list].prev = slab;
+	}
+	*list = slab;
+}
+
+/* Takes slab out of list. */
+void slabUnlink(int *list, int slab){
+	if (0 <= slabs[slab].prev){
+		slabs[slabs[slab].prev].next = slabs[slab].next;
+	}
+	else{
+		*list = slabs[slab].next;
+	}
+	if (0 <= slabs[slab].next){
+		slabs[slabs[slab].next].prev = slabs[slab].prev;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "cache.h"
+
+#define CHUNKMIN 128		/* smallest chunk */
+#define CHUNKGROWTH 1.25	/* each class's chunks are this much bigger than the last's */
+#define SLABMIN 4096		/* smallest slab */
+
+extern char *slabArena;
+extern size_t slabBytes;
+extern cacheSlab *slabs;
+extern size_t classSize[SLABCLASSES];
+extern int classChunks[SLABCLASSES];
+extern int classRun[SLABCLASSES];
+extern int numClasses;
+
+size_t slabSizeFor(size_t largest, size_t shardBytes);
+void slabInit(char *base, size_t bytes, int count, size_t largest);
+void slabShardInit(cacheShard *sp, int first, int count);
+int  slabClassFor(size_t need);
+char *chunkAddr(int cls, int slab, int chunk);
+int  chunkAlloc(cacheShard *sp, int cls, int *slab, int *chunk);
+void chunkFree(cacheShard *sp, int slab, int chunk);
+void slabRestoreBegin(cacheShard *sp);
+int  chunkInRange(cacheShard *sp, int cls, int slab, int chunk);
+int  chunkClaim(cacheShard *sp, int cls, int slab, int chunk);
+void slabRestoreEnd(cacheShard *sp);
+
+#endif /* __SLAB_H__ */
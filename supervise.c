@@ -0,0 +1,150 @@
+/*
+ * ----------------------------------------------------------
+ * supervise.c - Multi-process mode (--procs): a supervisor
+ *               forks the workers and restarts any that die.
+ *
+ * - each worker binds its own listening socket to the port
+ *   with SO_REUSEPORT, so the kernel spreads connections
+ *   over them and no accept lock is shared
+ * - the cache is set up, shared, before the first fork (see
+ *   cache.c); a worker forked to replace a dead one maps the
+ *   same memory, so nothing cached is lost. The supervisor
+ *   only touches it to drop what a dead worker held, before
+ *   forking its replacement
+ * - everything else that starts threads is started in each
+ *   worker after it is forked, and workers are killed if the
+ *   supervisor goes away
+ * - a worker that dies straight after starting is restarted
+ *   only after SUPERVISEBACKOFF, so one that cannot run does
+ *   not spin the supervisor
+ * - the workers and their restarts are counted in memory the
+ *   supervisor shares with them, for the status page
+ * ----------------------------------------------------------
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "metrics.h"
+#include "supervise.h"
+
+/* What the supervisor shares with its workers. */
+typedef struct superviseShared{
+	int procs;
+	long restarts;
+	pid_t pids[SUPERVISEMAX];
+} superviseShared;
+
+superviseShared *supervised;
+int superviseIndex = -1;			/* this worker's; -1 in the supervisor or without --procs */
+long superviseStarted[SUPERVISEMAX];	/* ns; when each worker was last forked */
+
+pid_t superviseFork(int i);
+
+/* Forks procs workers and, in the supervisor, restarts each one that dies, for ever. Returns only in a worker, with its index. */
+int superviseRun(int procs){
+	struct timespec ts = { SUPERVISEBACKOFF / 1000, SUPERVISEBACKOFF % 1000 * 1000000L };
+	pid_t pid;
+	int i, status;
+
+	if (MAP_FAILED == (supervised = mmap(NULL, sizeof(superviseShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0))){
+		fprintf(stderr, "Error mapping worker table.\n");
+		exit(1);
+	}
+	supervised->procs = procs;
+	for (i = 0; i < procs; i++){
+		if (0 == superviseFork(i)){
+			return i;
+		}
+	}
+
+	while(1){
+		if (0 > (pid = waitpid(-1, &status, 0))){
+			if (EINTR != errno){
+				fprintf(stderr, "Error waiting for workers.\n");
+				sleep(1);
+			}
+			continue;
+		}
+		for (i = 0; i < procs && pid != supervised->pids[i]; i++)
+			;
+		if (procs == i){
+			continue;
+		}
+		if (WIFSIGNALED(status)){
+			fprintf(stderr, "Error worker %d (pid %d) killed by signal %d; restarting it.\n", i, (int)pid, WTERMSIG(status));
+		}
+		else{
+			fprintf(stderr, "Error worker %d (pid %d) exited with status %d; restarting it.\n", i, (int)pid, WEXITSTATUS(status));
+		}
+		__atomic_add_fetch(&supervised->restarts, 1, __ATOMIC_RELAXED);
+		/* Whatever it was sending or filling would otherwise stay pinned in the cache for good. */
+		cacheReap(i);
+		if (metricNow() - superviseStarted[i] < SUPERVISEBACKOFF * 1000000L){
+			nanosleep(&ts, NULL);
+		}
+		/* A fork that fails leaves the slot empty until another worker dies; the rest keep serving. */
+		if (0 == superviseFork(i)){
+			return i;
+		}
+	}
+}
+
+/* Forks worker i. Returns 0 in the worker, and its pid (or -1) in the supervisor. */
+pid_t superviseFork(int i){
+	pid_t parent = getpid(), pid;
+
+	superviseStarted[i] = metricNow();
+	if (0 > (pid = fork())){
+		fprintf(stderr, "Error forking worker %d.\n", i);
+		supervised->pids[i] = -1;
+		return -1;
+	}
+	if (0 == pid){
+		superviseIndex = i;
+		/* Go when the supervisor does, even if it went before this was asked for. */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (parent != getppid()){
+			exit(1);
+		}
+		return 0;
+	}
+	supervised->pids[i] = pid;
+	return pid;
+}
+
+/* A socket listening on port that other processes may bind as well, the kernel spreading connections among them. Returns -1 on error. */
+int openReusePort(int port){
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	if (0 > (fd = socket(AF_INET, SOCK_STREAM, 0))){
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	if (0 > setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) || 0 > setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+		|| 0 > bind(fd, (SA *)&addr, sizeof(addr)) || 0 > listen(fd, LISTENQ)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Writes "name value" lines for the status page. */
+int superviseStats(char *buf, size_t len){
+	return snprintf(buf, len,
+		"procs_workers %d\n"
+		"procs_worker %d\n"
+		"procs_restarts %ld\n",
+		NULL == supervised ? 0 : supervised->procs,
+		superviseIndex,
+		NULL == supervised ? 0 : __atomic_load_n(&supervised->restarts, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,13 @@
+#ifndef __SUPERVISE_H__
+#define __SUPERVISE_H__
+
+#include "csapp.h"
+
+#define SUPERVISEMAX 256		/* most worker processes */
+#define SUPERVISEBACKOFF 1000	/* ms: a worker that dies sooner than this after starting is restarted only after this long */
+
+int  superviseRun(int procs);
+int  openReusePort(int port);
+int  superviseStats(char *buf, size_t len);
+
+#endif /* __SUPERVISE_H__ */
@@ -2,8 +2,25 @@
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *
+ * With -b it is instead an origin for benchmarking the proxy:
+ *     a thread per connection, HTTP/1.1 keep-alive, static files
+ *     sent with sendfile, nothing logged per request, and
+ *     synthetic responses at /synth/<anything>?<options>:
+ *         size=N       body of N bytes (default 1024)
+ *         delay=MS     wait MS milliseconds before answering
+ *         maxage=S     Cache-Control: max-age=S
+ *         cache=T      Cache-Control: T (no-store, private, ...)
+ *         etag=1       send an ETag and answer If-None-Match with 304
+ *     Each distinct uri is a distinct object to a cache, so
+ *     /synth/1?size=10240 and /synth/2?size=10240 are two.
  */
+#define _GNU_SOURCE
 #include "csapp.h"
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+
+#define BENCHCHUNK 65536        /* synthetic bodies go out this much at a time */
 
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
@@ -13,20 +30,33 @@ void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
+void bench_loop(int listenfd);
+void *bench_thread(void *vargp);
+int bench_doit(int fd, rio_t *rp);
+int bench_static(int fd, char *filename, int keep_alive);
+int bench_synth(int fd, char *uri, char *inm, int keep_alive);
+int bench_error(int fd, char *errnum, char *shortmsg, int keep_alive);
+long query_long(char *query, char *name, long dflt);
+
+char pattern[BENCHCHUNK];       /* what synthetic bodies are made of */
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd, port, clientlen;
+    int listenfd, connfd, port, clientlen, bench = 0;
     struct sockaddr_in clientaddr;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (argc == 3 && !strcmp(argv[1], "-b"))
+	bench = 1;
+    else if (argc != 2) {
+	fprintf(stderr, "usage: %s [-b] <port>\n", argv[0]);
 	exit(1);
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[argc - 1]);
    
     listenfd = Open_listenfd(port);
+    if (bench)
+	bench_loop(listenfd);
     printf("connected to a client\n");
     while (1) {
 	clientlen = sizeof(clientaddr);
@@ -238,3 +268,256 @@ void clienterror(int fd, char *cause, char *errnum,
     Rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
+
+/*
+ * bench_loop - accept connections forever, a thread for each
+ */
+/* $begin bench_loop */
+void bench_loop(int listenfd)
+{
+    int *connfdp, i;
+    socklen_t clientlen;
+    struct sockaddr_in clientaddr;
+    pthread_t tid;
+
+    /* Numbered 64-byte lines, so a body that comes back wrong shows */
+    for (i = 0; i < BENCHCHUNK; i += 64)
+	snprintf(pattern + i, 64, "%063d", i / 64);
+    for (i = 63; i < BENCHCHUNK; i += 64)
+	pattern[i] = '\n';
+
+    /* A client that goes away must not take the server with it */
+    Signal(SIGPIPE, SIG_IGN);
+    while (1) {
+	clientlen = sizeof(clientaddr);
+	connfdp = Malloc(sizeof(int));
+	if ((*connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+	    free(connfdp);
+	    continue;
+	}
+	if (pthread_create(&tid, NULL, bench_thread, connfdp) != 0) {
+	    close(*connfdp);
+	    free(connfdp);
+	}
+    }
+}
+/* $end bench_loop */
+
+/*
+ * bench_thread - answer requests on one connection until it closes
+ */
+/* $begin bench_thread */
+void *bench_thread(void *vargp)
+{
+    int fd = *((int *)vargp), one = 1;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    free(vargp);
+    /* Heads are sent ahead of their bodies; Nagle would hold the tails */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_readinitb(&rio, fd);
+    while (bench_doit(fd, &rio))
+	;
+    close(fd);
+    return NULL;
+}
+/* $end bench_thread */
+
+/*
+ * bench_doit - answer one request; return 1 if the connection
+ *              can carry another
+ */
+/* $begin bench_doit */
+int bench_doit(int fd, rio_t *rp)
+{
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE + 16], inm[MAXLINE], *p;
+    int keep_alive, n;
+
+    /* Unlike doit, a bad or vanished client ends the connection, not the server */
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	return 0;
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+	return 0;
+    keep_alive = !strcmp(version, "HTTP/1.1");
+    inm[0] = '\0';
+    while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")) {
+	if (!strncasecmp(buf, "Connection:", 11)) {
+	    if (strcasestr(buf + 11, "close"))
+		keep_alive = 0;
+	    else if (strcasestr(buf + 11, "keep-alive"))
+		keep_alive = 1;
+	}
+	else if (!strncasecmp(buf, "If-None-Match:", 14))
+	    sscanf(buf + 14, " %[^\r\n]", inm);
+    }
+    if (n <= 0)
+	return 0;
+
+    if (strcasecmp(method, "GET"))
+	return bench_error(fd, "501", "Not Implemented", keep_alive);
+    if (!strncmp(uri, "/synth/", 7))
+	return bench_synth(fd, uri, inm, keep_alive);
+
+    /* Static content; query strings are ignored */
+    if ((p = index(uri, '?')))
+	*p = '\0';
+    if (strstr(uri, ".."))
+	return bench_error(fd, "403", "Forbidden", keep_alive);
+    snprintf(filename, sizeof(filename), ".%s%s", uri,
+	     uri[strlen(uri)-1] == '/' ? "home.html" : "");
+    return bench_static(fd, filename, keep_alive);
+}
+/* $end bench_doit */
+
+/*
+ * bench_static - send a file, its body straight from the page cache
+ */
+/* $begin bench_static */
+int bench_static(int fd, char *filename, int keep_alive)
+{
+    int srcfd, n;
+    struct stat sbuf;
+    char filetype[MAXLINE], buf[MAXLINE];
+    off_t off = 0;
+    ssize_t sent;
+
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
+	return bench_error(fd, "404", "Not found", keep_alive);
+    if (fstat(srcfd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+	close(srcfd);
+	return bench_error(fd, "403", "Forbidden", keep_alive);
+    }
+
+    get_filetype(filename, filetype);
+    n = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+		 "Server: Tiny Web Server\r\n"
+		 "Content-length: %lld\r\n"
+		 "Content-type: %s\r\n"
+		 "Connection: %s\r\n\r\n",
+		 (long long)sbuf.st_size, filetype, keep_alive ? "keep-alive" : "close");
+    /* MSG_MORE lets the head share a segment with the start of the body */
+    if (send(fd, buf, n, MSG_MORE) != n) {
+	close(srcfd);
+	return 0;
+    }
+    while (off < sbuf.st_size) {
+	if ((sent = sendfile(fd, srcfd, &off, sbuf.st_size - off)) <= 0) {
+	    if (sent < 0 && errno == EINTR)
+		continue;
+	    close(srcfd);
+	    return 0;
+	}
+    }
+    close(srcfd);
+    return keep_alive;
+}
+/* $end bench_static */
+
+/*
+ * bench_synth - send a synthetic response shaped by uri's query
+ */
+/* $begin bench_synth */
+int bench_synth(int fd, char *uri, char *inm, int keep_alive)
+{
+    char buf[MAXLINE], cc[MAXLINE], etag[MAXLINE], *query, *p;
+    long size, delay, maxage, chunk;
+    unsigned long hash = 5381;
+    int n;
+
+    query = (query = index(uri, '?')) ? query + 1 : "";
+    size = query_long(query, "size", 1024);
+    delay = query_long(query, "delay", 0);
+    maxage = query_long(query, "maxage", -1);
+    if (size < 0)
+	return bench_error(fd, "400", "Bad Request", keep_alive);
+
+    /* Cache-Control from maxage and cache, either, both or neither */
+    cc[0] = '\0';
+    if (maxage >= 0)
+	snprintf(cc, sizeof(cc), "max-age=%ld", maxage);
+    if ((p = strstr(query, "cache=")) && (p == query || p[-1] == '&'))
+	snprintf(cc + strlen(cc), sizeof(cc) - strlen(cc), "%s%.*s",
+		 cc[0] ? ", " : "", (int)strcspn(p + 6, "&"), p + 6);
+
+    /* The ETag names the uri, so each object has its own */
+    etag[0] = '\0';
+    if (query_long(query, "etag", 0)) {
+	for (p = uri; *p; p++)
+	    hash = hash * 33 + (unsigned char)*p;
+	snprintf(etag, sizeof(etag), "\"%lx\"", hash);
+    }
+
+    if (delay > 0)
+	usleep(delay * 1000);
+
+    if (etag[0] && inm[0] && strstr(inm, etag)) {
+	n = snprintf(buf, sizeof(buf), "HTTP/1.1 304 Not Modified\r\n"
+		     "Server: Tiny Web Server\r\n"
+		     "ETag: %s\r\n"
+		     "%s%s%s"
+		     "Connection: %s\r\n\r\n",
+		     etag, cc[0] ? "Cache-Control: " : "", cc, cc[0] ? "\r\n" : "",
+		     keep_alive ? "keep-alive" : "close");
+	return rio_writen(fd, buf, n) == n && keep_alive;
+    }
+
+    n = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+		 "Server: Tiny Web Server\r\n"
+		 "Content-length: %ld\r\n"
+		 "Content-type: text/plain\r\n"
+		 "%s%s%s"
+		 "%s%s%s"
+		 "Connection: %s\r\n\r\n",
+		 size,
+		 cc[0] ? "Cache-Control: " : "", cc, cc[0] ? "\r\n" : "",
+		 etag[0] ? "ETag: " : "", etag, etag[0] ? "\r\n" : "",
+		 keep_alive ? "keep-alive" : "close");
+    if (send(fd, buf, n, MSG_MORE) != n)
+	return 0;
+    for (; size > 0; size -= chunk) {
+	chunk = size < BENCHCHUNK ? size : BENCHCHUNK;
+	if (rio_writen(fd, pattern, chunk) != chunk)
+	    return 0;
+    }
+    return keep_alive;
+}
+/* $end bench_synth */
+
+/*
+ * bench_error - send a short error response that keeps the connection
+ */
+/* $begin bench_error */
+int bench_error(int fd, char *errnum, char *shortmsg, int keep_alive)
+{
+    char buf[MAXLINE];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "HTTP/1.1 %s %s\r\n"
+		 "Server: Tiny Web Server\r\n"
+		 "Content-length: %d\r\n"
+		 "Content-type: text/plain\r\n"
+		 "Connection: %s\r\n\r\n%s: %s\n",
+		 errnum, shortmsg, (int)(strlen(errnum) + strlen(shortmsg) + 3),
+		 keep_alive ? "keep-alive" : "close", errnum, shortmsg);
+    return rio_writen(fd, buf, n) == n && keep_alive;
+}
+/* $end bench_error */
+
+/*
+ * query_long - the number given as name=N in query, or dflt
+ */
+/* $begin query_long */
+long query_long(char *query, char *name, long dflt)
+{
+    size_t len = strlen(name);
+    char *p;
+
+    for (p = query; *p; p += strcspn(p, "&"), p += *p == '&') {
+	if (!strncmp(p, name, len) && (p[len] == '=' || p[len] == '&' || !p[len]))
+	    return p[len] == '=' ? strtol(p + len + 1, NULL, 10) : 1;
+    }
+    return dflt;
+}
+/* $end query_long */
@@ -0,0 +1,172 @@
+/*
+ * ----------------------------------------------------------
+ * tracereplay.c - Replays a recorded url log against each
+ *                 cache policy and reports its hit ratio.
+ *
+ * - the trace has one request per line: a url, optionally
+ *   followed by the response size in bytes (-s otherwise);
+ *   blank lines and lines starting with # are skipped
+ * - every request is a cacheGet, and every miss on an object
+ *   no larger than the largest cacheable one is inserted,
+ *   as proxy does
+ * - each policy, with and without TinyLFU admission, runs in
+ *   a child process of its own against a fresh cache sized
+ *   like proxy's (-b, -l, -m), so runs do not share state
+ * - reports the request and byte hit ratios and how fast the
+ *   replay went
+ *
+ * usage: tracereplay [-b bytes] [-l lines] [-m max-object]
+ *                    [-s size] [-p policy] <trace>
+ * ----------------------------------------------------------
+ */
+
+#include <sys/wait.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "policy.h"
+
+typedef struct request{
+	char *url;
+	size_t size;
+} request;
+
+request *trace;
+long requests;
+
+void usage(char *name);
+void loadTrace(char *path, size_t defaultSize);
+void replay(cachePolicy *policy, int admission, size_t maxBytes, int maxLines, long maxObject);
+double now();
+
+int main(int argc, char **argv)
+{
+	long long maxBytes = MAXCACHE, maxObject = MAXOBJ, size = 10240;
+	int maxLines = NUMLINES, admission, opt;
+	char *only = NULL;
+	char *names[] = {"clock", "lru", "sieve", "s3fifo", NULL};
+	char **name;
+	pid_t pid;
+
+	while (-1 != (opt = getopt(argc, argv, "b:l:m:s:p:"))){
+		switch (opt){
+		case 'b':
+			maxBytes = parseSize(optarg);
+			break;
+		case 'l':
+			maxLines = atoi(optarg);
+			break;
+		case 'm':
+			maxObject = parseSize(optarg);
+			break;
+		case 's':
+			size = parseSize(optarg);
+			break;
+		case 'p':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (1 != argc - optind || 0 >= maxBytes || 0 >= maxLines || 0 >= maxObject || maxBytes < maxObject || 0 > size
+		|| (NULL != only && NULL == policyFind(only))){
+		usage(argv[0]);
+	}
+
+	loadTrace(argv[optind], size);
+	printf("%ld requests, %lld byte cache in %d lines, objects up to %lld bytes\n", requests, maxBytes, maxLines, maxObject);
+	printf("%-8s %-9s %9s %9s %12s\n", "policy", "admission", "hits", "bytes", "requests/s");
+	for (name = names; NULL != *name; name++){
+		if (NULL != only && 0 != strcmp(only, *name)){
+			continue;
+		}
+		for (admission = FALSE; admission <= TRUE; admission++){
+			fflush(stdout);
+			if (0 == (pid = Fork())){
+				replay(policyFind(*name), admission, maxBytes, maxLines, maxObject);
+				exit(EXIT_SUCCESS);
+			}
+			Waitpid(pid, NULL, 0);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+
+void usage(char *name){
+	fprintf(stderr, "usage: %s [-b bytes] [-l lines] [-m max-object] [-s size] [-p policy] <trace>\n", name);
+	fprintf(stderr, "  -b N[KMG]  cache budget (default: %d)\n", MAXCACHE);
+	fprintf(stderr, "  -l N       most objects cached (default: %d)\n", NUMLINES);
+	fprintf(stderr, "  -m N[KMG]  largest object cached (default: %d)\n", MAXOBJ);
+	fprintf(stderr, "  -s N[KMG]  size of requests the trace gives none for (default: 10K)\n");
+	fprintf(stderr, "  -p P       only replay policy P: %s\n", POLICYNAMES);
+	fprintf(stderr, "Each trace line is a url, optionally followed by its size in bytes.\n");
+	exit(EXIT_SUCCESS);
+}
+
+/* Reads every request in path into trace. */
+void loadTrace(char *path, size_t defaultSize){
+	char line[MAXLINE], url[MAXLINE];
+	long cap = 1024;
+	long long size;
+	FILE *fp;
+	int n;
+
+	if (NULL == (fp = fopen(path, "r"))){
+		fprintf(stderr, "Error opening trace %s.\n", path);
+		exit(1);
+	}
+	trace = Malloc(cap * sizeof(request));
+	while (NULL != fgets(line, sizeof(line), fp)){
+		if (0 >= (n = sscanf(line, "%s %lld", url, &size)) || '#' == url[0]){
+			continue;
+		}
+		if (requests == cap){
+			cap *= 2;
+			if (NULL == (trace = realloc(trace, cap * sizeof(request)))){
+				fprintf(stderr, "Error allocating memory for the trace.\n");
+				exit(1);
+			}
+		}
+		trace[requests].url = strdup(url);
+		trace[requests].size = 2 == n && 0 <= size ? size : defaultSize;
+		requests++;
+	}
+	fclose(fp);
+	if (0 == requests){
+		fprintf(stderr, "Error trace %s has no requests.\n", path);
+		exit(1);
+	}
+}
+
+/* Runs the whole trace through a fresh cache with policy and prints one line of results. */
+void replay(cachePolicy *policy, int admission, size_t maxBytes, int maxLines, long maxObject){
+	long i, hits = 0;
+	double bytes = 0, bytesHit = 0, start;
+	cacheObj *obj;
+
+	initCache(NULL, maxBytes, maxLines, maxObject, policy, admission, 0);
+	start = now();
+	for (i = 0; i < requests; i++){
+		bytes += trace[i].size;
+		if (NULL != (obj = cacheGet(trace[i].url))){
+			hits++;
+			bytesHit += trace[i].size;
+			cacheRelease(obj);
+		}
+		else if ((long)trace[i].size <= maxObject && NULL != (obj = cacheReserve(trace[i].url, trace[i].size))){
+			memset(obj->data, 0, obj->size);
+			cacheCommit(obj);
+		}
+	}
+	printf("%-8s %-9s %8.2f%% %8.2f%% %12.0f\n", policy->name, admission ? "tinylfu" : "none",
+		100.0 * hits / requests, 0 < bytes ? 100.0 * bytesHit / bytes : 0, requests / (now() - start));
+}
+
+/* Seconds on the monotonic clock. */
+double now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
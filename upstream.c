@@ -0,0 +1,231 @@
+/*
+ * ----------------------------------------------------------
+ * upstream.c - Pool of idle persistent origin connections.
+ *
+ * - idle connections are kept per (host, port) in a small
+ *   hash table, most recently used first
+ * - a connection is reused only if the origin has not
+ *   closed it and it has been idle less than idleTimeout
+ * - at most maxPerHost idle connections are kept per origin
+ *   and maxIdle overall; anything beyond that is closed
+ * - a request that fails on a reused connection before any
+ *   response arrives may be retried on a fresh one
+ * - a connect is bounded by --connect-timeout (see
+ *   deadline.c); a connection is released from the calling
+ *   thread's deadline as it is pooled or closed
+ * ----------------------------------------------------------
+ */
+
+#include "csapp.h"
+#include "proxy.h"
+#include "upstream.h"
+#include "resolver.h"
+#include "deadline.h"
+
+#define POOLBUCKETS 256
+
+upstream *idlePool[POOLBUCKETS];
+int idleCount = 0;
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+int poolMaxPerHost = 8;
+int poolMaxIdle = 256;
+int poolIdleTimeout = 30;
+int poolRetries = 1;
+
+/* Counters for the status page. */
+long statRequests;
+long statReused;
+long statOpened;
+long statRetries;
+long statDiscarded;
+
+unsigned int poolBucket(char *host, int port);
+int  upstreamAlive(upstream *up);
+upstream *upstreamOpen(char *host, int port);
+
+/* Sets the pool limits. A maxPerHost of 0 turns pooling off. */
+void upstreamInit(int maxPerHost, int maxIdle, int idleTimeout, int retries){
+	poolMaxPerHost = maxPerHost;
+	poolMaxIdle = maxIdle;
+	poolIdleTimeout = idleTimeout;
+	poolRetries = retries;
+}
+
+/* Returns an idle pooled connection to host:port, or opens a new one. Returns NULL on error. */
+upstream *upstreamGet(char *host, int port){
+	upstream **p, *up;
+	unsigned int bucket = poolBucket(host, port);
+
+	__atomic_add_fetch(&statRequests, 1, __ATOMIC_RELAXED);
+	while(1){
+		pthread_mutex_lock(&poolLock);
+		for (p = &idlePool[bucket]; NULL != (up = *p); p = &up->next){
+			if (port == up->port && 0 == strcasecmp(host, up->host)){
+				*p = up->next;
+				idleCount--;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&poolLock);
+
+		if (NULL == up){
+			return upstreamOpen(host, port);
+		}
+		if (upstreamAlive(up)){
+			__atomic_add_fetch(&statReused, 1, __ATOMIC_RELAXED);
+			return up;
+		}
+		__atomic_add_fetch(&statDiscarded, 1, __ATOMIC_RELAXED);
+		upstreamClose(up);
+	}
+}
+
+/* Returns a connection whose last response was read completely to the pool, or closes it. */
+void upstreamPut(upstream *up){
+	upstream **p, *old;
+	unsigned int bucket = poolBucket(up->host, up->port);
+	time_t now = time(NULL);
+	int sameHost = 0;
+
+	/* Pooled, it is no longer the caller's to watch. */
+	deadlineRelease(deadlineMine, up->fd);
+	up->uses++;
+	/* Bytes beyond the response mean the stream is out of step; never reuse it. */
+	if (0 >= poolMaxPerHost || 0 != up->rio.rio_cnt){
+		upstreamClose(up);
+		return;
+	}
+
+	pthread_mutex_lock(&poolLock);
+	for (p = &idlePool[bucket]; NULL != (old = *p); ){
+		if (now - old->idleSince > poolIdleTimeout){
+			*p = old->next;
+			idleCount--;
+			__atomic_add_fetch(&statDiscarded, 1, __ATOMIC_RELAXED);
+			close(old->fd);
+			free(old->host);
+			free(old);
+			continue;
+		}
+		if (up->port == old->port && 0 == strcasecmp(up->host, old->host)){
+			sameHost++;
+		}
+		p = &old->next;
+	}
+
+	if (sameHost >= poolMaxPerHost || idleCount >= poolMaxIdle){
+		pthread_mutex_unlock(&poolLock);
+		upstreamClose(up);
+		return;
+	}
+	up->idleSince = now;
+	up->next = idlePool[bucket];
+	idlePool[bucket] = up;
+	idleCount++;
+	pthread_mutex_unlock(&poolLock);
+}
+
+/* Closes a connection that will not be reused. */
+void upstreamClose(upstream *up){
+	deadlineRelease(deadlineMine, up->fd);
+	close(up->fd);
+	free(up->host);
+	free(up);
+}
+
+/* After a failure on up, TRUE if the request may be tried again on a fresh connection. */
+int upstreamRetry(upstream *up, int attempt){
+	if (0 == up->uses || attempt >= poolRetries){
+		return FALSE;
+	}
+	__atomic_add_fetch(&statRetries, 1, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+/* Writes the pool counters to buf, one "name value" per line. Returns the length written. */
+int upstreamStats(char *buf, size_t len){
+	long requests = __atomic_load_n(&statRequests, __ATOMIC_RELAXED);
+	long reused = __atomic_load_n(&statReused, __ATOMIC_RELAXED);
+
+	return snprintf(buf, len,
+		"upstream_requests %ld\n"
+		"upstream_reused %ld\n"
+		"upstream_opened %ld\n"
+		"upstream_retries %ld\n"
+		"upstream_discarded %ld\n"
+		"upstream_idle %d\n"
+		"upstream_hit_rate %.3f\n",
+		requests, reused,
+		__atomic_load_n(&statOpened, __ATOMIC_RELAXED),
+		__atomic_load_n(&statRetries, __ATOMIC_RELAXED),
+		__atomic_load_n(&statDiscarded, __ATOMIC_RELAXED),
+		idleCount,
+		requests ? (double)reused / requests : 0.0);
+}
+
+/* Hash of host and port selecting an idle pool bucket. */
+unsigned int poolBucket(char *host, int port){
+	unsigned int hash = 2166136261U ^ port;
+
+	while (*host){
+		hash ^= (unsigned char)tolower(*host++);
+		hash *= 16777619U;
+	}
+	return hash % POOLBUCKETS;
+}
+
+/* TRUE if up has not timed out and the origin has neither closed it nor sent anything unsolicited. */
+int upstreamAlive(upstream *up){
+	char c;
+
+	if (time(NULL) - up->idleSince > poolIdleTimeout){
+		return FALSE;
+	}
+	return 0 > recv(up->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) && (EAGAIN == errno || EWOULDBLOCK == errno);
+}
+
+/* Opens a new connection to host:port, resolving host through the resolver cache. */
+upstream *upstreamOpen(char *host, int port){
+	struct sockaddr_in addr;
+	upstream *up;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+    /* Ignores the request if there is an error. A lookup that has to be queried waits no longer than the connect may. */
+	if (0 > resolveHost(host, &addr.sin_addr, deadlineLimit(deadlineMine, DEADLINE_CONNECT))){
+		fprintf(stderr, "DNS error\n");
+		return NULL;
+	}
+	if (0 > (fd = socket(AF_INET, SOCK_STREAM, 0))){
+		fprintf(stderr, "Unix error\n");
+		return NULL;
+	}
+	/* An origin that never answers the SYN would otherwise hold the caller for the kernel's minutes of retries. */
+	deadlineArm(deadlineMine, DEADLINE_CONNECT, fd, -1);
+	if (0 > connect(fd, (SA *)&addr, sizeof(addr))){
+		fprintf(stderr, "Unix error\n");
+		deadlineCancel(deadlineMine);
+		close(fd);
+		return NULL;
+	}
+	deadlineCancel(deadlineMine);
+
+	if (NULL == (up = malloc(sizeof(upstream))) || NULL == (up->host = strdup(host))){
+		fprintf(stderr, "Error allocating memory for upstream connection.\n");
+		free(up);
+		close(fd);
+		return NULL;
+	}
+	__atomic_add_fetch(&statOpened, 1, __ATOMIC_RELAXED);
+	up->fd = fd;
+	up->port = port;
+	up->uses = 0;
+	up->idleSince = time(NULL);
+	up->next = NULL;
+	rio_readinitb(&up->rio, fd);
+	return up;
+}
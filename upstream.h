@@ -0,0 +1,24 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* A persistent connection to an origin, with its buffered reader. */
+typedef struct upstream{
+	int fd;
+	int port;
+	long uses;			/* responses completed on this connection */
+	time_t idleSince;
+	struct upstream *next;
+	char *host;
+	rio_t rio;
+} upstream;
+
+void upstreamInit(int maxPerHost, int maxIdle, int idleTimeout, int retries);
+upstream *upstreamGet(char *host, int port);
+void upstreamPut(upstream *up);
+void upstreamClose(upstream *up);
+int  upstreamRetry(upstream *up, int attempt);
+int  upstreamStats(char *buf, size_t len);
+
+#endif /* __UPSTREAM_H__ */